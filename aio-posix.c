@@ -17,6 +17,13 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+/* First busy polling time after a run of waits that were short enough */
+#define AIO_POLL_NS_START 4000
+
+typedef bool (AioPollHandler)(void *opaque);
 
 struct AioHandler
 {
@@ -24,6 +31,7 @@ struct AioHandler
     IOHandler *io_read;
     IOHandler *io_write;
     AioFlushHandler *io_flush;
+    AioPollHandler *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -82,6 +90,9 @@ void aio_set_fd_handler(AioContext *ctx,
             g_source_add_poll(&ctx->source, &node->pfd);
         }
         /* Update handler with latest information */
+        if (node->io_read != io_read) {
+            node->io_poll = NULL;
+        }
         node->io_read = io_read;
         node->io_write = io_write;
         node->io_flush = io_flush;
@@ -105,6 +116,19 @@ void aio_set_event_notifier(AioContext *ctx,
                        (AioFlushHandler *)io_flush, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    assert(node || !io_poll);
+    if (node) {
+        node->io_poll = (AioPollHandler *)io_poll;
+    }
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -169,11 +193,60 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+/* Calls the poll handlers of the busy nodes until one of them makes progress
+ * or ctx->poll_ns has passed.  Events that arrive from other threads in the
+ * meantime, such as aio_notify(), are only seen when the polling ends.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t start)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    ctx->walking_handlers++;
+    do {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->io_poll && node->pollfds_idx != -1 &&
+                node->io_poll(node->opaque)) {
+                progress = true;
+            }
+        }
+    } while (!progress && get_clock() - start < ctx->poll_ns);
+    ctx->walking_handlers--;
+
+    return progress;
+}
+
+/* Adapts the polling time to a wait that took block_ns, polling included */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* polling found the event, leave it as it is */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* the wait was too long to poll for, poll less */
+        ctx->poll_ns /= 2;
+        if (ctx->poll_ns < AIO_POLL_NS_START) {
+            ctx->poll_ns = 0;
+        }
+    } else {
+        /* polling a little longer would have found it */
+        ctx->poll_ns = MAX(ctx->poll_ns * 2, AIO_POLL_NS_START);
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+    }
+
+    if (ctx->poll_ns != old) {
+        trace_aio_poll_adjust(ctx, old, ctx->poll_ns, block_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
     bool busy, progress;
+    int64_t start = 0, wait_start = 0, now;
 
     progress = false;
 
@@ -231,11 +304,37 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return progress;
     }
 
+    if (blocking && ctx->poll_max_ns) {
+        start = get_clock();
+        if (ctx->poll_ns) {
+            if (run_poll_handlers(ctx, start)) {
+                ctx->poll_hits++;
+                progress = true;
+                blocking = false;
+            } else {
+                ctx->poll_misses++;
+            }
+        }
+    }
+
     /* wait until next event */
+    if (blocking) {
+        wait_start = get_clock();
+    }
     ret = g_poll((GPollFD *)ctx->pollfds->data,
                  ctx->pollfds->len,
                  blocking ? -1 : 0);
 
+    if (start || wait_start) {
+        now = get_clock();
+        if (wait_start) {
+            ctx->idle_ns += now - wait_start;
+        }
+        if (start) {
+            adjust_poll_ns(ctx, now - start);
+        }
+    }
+
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         QLIST_FOREACH(node, &ctx->aio_handlers, node) {
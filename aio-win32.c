@@ -19,6 +19,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -79,6 +80,13 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *e,
+                                 AioPollEventNotifierHandler *io_poll)
+{
+    /* busy polling is only implemented in aio-posix.c */
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -175,8 +183,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
     /* wait until next event */
     while (count > 0) {
         int timeout = blocking ? INFINITE : 0;
+        int64_t wait_start = blocking ? get_clock() : 0;
         int ret = WaitForMultipleObjects(count, events, FALSE, timeout);
 
+        if (wait_start) {
+            ctx->idle_ns += get_clock() - wait_start;
+        }
+
         /* if we have any signaled events, dispatch event */
         if ((DWORD) (ret - WAIT_OBJECT_0) >= count) {
             break;
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -44,11 +45,14 @@
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/config-file.h"
+#include "qemu/sockets.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
 #include "hw/acpi/acpi.h"
+#include "hw/xen/xen.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -104,8 +108,7 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
-static int dirty_rate_high_cnt;
+static int mig_throttle_pct;
 static void check_guest_throttling(void);
 
 /***********************************************************/
@@ -119,6 +122,20 @@ static void check_guest_throttling(void);
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* followed by one of the RAM_CMD_* commands below */
+#define RAM_SAVE_FLAG_COMMAND          0x200
+
+/* the source wants to switch to post-copy later on */
+#define RAM_CMD_POSTCOPY_ADVISE        1
+/* ranges still dirty at the switch; the destination drops its copy */
+#define RAM_CMD_POSTCOPY_DISCARD       2
+/* every page queued on the extra channels so far must be loaded first */
+#define RAM_CMD_CHANNEL_SYNC           3
+/* be32 number of connections, the destination waits for the extra ones */
+#define RAM_CMD_CHANNELS               4
+/* file: migration, where each RAM block was written in the file */
+#define RAM_CMD_FILE_MAP               5
 
 
 static struct defconfig_file {
@@ -152,8 +169,7 @@ int qemu_read_default_config_files(bool userconfig)
 
 static inline bool is_zero_page(uint8_t *p)
 {
-    return buffer_find_nonzero_offset(p, TARGET_PAGE_SIZE) ==
-        TARGET_PAGE_SIZE;
+    return buffer_is_zero(p, TARGET_PAGE_SIZE);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -165,8 +181,10 @@ static struct {
     uint8_t *current_buf;
     /* buffer used for XBZRLE decoding */
     uint8_t *decoded_buf;
-    /* Cache for XBZRLE */
+    /* Cache for XBZRLE, only used by the migration thread */
     PageCache *cache;
+    /* new cache size in pages requested from the monitor, 0 if none */
+    int64_t resize_pages;
 } XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
@@ -178,12 +196,22 @@ static struct {
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
     if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
-            TARGET_PAGE_SIZE;
+        /* the migration thread picks this up before its next iteration */
+        atomic_mb_set(&XBZRLE.resize_pages, new_size / TARGET_PAGE_SIZE);
+        return pow2floor(new_size / TARGET_PAGE_SIZE) * TARGET_PAGE_SIZE;
     }
     return pow2floor(new_size);
 }
 
+static void xbzrle_cache_apply_resize(void)
+{
+    int64_t new_pages = atomic_xchg(&XBZRLE.resize_pages, 0);
+
+    if (new_pages > 0 && XBZRLE.cache) {
+        cache_resize(XBZRLE.cache, new_pages);
+    }
+}
+
 /* accounting for migration statistics */
 typedef struct AccountingInfo {
     uint64_t dup_pages;
@@ -193,7 +221,12 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t compress_busy;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -248,11 +281,53 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
+double xbzrle_mig_cache_hit_rate(void)
+{
+    uint64_t lookups = acct_info.xbzrle_cache_hit +
+                       acct_info.xbzrle_cache_miss;
+
+    return lookups ? (double)acct_info.xbzrle_cache_hit / lookups : 0;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_busy(void)
+{
+    return acct_info.compress_busy;
+}
+
+double compress_mig_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)(acct_info.compress_pages * TARGET_PAGE_SIZE) /
+           acct_info.compress_bytes;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -280,12 +355,14 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
-        if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr, current_data);
+        if (!last_stage &&
+            cache_insert(XBZRLE.cache, current_addr, current_data)) {
+            acct_info.xbzrle_cache_evictions++;
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -324,6 +401,695 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     return bytes_sent;
 }
 
+/* Page codec used by the compress capability.  Each compression and
+ * decompression thread owns a private codec context, so the callbacks
+ * need not be thread safe.  compress/decompress return the number of
+ * bytes written to dst, or -1 on failure.
+ */
+typedef struct PageCodec {
+    const char *name;
+    void *(*init)(int level, bool compress);
+    void (*cleanup)(void *ctx, bool compress);
+    int (*bound)(int slen);
+    int (*compress)(void *ctx, uint8_t *dst, int dlen,
+                    const uint8_t *src, int slen);
+    int (*decompress)(void *ctx, uint8_t *dst, int dlen,
+                      const uint8_t *src, int slen);
+} PageCodec;
+
+static void *zlib_codec_init(int level, bool compress)
+{
+    z_stream *stream = g_new0(z_stream, 1);
+    int ret;
+
+    ret = compress ? deflateInit(stream, level) : inflateInit(stream);
+    if (ret != Z_OK) {
+        g_free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static void zlib_codec_cleanup(void *ctx, bool compress)
+{
+    z_stream *stream = ctx;
+
+    if (compress) {
+        deflateEnd(stream);
+    } else {
+        inflateEnd(stream);
+    }
+    g_free(stream);
+}
+
+static int zlib_codec_bound(int slen)
+{
+    return compressBound(slen);
+}
+
+static int zlib_codec_compress(void *ctx, uint8_t *dst, int dlen,
+                               const uint8_t *src, int slen)
+{
+    z_stream *stream = ctx;
+
+    if (deflateReset(stream) != Z_OK) {
+        return -1;
+    }
+    stream->next_in = (uint8_t *)src;
+    stream->avail_in = slen;
+    stream->next_out = dst;
+    stream->avail_out = dlen;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - stream->avail_out;
+}
+
+static int zlib_codec_decompress(void *ctx, uint8_t *dst, int dlen,
+                                 const uint8_t *src, int slen)
+{
+    z_stream *stream = ctx;
+
+    if (inflateReset(stream) != Z_OK) {
+        return -1;
+    }
+    stream->next_in = (uint8_t *)src;
+    stream->avail_in = slen;
+    stream->next_out = dst;
+    stream->avail_out = dlen;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - stream->avail_out;
+}
+
+static const PageCodec zlib_page_codec = {
+    .name       = "zlib",
+    .init       = zlib_codec_init,
+    .cleanup    = zlib_codec_cleanup,
+    .bound      = zlib_codec_bound,
+    .compress   = zlib_codec_compress,
+    .decompress = zlib_codec_decompress,
+};
+
+static const PageCodec *page_codec = &zlib_page_codec;
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* protected by comp_done_lock */
+    bool done;
+    /* output is waiting to be written into the migration stream */
+    bool pending;
+    void *ctx;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int cont;
+    uint8_t *page;
+    /* the guest can write the page while it is compressed, so the codec
+     * works on a private copy; zlib output is not valid otherwise */
+    uint8_t *origbuf;
+    uint8_t *buf;
+    int len;
+} CompressParam;
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    /* protected by decomp_done_lock */
+    bool done;
+    void *ctx;
+    void *host;
+    uint8_t *compbuf;
+    int len;
+} DecompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+/* slot that receives the next page; slots are used round robin so that
+ * the oldest outstanding output is always the one in the next slot */
+static int comp_next;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static int decomp_next;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static bool decomp_error;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            memcpy(param->origbuf, param->page, TARGET_PAGE_SIZE);
+            param->len = page_codec->compress(param->ctx, param->buf,
+                                              page_codec->bound(
+                                                  TARGET_PAGE_SIZE),
+                                              param->origbuf,
+                                              TARGET_PAGE_SIZE);
+
+            qemu_mutex_lock(&comp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&comp_done_cond);
+            qemu_mutex_unlock(&comp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int compress_threads_save_setup(void)
+{
+    int i;
+
+    comp_thread_count = migrate_compress_threads();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    comp_next = 0;
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        param->ctx = page_codec->init(migrate_compress_level(), true);
+        if (!param->ctx) {
+            DPRINTF("Error creating %s compression context\n",
+                    page_codec->name);
+            comp_thread_count = i;
+            return -1;
+        }
+        param->origbuf = g_malloc(TARGET_PAGE_SIZE);
+        param->buf = g_malloc(page_codec->bound(TARGET_PAGE_SIZE));
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_compress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+static void compress_threads_save_cleanup(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        page_codec->cleanup(param->ctx, true);
+        g_free(param->origbuf);
+        g_free(param->buf);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(comp_param);
+    comp_param = NULL;
+    comp_thread_count = 0;
+}
+
+static void wait_for_compress_slot(CompressParam *param)
+{
+    qemu_mutex_lock(&comp_done_lock);
+    if (!param->done) {
+        acct_info.compress_busy++;
+        while (!param->done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+}
+
+/* Write the output of a finished slot into the stream */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent;
+
+    if (!param->pending) {
+        return 0;
+    }
+    param->pending = false;
+
+    if (param->len < 0) {
+        /* the codec gave up on this page, send the copy it worked on */
+        bytes_sent = save_block_hdr(f, param->block, param->offset,
+                                    param->cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->origbuf, TARGET_PAGE_SIZE);
+        acct_info.norm_pages++;
+        return bytes_sent + TARGET_PAGE_SIZE;
+    }
+
+    bytes_sent = save_block_hdr(f, param->block, param->offset, param->cont,
+                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, param->len);
+    qemu_put_buffer(f, param->buf, param->len);
+    acct_info.compress_pages++;
+    acct_info.compress_bytes += param->len;
+
+    return bytes_sent + 4 + param->len;
+}
+
+/* Wait for every outstanding page and write them out in submission order */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param =
+            &comp_param[(comp_next + i) % comp_thread_count];
+
+        wait_for_compress_slot(param);
+        bytes_sent += flush_compressed_page(f, param);
+    }
+    return bytes_sent;
+}
+
+/*
+ * compress_page_with_multi_thread: queue a page for compression
+ *
+ * The slot is reused only after its previous output has been written,
+ * so pages reach the stream in the order they were queued.
+ *
+ * Returns: The number of bytes written to the stream by this call,
+ *          which belong to an earlier page.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset, int cont,
+                                           uint8_t *p)
+{
+    CompressParam *param = &comp_param[comp_next];
+    int bytes_sent;
+
+    comp_next = (comp_next + 1) % comp_thread_count;
+
+    wait_for_compress_slot(param);
+    bytes_sent = flush_compressed_page(f, param);
+
+    param->block = block;
+    param->offset = offset;
+    param->cont = cont;
+    param->page = p;
+    param->pending = true;
+    param->done = false;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            int ret;
+
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            ret = page_codec->decompress(param->ctx, param->host,
+                                         TARGET_PAGE_SIZE, param->compbuf,
+                                         param->len);
+
+            qemu_mutex_lock(&decomp_done_lock);
+            if (ret != TARGET_PAGE_SIZE) {
+                decomp_error = true;
+            }
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int decompress_threads_load_setup(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    decomp_next = 0;
+    decomp_error = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        param->ctx = page_codec->init(0, false);
+        if (!param->ctx) {
+            fprintf(stderr, "Failed to create %s decompression context\n",
+                    page_codec->name);
+            decomp_thread_count = i;
+            migrate_decompress_threads_join();
+            return -1;
+        }
+        param->compbuf = g_malloc(page_codec->bound(TARGET_PAGE_SIZE));
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        page_codec->cleanup(param->ctx, false);
+        g_free(param->compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_param);
+    decomp_param = NULL;
+    decomp_thread_count = 0;
+}
+
+static int decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                              int len)
+{
+    DecompressParam *param;
+
+    if (!decomp_param && decompress_threads_load_setup() < 0) {
+        return -1;
+    }
+
+    param = &decomp_param[decomp_next];
+    decomp_next = (decomp_next + 1) % decomp_thread_count;
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param->done) {
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+    param->done = false;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->compbuf, len);
+    param->host = host;
+    param->len = len;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+    return 0;
+}
+
+/* Returns -1 if any page queued since the last call failed to decode */
+static int wait_for_decompress_done(void)
+{
+    int i, ret;
+
+    if (!decomp_param) {
+        return 0;
+    }
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_thread_count; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    ret = decomp_error ? -1 : 0;
+    decomp_error = false;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+/*
+ * Multi-channel migration: normal pages are handed to one sender thread
+ * per extra connection.  A page always goes through the same channel,
+ * picked from its ram_addr_t, and RAM_CMD_CHANNEL_SYNC on the main stream
+ * makes the destination's main stream and channels wait for each other at
+ * the end of each round, so an older copy of a page never overwrites a
+ * newer one.
+ */
+
+/* the pages of a stripe go through the same channel */
+#define RAM_CHANNEL_STRIPE_BITS (TARGET_PAGE_BITS + 6)
+/* pages that can be waiting for each sender thread */
+#define RAM_CHANNEL_QUEUE_LEN   64
+
+typedef struct RAMChannelPage {
+    /* NULL for a sync marker */
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t data[TARGET_PAGE_SIZE];
+} RAMChannelPage;
+
+typedef struct RAMChannel {
+    QemuThread thread;
+    QemuMutex mutex;
+    /* signalled when a page is queued and when one has been sent */
+    QemuCond cond;
+    QEMUFile *file;
+    RAMChannelPage *queue;
+    int head;
+    int count;
+    bool quit;
+    /* only used by the sender thread */
+    RAMBlock *last_block;
+} RAMChannel;
+
+static RAMChannel *ram_channels;
+static int ram_channel_count;
+
+static void *ram_channel_send_thread(void *opaque)
+{
+    RAMChannel *c = opaque;
+
+    qemu_mutex_lock(&c->mutex);
+    while (c->count || !c->quit) {
+        RAMChannelPage *page;
+
+        if (!c->count) {
+            qemu_cond_wait(&c->cond, &c->mutex);
+            continue;
+        }
+        page = &c->queue[c->head];
+        qemu_mutex_unlock(&c->mutex);
+
+        if (page->block) {
+            int cont = (page->block == c->last_block) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+
+            save_block_hdr(c->file, page->block, page->offset, cont,
+                           RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer(c->file, page->data, TARGET_PAGE_SIZE);
+            c->last_block = page->block;
+        } else {
+            qemu_put_be64(c->file, RAM_SAVE_FLAG_EOS);
+            /* the destination is waiting for this one */
+            qemu_fflush(c->file);
+        }
+
+        qemu_mutex_lock(&c->mutex);
+        c->head = (c->head + 1) % RAM_CHANNEL_QUEUE_LEN;
+        c->count--;
+        qemu_cond_signal(&c->cond);
+    }
+    qemu_mutex_unlock(&c->mutex);
+    qemu_fflush(c->file);
+
+    return NULL;
+}
+
+static void ram_channels_save_setup(void)
+{
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    if (s->nr_channels < 2) {
+        return;
+    }
+    ram_channel_count = s->nr_channels - 1;
+    ram_channels = g_new0(RAMChannel, ram_channel_count);
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
+
+        c->file = s->channel_files[i + 1];
+        c->queue = g_new(RAMChannelPage, RAM_CHANNEL_QUEUE_LEN);
+        qemu_mutex_init(&c->mutex);
+        qemu_cond_init(&c->cond);
+        qemu_thread_create(&c->thread, ram_channel_send_thread, c,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static int ram_channels_get_error(void)
+{
+    int i, ret;
+
+    for (i = 0; i < ram_channel_count; i++) {
+        ret = qemu_file_get_error(ram_channels[i].file);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Stop the threads once they have sent everything; returns any error */
+static int ram_channels_save_cleanup(void)
+{
+    int i, ret;
+
+    if (!ram_channels) {
+        return 0;
+    }
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->quit = true;
+        qemu_cond_signal(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
+        qemu_thread_join(&c->thread);
+    }
+    ret = ram_channels_get_error();
+    for (i = 0; i < ram_channel_count; i++) {
+        RAMChannel *c = &ram_channels[i];
+
+        qemu_mutex_destroy(&c->mutex);
+        qemu_cond_destroy(&c->cond);
+        g_free(c->queue);
+    }
+    g_free(ram_channels);
+    ram_channels = NULL;
+    ram_channel_count = 0;
+
+    return ret;
+}
+
+/* Make the sender threads fail fast instead of draining their queues */
+static void ram_channels_abort(void)
+{
+    int i;
+
+    for (i = 0; i < ram_channel_count; i++) {
+        shutdown(qemu_get_fd(ram_channels[i].file), 2);
+    }
+}
+
+static void ram_channel_push(RAMChannel *c, RAMBlock *block,
+                             ram_addr_t offset, uint8_t *p)
+{
+    RAMChannelPage *page;
+
+    qemu_mutex_lock(&c->mutex);
+    while (c->count == RAM_CHANNEL_QUEUE_LEN) {
+        qemu_cond_wait(&c->cond, &c->mutex);
+    }
+    /* the sender does not look at the slot before count includes it */
+    page = &c->queue[(c->head + c->count) % RAM_CHANNEL_QUEUE_LEN];
+    qemu_mutex_unlock(&c->mutex);
+
+    page->block = block;
+    page->offset = offset;
+    if (block) {
+        memcpy(page->data, p, TARGET_PAGE_SIZE);
+    }
+
+    qemu_mutex_lock(&c->mutex);
+    c->count++;
+    qemu_cond_signal(&c->cond);
+    qemu_mutex_unlock(&c->mutex);
+}
+
+/*
+ * Queue a normal page on its channel.  The bytes are credited to @f so
+ * that they count against the bandwidth limit.
+ *
+ * Returns: The number of bytes sent on behalf of the page, not counting
+ *          the block name that the channel may have to send with it.
+ */
+static int ram_channel_queue_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset, uint8_t *p)
+{
+    ram_addr_t addr = block->offset + offset;
+    RAMChannel *c = &ram_channels[(addr >> RAM_CHANNEL_STRIPE_BITS) %
+                                  ram_channel_count];
+
+    ram_channel_push(c, block, offset, p);
+    qemu_file_credit_transfer(f, 8 + TARGET_PAGE_SIZE);
+    acct_info.norm_pages++;
+
+    return 8 + TARGET_PAGE_SIZE;
+}
+
+/* Everything queued so far must be loaded before what follows on @f */
+static void ram_channels_sync(QEMUFile *f)
+{
+    int i;
+
+    if (!ram_channels) {
+        return;
+    }
+    for (i = 0; i < ram_channel_count; i++) {
+        ram_channel_push(&ram_channels[i], NULL, 0, NULL);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+    qemu_put_byte(f, RAM_CMD_CHANNEL_SYNC);
+}
 
 /* This is the last block that we have visited serching for dirty pages
  */
@@ -335,6 +1101,243 @@ static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+static uint64_t bitmap_sync_count;
+static uint64_t bitmap_sync_time;
+
+/*
+ * file: migration: normal pages are not part of the stream but written in
+ * place, at ram_file_base plus their ram_addr_t, by a pool of writer
+ * threads.  A page always lands at the same offset, so the file does not
+ * grow with the number of rounds and the destination can read RAM back
+ * in large chunks.  As with the channels, a page always goes to the same
+ * writer so that an older copy never overwrites a newer one.
+ */
+
+/* the pages of a stripe go to the same writer */
+#define RAM_FILE_STRIPE_BITS    (TARGET_PAGE_BITS + 8)
+/* pages that can be waiting for each writer, and the most in one write */
+#define RAM_FILE_QUEUE_LEN      256
+/* O_DIRECT wants buffers, offsets and lengths aligned to this */
+#define RAM_FILE_DIRECT_ALIGN   4096
+
+typedef struct RAMFileWriter {
+    QemuThread thread;
+    QemuMutex mutex;
+    /* signalled when a page is queued and when some have been written */
+    QemuCond cond;
+    /* RAM_FILE_QUEUE_LEN pages and the file offset of each */
+    uint8_t *data;
+    off_t *pos;
+    int head;
+    int count;
+    bool quit;
+    int error;
+} RAMFileWriter;
+
+static RAMFileWriter *ram_file_writers;
+static int ram_file_writer_count;
+static int ram_file_fd = -1;
+static int64_t ram_file_base;
+
+/* Best effort: without O_DIRECT the pages go through the page cache */
+static void ram_file_set_direct(int fd)
+{
+#ifdef O_DIRECT
+    if (TARGET_PAGE_SIZE % RAM_FILE_DIRECT_ALIGN == 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+    }
+#endif
+}
+
+static void *ram_file_write_thread(void *opaque)
+{
+    RAMFileWriter *w = opaque;
+
+    qemu_mutex_lock(&w->mutex);
+    while (w->count || !w->quit) {
+        int n;
+
+        if (!w->count) {
+            qemu_cond_wait(&w->cond, &w->mutex);
+            continue;
+        }
+        /* write out the run of queued pages that are adjacent in the file */
+        for (n = 1; n < w->count && w->head + n < RAM_FILE_QUEUE_LEN; n++) {
+            if (w->pos[w->head + n] !=
+                w->pos[w->head] + n * TARGET_PAGE_SIZE) {
+                break;
+            }
+        }
+        qemu_mutex_unlock(&w->mutex);
+
+        if (!w->error) {
+            ssize_t len = n * TARGET_PAGE_SIZE;
+            ssize_t done = 0;
+
+            while (done < len) {
+                ssize_t ret = pwrite(ram_file_fd,
+                                     w->data + w->head * TARGET_PAGE_SIZE +
+                                     done, len - done, w->pos[w->head] + done);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    w->error = ret < 0 ? -errno : -EIO;
+                    break;
+                }
+                done += ret;
+            }
+        }
+
+        qemu_mutex_lock(&w->mutex);
+        w->head = (w->head + n) % RAM_FILE_QUEUE_LEN;
+        w->count -= n;
+        qemu_cond_signal(&w->cond);
+    }
+    qemu_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+static void ram_file_save_setup(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+    RAMBlock *block;
+    int i;
+
+    if (s->ram_fd < 0) {
+        return;
+    }
+    ram_file_fd = s->ram_fd;
+    ram_file_base = s->ram_base;
+    ram_file_set_direct(ram_file_fd);
+
+    ram_file_writer_count = s->ram_file_threads;
+    ram_file_writers = g_new0(RAMFileWriter, ram_file_writer_count);
+    for (i = 0; i < ram_file_writer_count; i++) {
+        RAMFileWriter *w = &ram_file_writers[i];
+
+        w->data = qemu_memalign(RAM_FILE_DIRECT_ALIGN,
+                                RAM_FILE_QUEUE_LEN * TARGET_PAGE_SIZE);
+        w->pos = g_new(off_t, RAM_FILE_QUEUE_LEN);
+        qemu_mutex_init(&w->mutex);
+        qemu_cond_init(&w->cond);
+        qemu_thread_create(&w->thread, ram_file_write_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+    qemu_put_byte(f, RAM_CMD_FILE_MAP);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, ram_file_base + block->offset);
+    }
+    qemu_put_byte(f, 0);
+}
+
+static int ram_file_get_error(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < ram_file_writer_count && !ret; i++) {
+        RAMFileWriter *w = &ram_file_writers[i];
+
+        qemu_mutex_lock(&w->mutex);
+        ret = w->error;
+        qemu_mutex_unlock(&w->mutex);
+    }
+    return ret;
+}
+
+/* Stop the writers once everything queued is in the file; returns any error */
+static int ram_file_save_cleanup(void)
+{
+    int i, ret;
+
+    if (!ram_file_writers) {
+        return 0;
+    }
+    for (i = 0; i < ram_file_writer_count; i++) {
+        RAMFileWriter *w = &ram_file_writers[i];
+
+        qemu_mutex_lock(&w->mutex);
+        w->quit = true;
+        qemu_cond_signal(&w->cond);
+        qemu_mutex_unlock(&w->mutex);
+        qemu_thread_join(&w->thread);
+    }
+    ret = ram_file_get_error();
+    for (i = 0; i < ram_file_writer_count; i++) {
+        RAMFileWriter *w = &ram_file_writers[i];
+
+        qemu_mutex_destroy(&w->mutex);
+        qemu_cond_destroy(&w->cond);
+        qemu_vfree(w->data);
+        g_free(w->pos);
+    }
+    g_free(ram_file_writers);
+    ram_file_writers = NULL;
+    ram_file_writer_count = 0;
+    ram_file_fd = -1;
+
+    return ret;
+}
+
+/*
+ * Queue a page for its writer.  A zero page does not need writing during
+ * the first round, the file has a hole there already.
+ *
+ * Returns: The number of bytes written to the file for the page.
+ */
+static int ram_file_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, uint8_t *p)
+{
+    ram_addr_t addr = block->offset + offset;
+    RAMFileWriter *w = &ram_file_writers[(addr >> RAM_FILE_STRIPE_BITS) %
+                                         ram_file_writer_count];
+    int slot;
+
+    if (ram_bulk_stage && is_zero_page(p)) {
+        acct_info.dup_pages++;
+        return 0;
+    }
+
+    qemu_mutex_lock(&w->mutex);
+    while (w->count == RAM_FILE_QUEUE_LEN) {
+        qemu_cond_wait(&w->cond, &w->mutex);
+    }
+    /* the writer does not look at the slot before count includes it */
+    slot = (w->head + w->count) % RAM_FILE_QUEUE_LEN;
+    qemu_mutex_unlock(&w->mutex);
+
+    memcpy(w->data + slot * TARGET_PAGE_SIZE, p, TARGET_PAGE_SIZE);
+    w->pos[slot] = ram_file_base + addr;
+
+    qemu_mutex_lock(&w->mutex);
+    w->count++;
+    qemu_cond_signal(&w->cond);
+    qemu_mutex_unlock(&w->mutex);
+
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    acct_info.norm_pages++;
+
+    return TARGET_PAGE_SIZE;
+}
+
+/* Pages the destination faulted on during post-copy, sent first */
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QemuMutex page_requests_lock;
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+/* set once the background scan of the post-copy phase reached the end */
+static bool postcopy_scan_done;
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -359,26 +1362,97 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
+static inline bool migration_bitmap_clear_dirty(RAMBlock *block,
+                                                ram_addr_t offset)
 {
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
     bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    ret = test_and_clear_bit(nr, migration_bitmap);
 
-    if (!ret) {
-        migration_dirty_pages++;
+    if (ret) {
+        migration_dirty_pages--;
     }
     return ret;
 }
 
+/*
+ * Large RAM blocks are synced by several threads, each taking chunks of
+ * DIRTY_SYNC_CHUNK bytes.  The chunks are a multiple of 64 pages, so no two
+ * threads write to the same word of the migration bitmap.
+ */
+#define DIRTY_SYNC_CHUNK        (1ULL << 30)
+#define DIRTY_SYNC_MAX_THREADS  8
+
+typedef struct DirtySyncJob {
+    QemuThread thread;
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint64_t num_dirty;
+} DirtySyncJob;
+
+static void *migration_bitmap_sync_job(void *opaque)
+{
+    DirtySyncJob *job = opaque;
+
+    job->num_dirty =
+        memory_region_test_and_clear_dirty_bitmap(job->mr, job->offset,
+                                                  job->length,
+                                                  DIRTY_MEMORY_MIGRATION,
+                                                  migration_bitmap);
+    return NULL;
+}
+
+/* Returns the number of pages that became dirty in the migration bitmap */
+static uint64_t migration_bitmap_sync_block(RAMBlock *block)
+{
+    DirtySyncJob jobs[DIRTY_SYNC_MAX_THREADS];
+    ram_addr_t chunks = DIV_ROUND_UP(block->length, DIRTY_SYNC_CHUNK);
+    ram_addr_t per_job, offset = 0;
+    uint64_t num_dirty = 0;
+    int i, nr_jobs;
+
+    /*
+     * With TCG, clearing the dirty flags also resets the TLB dirty bits of
+     * every CPU; keep that on the thread that holds the iothread lock.
+     */
+    if (!kvm_enabled() || chunks < 2) {
+        return memory_region_test_and_clear_dirty_bitmap(block->mr, 0,
+                                                         block->length,
+                                                         DIRTY_MEMORY_MIGRATION,
+                                                         migration_bitmap);
+    }
+
+    nr_jobs = MIN(chunks, DIRTY_SYNC_MAX_THREADS);
+    per_job = DIV_ROUND_UP(chunks, nr_jobs) * DIRTY_SYNC_CHUNK;
+    for (i = 0; i < nr_jobs && offset < block->length; i++) {
+        jobs[i].mr = block->mr;
+        jobs[i].offset = offset;
+        jobs[i].length = MIN(per_job, block->length - offset);
+        jobs[i].num_dirty = 0;
+        offset += jobs[i].length;
+        if (i > 0) {
+            qemu_thread_create(&jobs[i].thread, migration_bitmap_sync_job,
+                               &jobs[i], QEMU_THREAD_JOINABLE);
+        }
+    }
+    nr_jobs = i;
+
+    migration_bitmap_sync_job(&jobs[0]);
+    num_dirty += jobs[0].num_dirty;
+    for (i = 1; i < nr_jobs; i++) {
+        qemu_thread_join(&jobs[i].thread);
+        num_dirty += jobs[i].num_dirty;
+    }
+    return num_dirty;
+}
+
 /* Needs iothread lock! */
 
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -386,6 +1460,7 @@ static void migration_bitmap_sync(void)
     static int64_t num_dirty_pages_period;
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start = qemu_get_clock_ns(rt_clock);
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -399,39 +1474,36 @@ static void migration_bitmap_sync(void)
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
-        }
+        migration_dirty_pages += migration_bitmap_sync_block(block);
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    bitmap_sync_count++;
+    bitmap_sync_time = (qemu_get_clock_ns(rt_clock) - sync_start) / 1000;
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_get_clock_ms(rt_clock);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Throttle the guest just as much as it takes for the rounds
+               to shrink at a steady pace, based on what was dirtied and
+               what could be sent since the last time we were here */
+            int64_t period = end_time - start_time;
+            int pct;
+
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+            pct = migration_throttle_percentage(
+                num_dirty_pages_period * TARGET_PAGE_SIZE * 1000 / period,
+                (bytes_xfer_now - bytes_xfer_prev) * 1000 / period,
+                mig_throttle_pct);
+            if (pct != mig_throttle_pct) {
+                trace_migration_throttle(pct);
+                mig_throttle_pct = pct;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         } else {
-             mig_throttle_on = false;
+            mig_throttle_pct = 0;
         }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
@@ -444,16 +1516,22 @@ static void migration_bitmap_sync(void)
 /*
  * ram_save_block: Writes a page of memory to the stream f
  *
- * Returns:  The number of bytes written.
+ * With compression the page may only be queued; the bytes written on
+ * its behalf are accounted when a later call flushes it.
+ *
+ * Returns:  The number of pages written or queued.
  *           0 means no dirty pages
  */
 
-static int ram_save_block(QEMUFile *f, bool last_stage)
+static int ram_save_block(QEMUFile *f, bool last_stage,
+                          uint64_t *bytes_transferred)
 {
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
     int bytes_sent = 0;
+    int pages = 0;
+    bool on_channel = false;
     MemoryRegion *mr;
     ram_addr_t current_addr;
 
@@ -483,6 +1561,19 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 
             p = memory_region_get_ram_ptr(mr) + offset;
 
+            if (ram_file_writers) {
+                /* nothing of the page goes into the stream */
+                *bytes_transferred += ram_file_queue_page(f, block, offset, p);
+                pages = 1;
+                break;
+            }
+
+            if (!cont && migrate_use_compression()) {
+                /* queued pages use 'cont' relative to the previous block,
+                 * they must reach the stream before a new block name */
+                *bytes_transferred += flush_compressed_data(f);
+            }
+
             /* In doubt sent page as normal */
             bytes_sent = -1;
             ret = ram_control_save_page(f, block->offset,
@@ -502,6 +1593,10 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                                             RAM_SAVE_FLAG_COMPRESS);
                 qemu_put_byte(f, 0);
                 bytes_sent++;
+            } else if (migrate_use_compression()) {
+                bytes_sent = compress_page_with_multi_thread(f, block, offset,
+                                                             cont, p);
+                pages = 1;
             } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
                 current_addr = block->offset + offset;
                 bytes_sent = save_xbzrle_page(f, p, current_addr, block,
@@ -512,16 +1607,31 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
             }
 
             /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
+            if (bytes_sent == -1 && ram_channels) {
+                bytes_sent = ram_channel_queue_page(f, block, offset, p);
+                on_channel = true;
+            } else if (bytes_sent == -1) {
                 bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                if (p == memory_region_get_ram_ptr(mr) + offset) {
+                    qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                } else {
+                    /* the cache slot may be reused before a zero-copy
+                     * send has read it */
+                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                }
                 bytes_sent += TARGET_PAGE_SIZE;
                 acct_info.norm_pages++;
             }
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
-                last_sent_block = block;
+                pages = 1;
+            }
+            if (pages) {
+                *bytes_transferred += bytes_sent;
+                if (!on_channel) {
+                    last_sent_block = block;
+                }
                 break;
             }
         }
@@ -529,7 +1639,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
 static uint64_t bytes_transferred;
@@ -572,8 +1682,30 @@ uint64_t ram_bytes_total(void)
     return total;
 }
 
+uint64_t ram_dirty_sync_count(void)
+{
+    return bitmap_sync_count;
+}
+
+int ram_throttle_percentage(void)
+{
+    return mig_throttle_pct;
+}
+
+uint64_t ram_dirty_sync_time(void)
+{
+    return bitmap_sync_time;
+}
+
 static void migration_end(void)
 {
+    RAMPageRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
+    }
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -588,10 +1720,15 @@ static void migration_end(void)
         g_free(XBZRLE.decoded_buf);
         XBZRLE.cache = NULL;
     }
+
+    compress_threads_save_cleanup();
+    ram_channels_save_cleanup();
+    ram_file_save_cleanup();
 }
 
 static void ram_migration_cancel(void *opaque)
 {
+    ram_channels_abort();
     migration_end();
 }
 
@@ -614,8 +1751,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
+    mig_throttle_pct = 0;
+    bitmap_sync_count = 0;
+    bitmap_sync_time = 0;
 
     if (migrate_use_xbzrle()) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -625,11 +1763,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             DPRINTF("Error creating cache\n");
             return -1;
         }
+        XBZRLE.resize_pages = 0;
         XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
         XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
         acct_clear();
     }
 
+    if (migrate_use_compression()) {
+        if (!migrate_use_xbzrle()) {
+            acct_clear();
+        }
+        if (compress_threads_save_setup() < 0) {
+            compress_threads_save_cleanup();
+            return -1;
+        }
+    }
+
+    ram_channels_save_setup();
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
@@ -647,8 +1798,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->length);
     }
 
+    ram_file_save_setup(f);
+
     qemu_mutex_unlock_ramlist();
 
+    if (ram_channels) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+        qemu_put_byte(f, RAM_CMD_CHANNELS);
+        qemu_put_be32(f, ram_channel_count + 1);
+    }
+
+    if (migrate_postcopy_ram()) {
+        /* lets the destination refuse before the guest is stopped here */
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+        qemu_put_byte(f, RAM_CMD_POSTCOPY_ADVISE);
+        qemu_mutex_init(&page_requests_lock);
+        postcopy_scan_done = false;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -670,16 +1837,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         reset_ram_globals();
     }
 
+    xbzrle_cache_apply_resize();
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
     t0 = qemu_get_clock_ns(rt_clock);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+        uint64_t bytes_sent = 0;
 
-        bytes_sent = ram_save_block(f, false);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_save_block(f, false, &bytes_sent) == 0) {
             break;
         }
         total_sent += bytes_sent;
@@ -701,8 +1868,20 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    total_sent += flush_compressed_data(f);
     qemu_mutex_unlock_ramlist();
 
+    if (ret >= 0) {
+        int error = ram_channels_get_error();
+
+        if (!error) {
+            error = ram_file_get_error();
+        }
+        if (error) {
+            ret = error;
+        }
+    }
+
     /*
      * Must occur before EOS (or any QEMUFile operation)
      * because of RDMA protocol.
@@ -714,6 +1893,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         return ret;
     }
 
+    ram_channels_sync(f);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     total_sent += 8;
     bytes_transferred += total_sent;
@@ -721,34 +1901,224 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return total_sent;
 }
 
+/*
+ * Tell the destination which pages are still dirty, so that it drops
+ * its stale copies and faults on them until the new content arrives.
+ */
+static void ram_postcopy_send_discard(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+    qemu_put_byte(f, RAM_CMD_POSTCOPY_DISCARD);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->length >> TARGET_PAGE_BITS);
+        unsigned long start = find_next_bit(migration_bitmap, end, base);
+
+        if (start >= end) {
+            continue;
+        }
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        while (start < end) {
+            unsigned long stop = find_next_zero_bit(migration_bitmap, end,
+                                                    start);
+
+            qemu_put_be64(f, (ram_addr_t)(start - base) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (ram_addr_t)(stop - start) << TARGET_PAGE_BITS);
+            start = find_next_bit(migration_bitmap, end, stop);
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+}
+
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
+    if (migration_in_postcopy(migrate_get_current())) {
+        /* the dirty pages go out later, from ram_postcopy_send_pages() */
+        bytes_transferred += flush_compressed_data(f);
+        ram_postcopy_send_discard(f);
+        last_seen_block = QTAILQ_FIRST(&ram_list.blocks);
+        last_sent_block = NULL;
+        last_offset = 0;
+        ram_bulk_stage = false;
+        qemu_mutex_unlock_ramlist();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
-    /* try transferring iterative blocks of memory */
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        uint64_t bytes_sent = 0;
+
+        /* no more blocks to sent */
+        if (ram_save_block(f, true, &bytes_sent) == 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    bytes_transferred += flush_compressed_data(f);
+    ram_channels_sync(f);
+    ret = ram_channels_save_cleanup();
+    if (!ret) {
+        ret = ram_file_save_cleanup();
+    }
+
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    migration_end();
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return ret;
+}
+
+int ram_save_queue_pages(const char *rbname, ram_addr_t start,
+                         ram_addr_t len)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    /* RAM blocks cannot come and go while the guest is stopped */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(rbname, block->idstr, sizeof(block->idstr))) {
+            break;
+        }
+    }
+    if (!block || (start & ~TARGET_PAGE_MASK) || !len ||
+        start >= block->length || len > block->length - start) {
+        fprintf(stderr, "Invalid page request %s:" RAM_ADDR_FMT
+                " +" RAM_ADDR_FMT "\n", rbname, start, len);
+        return -EINVAL;
+    }
+
+    req = g_malloc0(sizeof(*req));
+    req->block = block;
+    req->offset = start;
+    req->len = len;
+
+    qemu_mutex_lock(&page_requests_lock);
+    QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+    qemu_mutex_unlock(&page_requests_lock);
+
+    return 0;
+}
+
+static RAMPageRequest *ram_dequeue_page_request(void)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_requests_lock);
+    req = QSIMPLEQ_FIRST(&page_requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+    }
+    qemu_mutex_unlock(&page_requests_lock);
+
+    return req;
+}
+
+/* Post-copy pages go out raw: the destination needs them right now */
+static int ram_save_postcopy_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent;
+
+    if (is_zero_page(p)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    last_sent_block = block;
+    bytes_transferred += bytes_sent;
+
+    return bytes_sent;
+}
+
+#define POSTCOPY_BURST (256 * 1024)
+
+/*
+ * Send a burst of the pages still missing on the destination, requested
+ * pages first, then whatever the background scan finds dirty.
+ *
+ * Returns: bytes written, 0 once all of RAM has been sent
+ */
+int ram_postcopy_send_pages(QEMUFile *f)
+{
+    int bytes_sent = 0;
+
+    qemu_mutex_lock_ramlist();
+    while (bytes_sent < POSTCOPY_BURST) {
+        RAMPageRequest *req = ram_dequeue_page_request();
+
+        if (req) {
+            ram_addr_t offset;
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+            /* the guest is stopped, so even a clean page is up to date */
+            for (offset = req->offset; offset < req->offset + req->len;
+                 offset += TARGET_PAGE_SIZE) {
+                migration_bitmap_clear_dirty(req->block, offset);
+                bytes_sent += ram_save_postcopy_page(f, req->block, offset);
+            }
+            g_free(req);
+            /* somebody is waiting for this one */
+            qemu_fflush(f);
+            continue;
+        }
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (postcopy_scan_done) {
             break;
         }
-        bytes_transferred += bytes_sent;
+
+        last_offset = migration_bitmap_find_and_reset_dirty(
+            last_seen_block->mr, last_offset);
+        if (last_offset >= last_seen_block->length) {
+            last_offset = 0;
+            last_seen_block = QTAILQ_NEXT(last_seen_block, next);
+            if (!last_seen_block) {
+                postcopy_scan_done = true;
+            }
+        } else {
+            bytes_sent += ram_save_postcopy_page(f, last_seen_block,
+                                                 last_offset);
+        }
     }
+    qemu_mutex_unlock_ramlist();
 
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
+    if (!bytes_sent && postcopy_scan_done) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    }
+    qemu_fflush(f);
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    return bytes_sent;
+}
 
-    return 0;
+void ram_postcopy_send_end(void)
+{
+    migration_end();
 }
 
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
@@ -807,11 +2177,11 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return rc;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+/* @block is the block of the previous page read from @f */
+static inline void *host_from_stream_block(QEMUFile *f, ram_addr_t offset,
+                                           int flags, RAMBlock **pblock)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = *pblock;
     char id[256];
     uint8_t len;
 
@@ -829,14 +2199,436 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *pblock = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
+        }
     }
 
+    *pblock = NULL;
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block;
+
+    return host_from_stream_block(f, offset, flags, &block);
+}
+
+/*
+ * The destination side of a multi-channel migration: one thread per extra
+ * connection loads the pages it receives straight into guest RAM.
+ *
+ * The sync markers are a two-way barrier.  The main stream waits for every
+ * channel to reach sync N before going on, and a channel waits for the main
+ * stream to reach sync N before loading pages of the next round; otherwise
+ * a zero or XBZRLE page still being loaded from the main stream could
+ * overwrite a newer copy that came through a channel.
+ */
+typedef struct RAMChannelIncoming {
+    QemuThread thread;
+    QEMUFile *file;
+    int index;
+    /* sync markers seen, protected by channels_incoming_lock */
+    uint64_t syncs;
+    bool failed;
+} RAMChannelIncoming;
+
+static RAMChannelIncoming *channels_incoming;
+static int channels_incoming_count;
+static QemuMutex channels_incoming_lock;
+static QemuCond channels_incoming_cond;
+/* RAM_CMD_CHANNEL_SYNC commands seen on the main stream */
+static uint64_t channels_incoming_syncs;
+/* set when the channels are torn down, stops waiting channel threads */
+static bool channels_incoming_quit;
+
+static void *ram_channel_recv_thread(void *opaque)
+{
+    RAMChannelIncoming *c = opaque;
+    RAMBlock *block = NULL;
+    int ret = 0;
+
+    if (qemu_get_be32(c->file) != MIGRATION_CHANNEL_MAGIC ||
+        qemu_get_be32(c->file) != c->index) {
+        fprintf(stderr, "Migration channel %d: bad header\n", c->index);
+        ret = -EINVAL;
+    }
+
+    while (!ret) {
+        ram_addr_t addr = qemu_get_be64(c->file);
+        int flags = addr & ~TARGET_PAGE_MASK;
+
+        addr &= TARGET_PAGE_MASK;
+        ret = qemu_file_get_error(c->file);
+        if (ret) {
+            break;
+        }
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            qemu_mutex_lock(&channels_incoming_lock);
+            c->syncs++;
+            qemu_cond_broadcast(&channels_incoming_cond);
+            while (channels_incoming_syncs < c->syncs &&
+                   !channels_incoming_quit) {
+                qemu_cond_wait(&channels_incoming_cond,
+                               &channels_incoming_lock);
+            }
+            if (channels_incoming_quit) {
+                ret = -EINTR;
+            }
+            qemu_mutex_unlock(&channels_incoming_lock);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            void *host = host_from_stream_block(c->file, addr, flags, &block);
+
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(c->file, host, TARGET_PAGE_SIZE);
+        } else {
+            fprintf(stderr, "Migration channel %d: unexpected flags 0x%x\n",
+                    c->index, flags);
+            ret = -EINVAL;
+        }
+    }
+
+    /* the source closes the channels once it is done with them */
+    DPRINTF("channel %d stopped: %d\n", c->index, ret);
+    qemu_mutex_lock(&channels_incoming_lock);
+    c->failed = true;
+    qemu_cond_broadcast(&channels_incoming_cond);
+    qemu_mutex_unlock(&channels_incoming_lock);
+
+    return NULL;
+}
+
+void ram_channels_incoming_start(QEMUFile **files, int count)
+{
+    int i;
+
+    channels_incoming = g_new0(RAMChannelIncoming, count);
+    channels_incoming_count = count;
+    channels_incoming_syncs = 0;
+    channels_incoming_quit = false;
+    qemu_mutex_init(&channels_incoming_lock);
+    qemu_cond_init(&channels_incoming_cond);
+    for (i = 0; i < count; i++) {
+        RAMChannelIncoming *c = &channels_incoming[i];
+
+        c->file = files[i];
+        c->index = i + 1;
+        qemu_set_block(qemu_get_fd(c->file));
+        qemu_thread_create(&c->thread, ram_channel_recv_thread, c,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Wait until every channel has loaded the pages sent before this point */
+static int ram_channels_incoming_sync(void)
+{
+    int i, ret = 0;
+
+    if (!channels_incoming) {
+        fprintf(stderr, "Channel sync without any migration channel\n");
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&channels_incoming_lock);
+    channels_incoming_syncs++;
+    /* let the channels go on with the next round once they get here */
+    qemu_cond_broadcast(&channels_incoming_cond);
+    for (i = 0; i < channels_incoming_count; i++) {
+        RAMChannelIncoming *c = &channels_incoming[i];
+
+        while (c->syncs < channels_incoming_syncs && !c->failed) {
+            qemu_cond_wait(&channels_incoming_cond, &channels_incoming_lock);
+        }
+        if (c->syncs < channels_incoming_syncs) {
+            fprintf(stderr, "Migration channel %d failed\n", c->index);
+            ret = -EIO;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&channels_incoming_lock);
+
+    return ret;
+}
+
+void ram_channels_incoming_join(void)
+{
+    int i;
+
+    if (!channels_incoming) {
+        return;
+    }
+    qemu_mutex_lock(&channels_incoming_lock);
+    channels_incoming_quit = true;
+    qemu_cond_broadcast(&channels_incoming_cond);
+    qemu_mutex_unlock(&channels_incoming_lock);
+    for (i = 0; i < channels_incoming_count; i++) {
+        RAMChannelIncoming *c = &channels_incoming[i];
+
+        /* everything needed has been loaded, don't wait for the source */
+        shutdown(qemu_get_fd(c->file), 2);
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
+    }
+    qemu_mutex_destroy(&channels_incoming_lock);
+    qemu_cond_destroy(&channels_incoming_cond);
+    g_free(channels_incoming);
+    channels_incoming = NULL;
+    channels_incoming_count = 0;
+}
+
+/*
+ * The destination side of a file: migration: when RAM_CMD_FILE_MAP shows
+ * up, RAM is read back from where the source wrote it, in chunks spread
+ * over a few threads.
+ *
+ * With lazy=on the blocks are instead mapped privately from the file, so
+ * the guest can start right away and pages are read on first touch; a
+ * background thread faults in the rest meanwhile.  The file must not be
+ * changed while guests restored from it are running.
+ */
+#define RAM_FILE_READ_CHUNK     (16 << 20)
+
+typedef struct RAMFileChunk {
+    uint8_t *host;
+    size_t len;
+    off_t pos;
+} RAMFileChunk;
+
+static int ram_file_incoming_fd = -1;
+static int ram_file_reader_count;
+static bool ram_file_lazy;
+static RAMFileChunk *ram_file_chunks;
+static int ram_file_nr_chunks;
+static int ram_file_next_chunk;
+static int ram_file_read_error;
+static QemuThread ram_file_prefetcher;
+static QEMUBH *ram_file_prefetch_bh;
+static bool ram_file_prefetch_quit;
+
+void ram_file_incoming_start(int fd, int threads, bool lazy)
+{
+    ram_file_incoming_fd = fd;
+    ram_file_reader_count = threads;
+    ram_file_lazy = lazy;
+}
+
+void ram_file_incoming_close(void)
+{
+    if (ram_file_incoming_fd >= 0) {
+        close(ram_file_incoming_fd);
+        ram_file_incoming_fd = -1;
+    }
+}
+
+static void *ram_file_read_thread(void *opaque)
+{
+    int i;
+
+    while ((i = atomic_fetch_add(&ram_file_next_chunk, 1)) <
+           ram_file_nr_chunks) {
+        RAMFileChunk *c = &ram_file_chunks[i];
+        size_t done = 0;
+
+        while (done < c->len) {
+            ssize_t ret = pread(ram_file_incoming_fd, c->host + done,
+                                c->len - done, c->pos + done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                atomic_cmpxchg(&ram_file_read_error, 0,
+                               ret < 0 ? -errno : -EIO);
+                return NULL;
+            }
+            done += ret;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Replace the anonymous memory of @block with a private mapping of the
+ * file.  Returns false if the block cannot be mapped, for example because
+ * it lives in hugetlbfs or belongs to a device.
+ */
+static bool ram_file_map_block(RAMBlock *block, off_t pos)
+{
+    uintptr_t align = getpagesize() - 1;
+    void *area;
+
+#ifdef TARGET_S390X
+    /* s390 KVM has constraints of its own on the placement of RAM */
+    return false;
+#endif
+    if ((block->flags & RAM_PREALLOC_MASK) || mem_path || xen_enabled() ||
+        (kvm_enabled() && !kvm_has_sync_mmu())) {
+        return false;
+    }
+    if (((uintptr_t)block->host | pos | block->length) & align) {
+        return false;
+    }
+
+    area = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, ram_file_incoming_fd, pos);
+    if (area != block->host) {
+        return false;
+    }
+    qemu_ram_setup_mapping(block->host, block->length);
+    return true;
+}
+
+/* Fault in the mapped blocks, a list that ends with a NULL host */
+static void *ram_file_prefetch_thread(void *opaque)
+{
+    RAMFileChunk *blocks = opaque;
+    size_t page = getpagesize();
+    int64_t start = qemu_get_clock_ms(rt_clock);
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; blocks[i].host; i++) {
+        RAMFileChunk *b = &blocks[i];
+        size_t off, p;
+
+        for (off = 0; off < b->len; off += RAM_FILE_READ_CHUNK) {
+            size_t len = MIN(RAM_FILE_READ_CHUNK, b->len - off);
+
+            if (atomic_mb_read(&ram_file_prefetch_quit)) {
+                goto out;
+            }
+            qemu_madvise(b->host + off, len, QEMU_MADV_WILLNEED);
+            for (p = 0; p < len; p += page) {
+                /* a read fault maps the file page, a write copies it */
+                (void)*(volatile uint8_t *)(b->host + off + p);
+            }
+        }
+        total += b->len;
+    }
+out:
+    trace_ram_file_prefetch_done(total, qemu_get_clock_ms(rt_clock) - start);
+    g_free(blocks);
+    qemu_bh_schedule(ram_file_prefetch_bh);
+
+    return NULL;
+}
+
+/* Stop faulting in mapped RAM, if still at it, and reap the thread */
+void ram_file_prefetch_stop(void)
+{
+    if (!ram_file_prefetch_bh) {
+        return;
+    }
+    atomic_mb_set(&ram_file_prefetch_quit, true);
+    qemu_thread_join(&ram_file_prefetcher);
+    qemu_bh_delete(ram_file_prefetch_bh);
+    ram_file_prefetch_bh = NULL;
+}
+
+static void ram_file_prefetch_bh_cb(void *opaque)
+{
+    ram_file_prefetch_stop();
+}
+
+static int ram_load_file_map(QEMUFile *f)
+{
+    RAMFileChunk *mapped = NULL;
+    QemuThread *threads;
+    int i, len, ret, nr_mapped = 0;
+
+    if (ram_file_incoming_fd < 0) {
+        fprintf(stderr, "RAM file map outside of a file: migration\n");
+        return -EINVAL;
+    }
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        RAMBlock *block;
+        ram_addr_t offset;
+        char id[256];
+        off_t pos;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        pos = qemu_get_be64(f);
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Unknown ramblock \"%s\", cannot "
+                    "accept migration\n", id);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        if (ram_file_lazy && ram_file_map_block(block, pos)) {
+            mapped = g_renew(RAMFileChunk, mapped, nr_mapped + 2);
+            mapped[nr_mapped].host = block->host;
+            mapped[nr_mapped].len = block->length;
+            mapped[nr_mapped].pos = pos;
+            nr_mapped++;
+            mapped[nr_mapped].host = NULL;
+            continue;
+        }
+
+        ram_file_chunks = g_renew(RAMFileChunk, ram_file_chunks,
+                                  ram_file_nr_chunks +
+                                  DIV_ROUND_UP(block->length,
+                                               RAM_FILE_READ_CHUNK));
+        for (offset = 0; offset < block->length;
+             offset += RAM_FILE_READ_CHUNK) {
+            RAMFileChunk *c = &ram_file_chunks[ram_file_nr_chunks++];
+
+            c->host = block->host + offset;
+            c->len = MIN(RAM_FILE_READ_CHUNK, block->length - offset);
+            c->pos = pos + offset;
+        }
+    }
+
+    ram_file_set_direct(ram_file_incoming_fd);
+    ram_file_next_chunk = 0;
+    ram_file_read_error = 0;
+    threads = g_new(QemuThread, ram_file_reader_count);
+    for (i = 0; i < ram_file_reader_count; i++) {
+        qemu_thread_create(&threads[i], ram_file_read_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < ram_file_reader_count; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+
+    ret = ram_file_read_error;
+    if (ret) {
+        fprintf(stderr, "Reading RAM from the migration file failed: %s\n",
+                strerror(-ret));
+    } else if (mapped) {
+        ram_file_prefetch_quit = false;
+        ram_file_prefetch_bh = qemu_bh_new(ram_file_prefetch_bh_cb, NULL);
+        qemu_thread_create(&ram_file_prefetcher, ram_file_prefetch_thread,
+                           mapped, QEMU_THREAD_JOINABLE);
+        mapped = NULL;
+    }
+
+out:
+    g_free(mapped);
+    g_free(ram_file_chunks);
+    ram_file_chunks = NULL;
+    ram_file_nr_chunks = 0;
+    return ret;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -855,6 +2647,141 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+static int ram_load_postcopy_discard(QEMUFile *f)
+{
+    char id[256];
+    uint8_t len;
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        RAMBlock *block;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        while (true) {
+            uint64_t start = qemu_get_be64(f);
+            uint64_t length = qemu_get_be64(f);
+            int ret;
+
+            if (qemu_file_get_error(f)) {
+                return qemu_file_get_error(f);
+            }
+            if (!length) {
+                break;
+            }
+            if (start >= block->length || length > block->length - start) {
+                fprintf(stderr, "Invalid discard range %s:%" PRIx64
+                        " +%" PRIx64 "\n", id, start, length);
+                return -EINVAL;
+            }
+            ret = postcopy_ram_discard_range(
+                memory_region_get_ram_ptr(block->mr) + start, length);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int ram_load_command(QEMUFile *f)
+{
+    uint8_t cmd = qemu_get_byte(f);
+
+    switch (cmd) {
+    case RAM_CMD_POSTCOPY_ADVISE:
+        if (!postcopy_ram_supported_by_host()) {
+            return -ENOSYS;
+        }
+        return 0;
+    case RAM_CMD_POSTCOPY_DISCARD:
+        /* queued pages must land before their ranges are dropped */
+        if (wait_for_decompress_done() < 0) {
+            return -EINVAL;
+        }
+        return ram_load_postcopy_discard(f);
+    case RAM_CMD_CHANNEL_SYNC:
+        /* a page may come on a channel after its older copy went through
+         * the decompression threads */
+        if (wait_for_decompress_done() < 0) {
+            return -EINVAL;
+        }
+        return ram_channels_incoming_sync();
+    case RAM_CMD_CHANNELS:
+        return migration_incoming_wait_channels(qemu_get_be32(f));
+    case RAM_CMD_FILE_MAP:
+        return ram_load_file_map(f);
+    default:
+        fprintf(stderr, "Unknown RAM command %d\n", cmd);
+        return -EINVAL;
+    }
+}
+
+/*
+ * Receive the pages sent after the switch to post-copy.  Every page is
+ * placed atomically, so a vCPU never sees a partially written page.
+ */
+int ram_postcopy_incoming_load(QEMUFile *f)
+{
+    uint8_t *buf = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    int flags, ret = 0;
+
+    do {
+        ram_addr_t addr = qemu_get_be64(f);
+        void *host;
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            uint8_t ch;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+            ch = qemu_get_byte(f);
+            if (ch == 0) {
+                ret = postcopy_place_zero_page(host);
+            } else {
+                memset(buf, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, buf);
+            }
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(host, buf);
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            fprintf(stderr, "Unexpected RAM flags 0x%x in post-copy\n",
+                    flags);
+            ret = -EINVAL;
+        }
+
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    } while (!ret && !(flags & RAM_SAVE_FLAG_EOS));
+
+    qemu_vfree(buf);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -946,6 +2873,29 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            int len;
+
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > page_codec->bound(TARGET_PAGE_SIZE)) {
+                fprintf(stderr, "Invalid compressed data length: %d\n", len);
+                ret = -EINVAL;
+                goto done;
+            }
+            if (decompress_data_with_multi_threads(f, host, len) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMMAND) {
+            ret = ram_load_command(f);
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         }
@@ -957,6 +2907,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && !ret) {
+        fprintf(stderr, "Failed to load compressed page!\n");
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1187,7 +3141,7 @@ TargetInfo *qmp_query_target(Error **errp)
 static void mig_sleep_cpu(void *opq)
 {
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep((uintptr_t)opq);
     qemu_mutex_lock_iothread();
 }
 
@@ -1197,22 +3151,26 @@ static void mig_sleep_cpu(void *opq)
 */
 static void mig_throttle_cpu_down(CPUState *cpu, void *data)
 {
-    async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
+    async_run_on_cpu(cpu, mig_sleep_cpu, data);
 }
 
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_down(int64_t sleep_us)
 {
     qemu_mutex_lock_iothread();
-    qemu_for_each_cpu(mig_throttle_cpu_down, NULL);
+    qemu_for_each_cpu(mig_throttle_cpu_down, (void *)(uintptr_t)sleep_us);
     qemu_mutex_unlock_iothread();
 }
 
+/* The guest runs for this long between two throttling sleeps */
+#define THROTTLE_RUN_MS 40
+
 static void check_guest_throttling(void)
 {
     static int64_t t0;
     int64_t        t1;
+    int64_t        sleep_ms;
 
-    if (!mig_throttle_on) {
+    if (!mig_throttle_pct) {
         return;
     }
 
@@ -1223,11 +3181,12 @@ static void check_guest_throttling(void)
 
     t1 = qemu_get_clock_ns(rt_clock);
 
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
+    /* Sleep long enough for the guest to lose mig_throttle_pct percent of
+     * its time, once it has run for THROTTLE_RUN_MS since the last sleep.
      */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
+    sleep_ms = THROTTLE_RUN_MS * mig_throttle_pct / (100 - mig_throttle_pct);
+    if (THROTTLE_RUN_MS + sleep_ms < (t1-t0)/1000000) {
+        mig_throttle_guest_down(sleep_ms * 1000);
         t0 = t1;
     }
 }
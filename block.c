@@ -51,11 +51,6 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
-typedef enum {
-    BDRV_REQ_COPY_ON_READ = 0x1,
-    BDRV_REQ_ZERO_WRITE   = 0x2,
-} BdrvRequestFlags;
-
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
@@ -84,7 +79,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                bool is_write);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors);
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
 
 static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
         bool is_write, double elapsed_time, uint64_t *wait);
@@ -133,23 +128,53 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
         qemu_del_timer(bs->block_timer);
         qemu_free_timer(bs->block_timer);
         bs->block_timer = NULL;
+        qemu_bh_delete(bs->block_timer_arm_bh);
+        bs->block_timer_arm_bh = NULL;
+        qemu_bh_delete(bs->block_timer_wake_bh);
+        bs->block_timer_wake_bh = NULL;
     }
 
     bs->slice_start = 0;
     bs->slice_end   = 0;
 }
 
-static void bdrv_block_timer(void *opaque)
+static void bdrv_block_timer_wake(void *opaque)
 {
     BlockDriverState *bs = opaque;
 
     qemu_co_enter_next(&bs->throttled_reqs);
 }
 
+static void bdrv_block_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+        /* the throttled coroutines belong to the other thread */
+        qemu_bh_schedule(bs->block_timer_wake_bh);
+        return;
+    }
+    bdrv_block_timer_wake(bs);
+}
+
+static void bdrv_block_timer_arm(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    /* block_timer_deadline is written by the thread that runs ctx */
+    aio_context_acquire(ctx);
+    qemu_mod_timer(bs->block_timer, bs->block_timer_deadline);
+    aio_context_release(ctx);
+}
+
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
     qemu_co_queue_init(&bs->throttled_reqs);
     bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
+    bs->block_timer_arm_bh = qemu_bh_new(bdrv_block_timer_arm, bs);
+    bs->block_timer_wake_bh = aio_bh_new(bdrv_get_aio_context(bs),
+                                         bdrv_block_timer_wake, bs);
     bs->io_limits_enabled = true;
 }
 
@@ -181,8 +206,12 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      */
 
     while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
+        bs->block_timer_deadline = wait_time + qemu_get_clock_ns(vm_clock);
+        if (bdrv_get_aio_context(bs) == qemu_get_aio_context()) {
+            qemu_mod_timer(bs->block_timer, bs->block_timer_deadline);
+        } else {
+            qemu_bh_schedule(bs->block_timer_arm_bh);
+        }
         qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
     }
 
@@ -306,6 +335,7 @@ BlockDriverState *bdrv_new(const char *device_name)
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    bs->aio_context = qemu_get_aio_context();
 
     return bs;
 }
@@ -1424,7 +1454,11 @@ void bdrv_close_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         bdrv_close(bs);
+        aio_context_release(aio_context);
     }
 }
 
@@ -1440,6 +1474,44 @@ void bdrv_close_all(void)
  * coroutine is complete.  Because of this, it is not possible to have a
  * function to drain a single device's I/O queue.
  */
+static bool bdrv_requests_pending(BlockDriverState *bs)
+{
+    if (!QLIST_EMPTY(&bs->tracked_requests) || bs->in_flight) {
+        return true;
+    }
+    if (bs->file && bdrv_requests_pending(bs->file)) {
+        return true;
+    }
+    if (bs->backing_hd && bdrv_requests_pending(bs->backing_hd)) {
+        return true;
+    }
+    return false;
+}
+
+/* Wait for the requests of a BlockDriverState that is run by the event loop
+ * of another thread.  The handlers of such an AioContext are usually always
+ * busy, so aio_poll() cannot tell whether there is I/O left.
+ */
+static bool bdrv_drain_aio_context(BlockDriverState *bs)
+{
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    bool busy;
+
+    aio_context_acquire(aio_context);
+    /* throttled requests are not tracked yet, restart them */
+    do {} while (qemu_co_enter_next(&bs->throttled_reqs));
+    while (bdrv_requests_pending(bs)) {
+        aio_poll(aio_context, true);
+    }
+    /* Run the completion bottom halves, they may submit more requests */
+    aio_poll(aio_context, false);
+    busy = bdrv_requests_pending(bs) ||
+           !qemu_co_queue_empty(&bs->throttled_reqs);
+    aio_context_release(aio_context);
+
+    return busy;
+}
+
 void bdrv_drain_all(void)
 {
     BlockDriverState *bs;
@@ -1452,6 +1524,10 @@ void bdrv_drain_all(void)
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+                busy |= bdrv_drain_aio_context(bs);
+                continue;
+            }
             while (qemu_co_enter_next(&bs->throttled_reqs)) {
                 busy = true;
             }
@@ -1461,6 +1537,7 @@ void bdrv_drain_all(void)
     /* If requests are still pending there is a bug somewhere */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
         assert(QLIST_EMPTY(&bs->tracked_requests));
+        assert(!bs->in_flight);
         assert(qemu_co_queue_empty(&bs->throttled_reqs));
     }
 }
@@ -1504,6 +1581,9 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->io_limits          = bs_src->io_limits;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
     bs_dest->block_timer        = bs_src->block_timer;
+    bs_dest->block_timer_deadline = bs_src->block_timer_deadline;
+    bs_dest->block_timer_arm_bh = bs_src->block_timer_arm_bh;
+    bs_dest->block_timer_wake_bh = bs_src->block_timer_wake_bh;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -2223,7 +2303,7 @@ static int bdrv_rwv_co(BlockDriverState *bs, int64_t sector_num,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
     return rwco.ret;
@@ -2283,10 +2363,11 @@ int bdrv_writev(BlockDriverState *bs, int64_t sector_num, QEMUIOVector *qiov)
     return bdrv_rwv_co(bs, sector_num, qiov, true, 0);
 }
 
-int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, BdrvRequestFlags flags)
 {
     return bdrv_rw_co(bs, sector_num, NULL, nb_sectors, true,
-                      BDRV_REQ_ZERO_WRITE);
+                      BDRV_REQ_ZERO_WRITE | flags);
 }
 
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
@@ -2468,7 +2549,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     if (drv->bdrv_co_write_zeroes &&
         buffer_is_zero(bounce_buffer, iov.iov_len)) {
         ret = bdrv_co_do_write_zeroes(bs, cluster_sector_num,
-                                      cluster_nb_sectors);
+                                      cluster_nb_sectors, 0);
     } else {
         /* This does not change the data on the disk, it is not necessary
          * to flush even in cache=writethrough mode.
@@ -2574,7 +2655,7 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
 }
 
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
     QEMUIOVector qiov;
@@ -2586,7 +2667,7 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
 
     /* First try the efficient write zeroes operation */
     if (drv->bdrv_co_write_zeroes) {
-        ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+        ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors, flags);
         if (ret != -ENOTSUP) {
             return ret;
         }
@@ -2638,10 +2719,26 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
 
+    /* Checking the payload stops at the first non-zero byte, so this is cheap
+     * for normal writes */
+    if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
+        !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_write_zeroes &&
+        qemu_iovec_is_zero(qiov)) {
+        flags |= BDRV_REQ_ZERO_WRITE;
+        if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP &&
+            (bs->open_flags & BDRV_O_UNMAP)) {
+            flags |= BDRV_REQ_MAY_UNMAP;
+        }
+        bs->nr_detected_zero_ops++;
+        bs->nr_detected_zero_bytes += (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+        trace_bdrv_co_detect_zeroes(bs, sector_num, nb_sectors,
+                                    !!(flags & BDRV_REQ_MAY_UNMAP));
+    }
+
     if (ret < 0) {
         /* Do nothing, write notifier decided to fail this request */
     } else if (flags & BDRV_REQ_ZERO_WRITE) {
-        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
+        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors, flags);
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
@@ -2672,12 +2769,13 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
 }
 
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
-                                      int64_t sector_num, int nb_sectors)
+                                      int64_t sector_num, int nb_sectors,
+                                      BdrvRequestFlags flags)
 {
     trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
 
     return bdrv_co_do_writev(bs, sector_num, nb_sectors, NULL,
-                             BDRV_REQ_ZERO_WRITE);
+                             BDRV_REQ_ZERO_WRITE | flags);
 }
 
 /**
@@ -2789,6 +2887,33 @@ BlockErrorAction bdrv_get_error_action(BlockDriverState *bs, bool is_read, int e
     }
 }
 
+static void bdrv_do_error_action(BlockDriverState *bs, BlockErrorAction action,
+                                 bool is_read, int error)
+{
+    bdrv_emit_qmp_error_event(bs, QEVENT_BLOCK_IO_ERROR, action, is_read);
+    if (action == BDRV_ACTION_STOP) {
+        vm_stop(RUN_STATE_IO_ERROR);
+        bdrv_iostatus_set_err(bs, error);
+    }
+}
+
+typedef struct BdrvErrorActionBH {
+    QEMUBH *bh;
+    BlockDriverState *bs;
+    BlockErrorAction action;
+    bool is_read;
+    int error;
+} BdrvErrorActionBH;
+
+static void bdrv_error_action_bh(void *opaque)
+{
+    BdrvErrorActionBH *s = opaque;
+
+    bdrv_do_error_action(s->bs, s->action, s->is_read, s->error);
+    qemu_bh_delete(s->bh);
+    g_free(s);
+}
+
 /* This is done by device models because, while the block layer knows
  * about the error, it does not know whether an operation comes from
  * the device or the block layer (from a job, for example).
@@ -2796,12 +2921,24 @@ BlockErrorAction bdrv_get_error_action(BlockDriverState *bs, bool is_read, int e
 void bdrv_error_action(BlockDriverState *bs, BlockErrorAction action,
                        bool is_read, int error)
 {
+    BdrvErrorActionBH *s;
+
     assert(error >= 0);
-    bdrv_emit_qmp_error_event(bs, QEVENT_BLOCK_IO_ERROR, action, is_read);
-    if (action == BDRV_ACTION_STOP) {
-        vm_stop(RUN_STATE_IO_ERROR);
-        bdrv_iostatus_set_err(bs, error);
+    if (bdrv_get_aio_context(bs) == qemu_get_aio_context()) {
+        bdrv_do_error_action(bs, action, is_read, error);
+        return;
     }
+
+    /* The monitor and the VM run state belong to the main loop, so leave
+     * the event and the stop to it when the device runs in another thread.
+     */
+    s = g_new(BdrvErrorActionBH, 1);
+    s->bs = bs;
+    s->action = action;
+    s->is_read = is_read;
+    s->error = error;
+    s->bh = qemu_bh_new(bdrv_error_action_bh, s);
+    qemu_bh_schedule(s->bh);
 }
 
 int bdrv_is_read_only(BlockDriverState *bs)
@@ -2933,7 +3070,12 @@ int bdrv_flush_all(void)
     int result = 0;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        int ret = bdrv_flush(bs);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_flush(bs);
+        aio_context_release(aio_context);
         if (ret < 0 && !result) {
             result = ret;
         }
@@ -2999,6 +3141,15 @@ int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
         nb_sectors = n;
     }
 
+    if (bs->drv->bdrv_co_get_block_status) {
+        int64_t ret = bs->drv->bdrv_co_get_block_status(bs, sector_num,
+                                                        nb_sectors, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        return !!(ret & BDRV_BLOCK_ALLOCATED);
+    }
+
     if (!bs->drv->bdrv_co_is_allocated) {
         *pnum = nb_sectors;
         return 1;
@@ -3038,7 +3189,135 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    return data.ret;
+}
+
+/*
+ * Returns a combination of BDRV_BLOCK_* flags that describes the sectors
+ * starting at 'sector_num' in this image (not its backing files), or
+ * -errno.  'pnum' is set to the number of sectors that are known to be in
+ * the same state, as for bdrv_co_is_allocated().
+ *
+ * BDRV_BLOCK_DATA and BDRV_BLOCK_ZERO are only set when the driver knows
+ * for sure; if neither is set, the data must be read to find out.
+ */
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum)
+{
+    int64_t n, ret;
+
+    if (sector_num >= bs->total_sectors) {
+        *pnum = 0;
+        return 0;
+    }
+
+    n = bs->total_sectors - sector_num;
+    if (n < nb_sectors) {
+        nb_sectors = n;
+    }
+
+    if (!bs->drv->bdrv_co_get_block_status) {
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        return ret ? BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED : 0;
+    }
+
+    ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Reads beyond the end of the backing file return zeroes */
+    if (!(ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) && bs->backing_hd &&
+        sector_num >= bs->backing_hd->total_sectors) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+
+    return ret;
+}
+
+/*
+ * Like bdrv_co_get_block_status(), but looks through the backing files of
+ * 'top' down to (excluding) 'base' until it finds the image that determines
+ * the content of the sectors.  BDRV_BLOCK_ALLOCATED is set if that is one of
+ * the images in the chain.
+ */
+int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *top,
+                                                    BlockDriverState *base,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    BlockDriverState *p;
+    int64_t ret = 0;
+
+    for (p = top; p && p != base; p = p->backing_hd) {
+        ret = bdrv_co_get_block_status(p, sector_num, nb_sectors, pnum);
+        if (ret < 0 || (ret & (BDRV_BLOCK_ALLOCATED | BDRV_BLOCK_ZERO)) ||
+            *pnum == 0) {
+            break;
+        }
+        /* The following sectors may be allocated in this image again */
+        nb_sectors = *pnum;
+    }
+
+    if (p && p != top && *pnum == 0) {
+        /* A backing file that is shorter than the sectors in question */
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_ZERO;
+    }
+
+    return ret;
+}
+
+typedef struct BdrvCoGetBlockStatusData {
+    BlockDriverState *bs;
+    BlockDriverState *base;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int64_t ret;
+    bool done;
+} BdrvCoGetBlockStatusData;
+
+static void coroutine_fn bdrv_get_block_status_above_co_entry(void *opaque)
+{
+    BdrvCoGetBlockStatusData *data = opaque;
+
+    data->ret = bdrv_co_get_block_status_above(data->bs, data->base,
+                                               data->sector_num,
+                                               data->nb_sectors, data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_block_status_above().
+ *
+ * See bdrv_co_get_block_status_above() for details.
+ */
+int64_t bdrv_get_block_status_above(BlockDriverState *top,
+                                    BlockDriverState *base,
+                                    int64_t sector_num, int nb_sectors,
+                                    int *pnum)
+{
+    Coroutine *co;
+    BdrvCoGetBlockStatusData data = {
+        .bs = top,
+        .base = base,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    co = qemu_coroutine_create(bdrv_get_block_status_above_co_entry);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        aio_poll(bdrv_get_aio_context(top), true);
     }
     return data.ret;
 }
@@ -3127,7 +3406,7 @@ int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
     co = qemu_coroutine_create(bdrv_is_allocated_above_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(top), true);
     }
     return data.ret;
 }
@@ -3148,19 +3427,86 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num, wco->buf,
+                                        wco->nb_sectors);
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    if (!drv->bdrv_co_write_compressed) {
+        if (!drv->bdrv_write_compressed)
+            return -ENOTSUP;
+        if (bdrv_check_request(bs, sector_num, nb_sectors))
+            return -EIO;
+
+        assert(!bs->dirty_bitmap);
+
+        return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    return wco.ret;
+}
+
+/*
+ * Drivers without bdrv_co_write_compressed are called synchronously, and
+ * the caller must make sure that only one such request is in flight.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_write_compressed && !drv->bdrv_write_compressed) {
         return -ENOTSUP;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
         return -EIO;
+    }
 
     assert(!bs->dirty_bitmap);
 
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
@@ -3563,6 +3909,33 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     return 0;
 }
 
+/*
+ * Plugging lets a device queue all the requests it finds in one go and have
+ * them submitted together on unplug, e.g. with a single io_submit() call for
+ * Linux AIO.  Calls nest; the requests go out on the outermost unplug.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
     acb->aiocb_info->cancel(acb);
@@ -3786,7 +4159,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3831,7 +4204,7 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -3868,7 +4241,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3902,7 +4275,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3929,7 +4302,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4045,11 +4418,11 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs)
 {
     int ret;
 
-    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
+    if (!bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
         return 0;
     }
 
@@ -4108,6 +4481,20 @@ flush_parent:
     return bdrv_co_flush(bs->file);
 }
 
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    int ret;
+
+    if (!bs) {
+        return 0;
+    }
+
+    bs->in_flight++;
+    ret = bdrv_co_do_flush(bs);
+    bs->in_flight--;
+    return ret;
+}
+
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
@@ -4148,7 +4535,7 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -4162,8 +4549,8 @@ static void coroutine_fn bdrv_discard_co_entry(void *opaque)
     rwco->ret = bdrv_co_discard(rwco->bs, rwco->sector_num, rwco->nb_sectors);
 }
 
-int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
-                                 int nb_sectors)
+static int coroutine_fn bdrv_co_do_discard(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors)
 {
     if (!bs->drv) {
         return -ENOMEDIUM;
@@ -4203,6 +4590,17 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     }
 }
 
+int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors)
+{
+    int ret;
+
+    bs->in_flight++;
+    ret = bdrv_co_do_discard(bs, sector_num, nb_sectors);
+    bs->in_flight--;
+    return ret;
+}
+
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
 {
     Coroutine *co;
@@ -4220,7 +4618,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -4610,8 +5008,87 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (bs->block_timer_wake_bh) {
+        qemu_bh_delete(bs->block_timer_wake_bh);
+        bs->block_timer_wake_bh = NULL;
+    }
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+
+    if (bs->block_timer) {
+        bs->block_timer_wake_bh = aio_bh_new(new_context,
+                                             bdrv_block_timer_wake, bs);
+    }
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+}
+
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
+}
+
+bool bdrv_can_set_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return true;
+    }
+    if (bs->drv->bdrv_needs_main_loop) {
+        return false;
+    }
+    if (bs->file && !bdrv_can_set_aio_context(bs->file)) {
+        return false;
+    }
+    if (bs->backing_hd && !bdrv_can_set_aio_context(bs->backing_hd)) {
+        return false;
+    }
+    return true;
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
@@ -637,6 +637,7 @@ static BlockDriver bdrv_blkdebug = {
     .bdrv_debug_breakpoint      = blkdebug_debug_breakpoint,
     .bdrv_debug_resume          = blkdebug_debug_resume,
     .bdrv_debug_is_suspended    = blkdebug_debug_is_suspended,
+    .bdrv_needs_main_loop       = true,
 };
 
 static void bdrv_blkdebug_init(void)
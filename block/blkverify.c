@@ -412,6 +412,7 @@ static BlockDriver bdrv_blkverify = {
     .bdrv_aio_readv         = blkverify_aio_readv,
     .bdrv_aio_writev        = blkverify_aio_writev,
     .bdrv_aio_flush         = blkverify_aio_flush,
+    .bdrv_needs_main_loop   = true,
 };
 
 static void bdrv_blkverify_init(void)
@@ -639,6 +639,7 @@ static BlockDriver bdrv_http = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+    .bdrv_needs_main_loop   = true,
 };
 
 static BlockDriver bdrv_https = {
@@ -652,6 +653,7 @@ static BlockDriver bdrv_https = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+    .bdrv_needs_main_loop   = true,
 };
 
 static BlockDriver bdrv_ftp = {
@@ -665,6 +667,7 @@ static BlockDriver bdrv_ftp = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+    .bdrv_needs_main_loop   = true,
 };
 
 static BlockDriver bdrv_ftps = {
@@ -678,6 +681,7 @@ static BlockDriver bdrv_ftps = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+    .bdrv_needs_main_loop   = true,
 };
 
 static BlockDriver bdrv_tftp = {
@@ -691,6 +695,7 @@ static BlockDriver bdrv_tftp = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+    .bdrv_needs_main_loop   = true,
 };
 
 static void curl_block_init(void)
@@ -653,6 +653,8 @@ static BlockDriver bdrv_gluster = {
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
     .create_options               = qemu_gluster_create_options,
+
+    .bdrv_needs_main_loop         = true,
 };
 
 static BlockDriver bdrv_gluster_tcp = {
@@ -673,6 +675,8 @@ static BlockDriver bdrv_gluster_tcp = {
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
     .create_options               = qemu_gluster_create_options,
+
+    .bdrv_needs_main_loop         = true,
 };
 
 static BlockDriver bdrv_gluster_unix = {
@@ -693,6 +697,8 @@ static BlockDriver bdrv_gluster_unix = {
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
     .create_options               = qemu_gluster_create_options,
+
+    .bdrv_needs_main_loop         = true,
 };
 
 static BlockDriver bdrv_gluster_rdma = {
@@ -713,6 +719,8 @@ static BlockDriver bdrv_gluster_rdma = {
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
     .create_options               = qemu_gluster_create_options,
+
+    .bdrv_needs_main_loop         = true,
 };
 
 static void bdrv_gluster_init(void)
@@ -1329,6 +1329,8 @@ static BlockDriver bdrv_iscsi = {
     .bdrv_ioctl       = iscsi_ioctl,
     .bdrv_aio_ioctl   = iscsi_aio_ioctl,
 #endif
+
+    .bdrv_needs_main_loop = true,
 };
 
 static QemuOptsList qemu_iscsi_opts = {
@@ -12,6 +12,8 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -25,6 +27,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Maximum number of requests that are queued while plugged */
+#define MAX_QUEUED_IO  128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -33,15 +38,47 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    QSIMPLEQ_ENTRY(qemu_laiocb) node;
 };
 
+/*
+ * Requests that are prepared while the queue is plugged are only submitted,
+ * with a single io_submit() call, when it is unplugged or becomes full.
+ */
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    unsigned int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
     int count;
+    LaioQueue io_q;
+
+    /* requests that failed to submit, completed in order from a bottom half */
+    QSIMPLEQ_HEAD(, qemu_laiocb) failed;
+    QEMUBH *failed_bh;
 };
 
+/*
+ * The completion ring that the kernel maps at the address of the context,
+ * as in fs/aio.c.  Only the header is needed to see if it holds events.
+ */
+struct laio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define LAIO_RING_MAGIC 0xa10a10a1
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -77,34 +114,133 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Submits the queued requests.  Whatever the kernel does not take because
+ * it is out of resources stays queued while other requests are in flight,
+ * and is tried again when they complete; other failures complete the
+ * requests with the error.  This may run inside laio_submit(), so the
+ * callbacks are not called from here.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    int ret, i, len;
+
+    while (s->io_q.idx > 0) {
+        len = s->io_q.idx;
+        do {
+            ret = io_submit(s->ctx, len, s->io_q.iocbs);
+        } while (ret == -EINTR);
+
+        if (ret > 0) {
+            memmove(s->io_q.iocbs, s->io_q.iocbs + ret,
+                    (len - ret) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx = len - ret;
+            continue;
+        }
+
+        if (ret == -EAGAIN && s->count > len) {
+            break;
+        }
+
+        s->io_q.idx = 0;
+        for (i = 0; i < len; i++) {
+            struct qemu_laiocb *laiocb =
+                container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+            laiocb->ret = ret < 0 ? ret : -EIO;
+            QSIMPLEQ_INSERT_TAIL(&s->failed, laiocb, node);
+        }
+        qemu_bh_schedule(s->failed_bh);
+    }
+}
+
+static void qemu_laio_failed_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QSIMPLEQ_FIRST(&s->failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, node);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+/*
+ * Returns whether the ring of a context holds completions, without making a
+ * system call.  Returns false if the ring does not have the expected layout,
+ * which only costs the benefit of polling.
+ */
+bool laio_ring_has_events(io_context_t io_ctx)
+{
+    struct laio_ring *ring = (struct laio_ring *)io_ctx;
+
+    if (ring->magic != LAIO_RING_MAGIC || ring->incompat_features) {
+        return false;
+    }
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
+}
+
+static void qemu_laio_process_events(struct qemu_laio_state *s)
+{
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i;
+
+    do {
+        nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+    } while (nevents == -EINTR);
+
+    for (i = 0; i < nevents; i++) {
+        struct iocb *iocb = events[i].obj;
+        struct qemu_laiocb *laiocb =
+                container_of(iocb, struct qemu_laiocb, iocb);
+
+        laiocb->ret = io_event_ret(&events[i]);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
     while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
+        qemu_laio_process_events(s);
+    }
 
-        do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+    /* requests that did not fit may go now */
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+}
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+static bool qemu_laio_poll_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
-        }
+    if (!laio_ring_has_events(s->ctx)) {
+        return false;
     }
+
+    /* the kernel signals the eventfd as well, clear it to save a wakeup */
+    event_notifier_test_and_clear(&s->e);
+    qemu_laio_process_events(s);
+
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+    return true;
 }
 
 static int qemu_laio_flush_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
+    /* nothing would complete a request that is still queued */
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -117,6 +253,16 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* the request may not have reached the kernel yet */
+    if (laiocb->ctx->io_q.idx > 0) {
+        ioq_submit(laiocb->ctx);
+        if (laiocb->ret != -EINPROGRESS) {
+            /* failed, the bottom half only has to free it */
+            laiocb->ret = -ECANCELED;
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -179,6 +325,24 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
+    if (s->io_q.plugged || s->io_q.idx > 0) {
+        /* only EAGAIN leaves the queue full, give the kernel another go */
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            ioq_submit(s);
+        }
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            laiocb->ret = -EAGAIN;
+            QSIMPLEQ_INSERT_TAIL(&s->failed, laiocb, node);
+            qemu_bh_schedule(s->failed_bh);
+            return &laiocb->common;
+        }
+        s->io_q.iocbs[s->io_q.idx++] = iocbs;
+        if (s->io_q.idx == MAX_QUEUED_IO || !s->io_q.plugged) {
+            ioq_submit(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -190,6 +354,43 @@ out_free_aiocb:
     return NULL;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+}
+
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    assert(QSIMPLEQ_EMPTY(&s->failed));
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+    qemu_bh_delete(s->failed_bh);
+    s->failed_bh = NULL;
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    s->failed_bh = aio_bh_new(new_context, qemu_laio_failed_bh, s);
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb,
+                           qemu_laio_flush_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -203,8 +404,7 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
-    qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb,
-                                qemu_laio_flush_cb);
+    QSIMPLEQ_INIT(&s->failed);
 
     return s;
 
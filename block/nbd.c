@@ -660,6 +660,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_needs_main_loop = true,
 };
 
 static BlockDriver bdrv_nbd_tcp = {
@@ -674,6 +675,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_needs_main_loop = true,
 };
 
 static BlockDriver bdrv_nbd_unix = {
@@ -688,6 +690,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_needs_main_loop = true,
 };
 
 static void bdrv_nbd_init(void)
@@ -221,6 +221,7 @@ void bdrv_query_info(BlockDriverState *bs,
         }
 
         info->inserted->backing_file_depth = bdrv_get_backing_file_depth(bs);
+        info->inserted->detect_zeroes = bs->detect_zeroes;
 
         if (bs->io_limits_enabled) {
             info->inserted->bps =
@@ -283,6 +284,14 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->wr_zero_detected_operations = bs->nr_detected_zero_ops;
+    s->stats->wr_zero_detected_bytes = bs->nr_detected_zero_bytes;
+
+    if (bs->drv && bs->drv->bdrv_get_metadata_cache_stats) {
+        s->has_metadata_cache = true;
+        s->metadata_cache = g_malloc0(sizeof(*s->metadata_cache));
+        bs->drv->bdrv_get_metadata_cache_stats(bs, s->metadata_cache);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -27,21 +27,119 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables are found through a hash of their offset, and the entry to
+ * replace is the least recently used one that nobody holds a reference to.
+ * The LRU list links all entries, most recently used first; entries are
+ * referred to by index, -1 ending a list.
+ */
+
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;
+    int     lru_prev;
+    int     lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    /* all tables in one allocation, entry i at i * cluster_size */
+    uint8_t*                tables;
+    int*                    buckets;
+    unsigned                hash_bits;
+    int                     lru_head;
+    int                     lru_tail;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     cluster_bits;
     bool                    depends_on_flush;
+    /* tables were written since the last flush */
+    bool                    unflushed;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + ((size_t)i << c->cluster_bits);
+}
+
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t off = (uint8_t *)table - c->tables;
+    int i = off >> c->cluster_bits;
+
+    assert(off >= 0 && i < c->size && table == qcow2_cache_table(c, i));
+    return i;
+}
+
+static unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset >> c->cluster_bits) * 0x9e3779b97f4a7c15ULL)
+           >> (64 - c->hash_bits);
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_lru_unlink(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    if (e->lru_prev >= 0) {
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        c->lru_head = e->lru_next;
+    }
+    if (e->lru_next >= 0) {
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        c->lru_tail = e->lru_prev;
+    }
+}
+
+static void qcow2_cache_lru_push_front(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    e->lru_prev = -1;
+    e->lru_next = c->lru_head;
+    if (c->lru_head >= 0) {
+        c->entries[c->lru_head].lru_prev = i;
+    } else {
+        c->lru_tail = i;
+    }
+    c->lru_head = i;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -50,10 +148,22 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->cluster_bits = s->cluster_bits;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables << s->cluster_bits);
 
+    /* about two buckets per table keeps the chains short */
+    c->hash_bits = 1;
+    while ((1 << c->hash_bits) < 2 * num_tables) {
+        c->hash_bits++;
+    }
+    c->buckets = g_malloc(sizeof(*c->buckets) << c->hash_bits);
+    memset(c->buckets, -1, sizeof(*c->buckets) << c->hash_bits);
+
+    c->lru_head = c->lru_tail = -1;
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
+        qcow2_cache_lru_push_front(c, i);
     }
 
     return c;
@@ -65,22 +175,53 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, int64_t *size, int64_t *hits,
+                           int64_t *misses)
+{
+    *size = (int64_t)c->size << c->cluster_bits;
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
+static bool qcow2_cache_is_stable(Qcow2Cache *c)
+{
+    int i;
+
+    if (c->unflushed) {
+        return false;
+    }
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
 
-    ret = qcow2_cache_flush(bs, c->depends);
-    if (ret < 0) {
-        return ret;
+    /*
+     * Allocations from the same batch of clusters keep making the L2 cache
+     * depend on the refcount cache; once that is on disk, there is nothing
+     * left to wait for.
+     */
+    if (!qcow2_cache_is_stable(c->depends)) {
+        ret = qcow2_cache_flush(bs, c->depends);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     c->depends = NULL;
@@ -120,13 +261,14 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_table(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
 
     c->entries[i].dirty = false;
+    c->unflushed = true;
 
     return 0;
 }
@@ -151,6 +293,8 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         ret = bdrv_flush(bs->file);
         if (ret < 0) {
             result = ret;
+        } else {
+            c->unflushed = false;
         }
     }
 
@@ -188,31 +332,16 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
     int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
 
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    for (i = c->lru_tail; i >= 0; i = c->entries[i].lru_prev) {
+        if (!c->entries[i].ref) {
+            return i;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -226,11 +355,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -247,28 +377,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    qcow2_cache_lru_unlink(c, i);
+    qcow2_cache_lru_push_front(c, i);
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_table(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -288,18 +421,34 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
-int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+/*
+ * Returns the table at @offset like qcow2_cache_get(), but only if it is
+ * cached already, and -ENOENT otherwise.  This never yields, so the cache
+ * cannot change under the caller, who therefore need not hold s->lock.
+ */
+int qcow2_cache_get_cached(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
+    c->hits++;
+    qcow2_cache_lru_unlink(c, i);
+    qcow2_cache_lru_push_front(c, i);
+    c->entries[i].ref++;
+    *table = qcow2_cache_table(c, i);
+
+    return 0;
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = qcow2_cache_table_index(c, *table);
+
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +458,5 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
-    c->entries[i].dirty = true;
+    c->entries[qcow2_cache_table_index(c, table)].dirty = true;
 }
@@ -183,7 +183,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         return l2_offset;
     }
@@ -205,7 +205,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -256,40 +256,44 @@ fail:
 }
 
 /*
- * Checks how many clusters in a given L2 table are contiguous in the image
- * file. As soon as one of the flags in the bitmask stop_flags changes compared
- * to the first cluster, the search is stopped and the cluster is not counted
- * as contiguous. (This allows it, for example, to stop at the first compressed
- * cluster which may require a different handling)
+ * Checks how many subclusters, starting at subcluster sc_index of the cluster
+ * at l2_index and looking at no more than nb_subclusters, have the same type
+ * as the first one.  For allocated subclusters, the host clusters must be
+ * contiguous in the image file as well, and as soon as one of the flags in the
+ * bitmask stop_flags changes compared to the first cluster, the search is
+ * stopped and the cluster is not counted as contiguous.  (This allows it, for
+ * example, to stop at the first cluster that needs COW.)
+ *
+ * Without extended L2 entries, each cluster is a single subcluster.
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t start, uint64_t stop_flags)
+static int count_contiguous_subclusters(BlockDriverState *bs,
+    int nb_subclusters, unsigned int sc_index, uint64_t *l2_table,
+    int l2_index, uint64_t stop_flags)
 {
-    int i;
+    BDRVQcowState *s = bs->opaque;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK;
-    uint64_t offset = be64_to_cpu(l2_table[0]) & mask;
-
-    if (!offset)
-        return 0;
-
-    for (i = start; i < start + nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
-            break;
-        }
-    }
-
-	return (i - start);
-}
-
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
-{
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t expected_offset = l2_entry & mask;
+    int type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index);
     int i;
 
-    for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
-
-        if (type != QCOW2_CLUSTER_UNALLOCATED) {
+    assert(type != QCOW2_CLUSTER_COMPRESSED);
+
+    for (i = 0; i < nb_subclusters; i++, sc_index++) {
+        if (sc_index == s->subclusters_per_cluster) {
+            sc_index = 0;
+            l2_index++;
+            l2_entry = get_l2_entry(s, l2_table, l2_index);
+            l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+            expected_offset += s->cluster_size;
+            if (type == QCOW2_CLUSTER_NORMAL &&
+                (l2_entry & mask) != expected_offset) {
+                break;
+            }
+        }
+        if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index)
+            != type) {
             break;
         }
     }
@@ -393,16 +397,20 @@ out:
  * on exit, *num is the number of contiguous sectors we can read.
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
- * cases.
+ * cases.  With extended L2 entries, this is the type of the subclusters
+ * that the *num sectors are in.  @cached_only and @copied_only are for
+ * qcow2_get_cluster_offset_cached().
  */
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int *num, uint64_t *cluster_offset)
+static int get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool cached_only, bool copied_only)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset, *l2_table;
+    uint64_t l2_entry, l2_bitmap;
+    uint64_t stop_flags = QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO;
     int l1_bits, c;
-    unsigned int index_in_cluster, nb_clusters;
+    unsigned int index_in_cluster, sc_index, nb_subclusters;
     uint64_t nb_available, nb_needed;
     int ret;
 
@@ -443,7 +451,15 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    if (cached_only) {
+        ret = qcow2_cache_get_cached(bs, s->l2_table_cache, l2_offset,
+                                     (void**) &l2_table);
+        if (ret == -ENOENT) {
+            return -EAGAIN;
+        }
+    } else {
+        ret = l2_load(bs, l2_offset, &l2_table);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -451,36 +467,56 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
-    nb_clusters = size_to_clusters(s, nb_needed << 9);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_table, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    nb_subclusters = size_to_subclusters(s, nb_needed << 9) - sc_index;
+
+    ret = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index);
+    if (ret < 0) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        return ret;
+    }
+    if (copied_only && ret == QCOW2_CLUSTER_NORMAL) {
+        /* Clusters that are shared with a snapshot need a COW */
+        if (!(l2_entry & QCOW_OFLAG_COPIED)) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+            return -EAGAIN;
+        }
+        stop_flags |= QCOW_OFLAG_COPIED;
+    }
 
-    ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
+        if (cached_only) {
+            /* decompressing needs s->cluster_cache */
+            qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+            return -EAGAIN;
+        }
         /* Compressed clusters can only be processed one by one */
-        c = 1;
-        *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        c = s->subclusters_per_cluster - sc_index;
+        *cluster_offset = l2_entry & L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
     case QCOW2_CLUSTER_ZERO:
         if (s->qcow_version < 3) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
             return -EIO;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
-                QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
+        c = count_contiguous_subclusters(bs, nb_subclusters, sc_index,
+                                         l2_table, l2_index, stop_flags);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_subclusters(bs, nb_subclusters, sc_index,
+                                         l2_table, l2_index, stop_flags);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
-                QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
-        *cluster_offset &= L2E_OFFSET_MASK;
+        c = count_contiguous_subclusters(bs, nb_subclusters, sc_index,
+                                         l2_table, l2_index, stop_flags);
+        *cluster_offset = l2_entry & L2E_OFFSET_MASK;
         break;
     default:
         abort();
@@ -488,7 +524,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
 
-    nb_available = (c * s->cluster_sectors);
+    nb_available = (sc_index + c) * s->subcluster_sectors;
 
 out:
     if (nb_available > nb_needed)
@@ -499,6 +535,64 @@ out:
     return ret;
 }
 
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, false, false);
+}
+
+/*
+ * Returns true if any of the @num sectors at @offset belong to a cluster
+ * allocation that is still in flight.
+ */
+static bool overlaps_cluster_alloc(BDRVQcowState *s, uint64_t offset, int num)
+{
+    QCowL2Meta *m;
+    uint64_t end = offset + ((uint64_t) num << BDRV_SECTOR_BITS);
+
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (offset < l2meta_cow_end(m) && end > l2meta_cow_start(m)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Like qcow2_get_cluster_offset(), but only looks at L2 tables that are
+ * cached already and never yields.  Since coroutines only switch when
+ * they yield, the mapping it returns is consistent without s->lock, which
+ * lets requests to allocated clusters proceed while another request holds
+ * the lock for a slow metadata update.
+ *
+ * If @for_write is true, only clusters that can be overwritten in place
+ * are returned, i.e. allocated ones that need no COW and no other request
+ * is allocating at the moment; the return value is QCOW2_CLUSTER_NORMAL.
+ *
+ * Returns -EAGAIN if the caller must take s->lock and use the slow path
+ * (qcow2_get_cluster_offset() or qcow2_alloc_cluster_offset()) instead,
+ * in which case *num is left untouched.
+ */
+int qcow2_get_cluster_offset_cached(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool for_write)
+{
+    BDRVQcowState *s = bs->opaque;
+    int n = *num;
+    int ret;
+
+    ret = get_cluster_offset(bs, offset, &n, cluster_offset, true, for_write);
+    if (ret < 0) {
+        return ret;
+    }
+    if (for_write && (ret != QCOW2_CLUSTER_NORMAL ||
+                      overlaps_cluster_alloc(s, offset, n))) {
+        return -EAGAIN;
+    }
+
+    *num = n;
+    return ret;
+}
+
 /*
  * get_cluster_table
  *
@@ -550,7 +644,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -595,7 +689,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -619,7 +713,11 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        /* compressed clusters don't have subclusters */
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -657,6 +755,26 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns the subcluster bitmap of cluster @i of the allocation @m once the
+ * request has completed: the subclusters written by the request and its COW
+ * are allocated, and the others stay as they were in @old_bitmap.
+ */
+static uint64_t l2meta_bitmap(BDRVQcowState *s, QCowL2Meta *m, int i,
+                              uint64_t old_bitmap)
+{
+    int64_t cluster_start = m->offset + ((int64_t) i << s->cluster_bits);
+    int64_t start = MAX((int64_t) l2meta_cow_start(m) - cluster_start, 0);
+    int64_t end = MIN((int64_t) l2meta_cow_end(m) - cluster_start,
+                      s->cluster_size);
+    int first_sc = start >> s->subcluster_bits;
+    int last_sc = size_to_subclusters(s, end);
+
+    assert(start < end);
+    return (old_bitmap & ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc))
+           | QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc);
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
@@ -696,18 +814,28 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
 
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t new_offset = cluster_offset + (i << s->cluster_bits);
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
-	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+	 * old cluster. This is what this loop does.  Writes to unallocated
+	 * subclusters keep the host cluster, which mustn't be freed. */
+        if (old_entry != 0 && (old_entry & L2E_OFFSET_MASK) != new_offset) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
-     }
+        set_l2_entry(s, l2_table, l2_index + i,
+                     new_offset | QCOW_OFLAG_COPIED);
+        if (has_subclusters(s)) {
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          l2meta_bitmap(s, m, i, old_bitmap));
+        }
+    }
 
 
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
@@ -724,7 +852,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -743,12 +871,26 @@ err:
 static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     uint64_t *l2_table, int l2_index)
 {
+    int first_type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                         l2_index));
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
+        /*
+         * With subclusters, only the written subclusters of a cluster that
+         * had no host cluster need COW, but all data of one that had must
+         * move.  Keep the two kinds apart so that a single pair of COW
+         * regions fits all clusters of the allocation.
+         */
+        if (has_subclusters(s) &&
+            (cluster_type == QCOW2_CLUSTER_UNALLOCATED) !=
+            (first_type == QCOW2_CLUSTER_UNALLOCATED)) {
+            goto out;
+        }
+
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -797,6 +939,16 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /*
+         * A second write to another subcluster of the same cluster would
+         * allocate a second host cluster for it, or update the same L2
+         * entry, so wait for the whole cluster.
+         */
+        if (has_subclusters(s)) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -838,7 +990,8 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
  * *host_offset is not zero, only physically contiguous clusters beginning at
- * this host offset are counted.
+ * this host offset are counted.  With extended L2 entries, this only counts
+ * allocated subclusters.
  *
  * Note that guest_offset may not be cluster aligned. In this case, the
  * returned *host_offset points to exact byte referenced by guest_offset and
@@ -863,8 +1016,9 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     int l2_index;
     uint64_t cluster_offset;
     uint64_t *l2_table;
-    unsigned int nb_clusters;
-    unsigned int keep_clusters;
+    unsigned int sc_index, nb_subclusters;
+    unsigned int keep_subclusters;
+    int type;
     int ret, pret;
 
     trace_qcow2_handle_copied(qemu_coroutine_self(), guest_offset, *host_offset,
@@ -874,14 +1028,16 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of subclusters to look for. We stop at L2 table
      * boundaries to keep things simple.
      */
-    nb_clusters =
-        size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
-
     l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    sc_index = offset_to_sc_index(s, guest_offset);
+    nb_subclusters =
+        size_to_subclusters(s, offset_into_cluster(s, guest_offset) + *bytes);
+    nb_subclusters = MIN(nb_subclusters,
+                         (s->l2_size - l2_index) * s->subclusters_per_cluster);
+    nb_subclusters -= sc_index;
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -889,15 +1045,20 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
+    type = qcow2_get_subcluster_type(s, cluster_offset,
+                                     get_l2_bitmap(s, l2_table, l2_index),
+                                     sc_index);
+    if (type < 0) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        return type;
+    }
 
     /* Check how many clusters are already allocated and don't need COW */
-    if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
-        && (cluster_offset & QCOW_OFLAG_COPIED))
-    {
+    if (type == QCOW2_CLUSTER_NORMAL && (cluster_offset & QCOW_OFLAG_COPIED)) {
         /* If a specific host_offset is required, check it */
-        bool offset_matches =
-            (cluster_offset & L2E_OFFSET_MASK) == *host_offset;
+        bool offset_matches = (cluster_offset & L2E_OFFSET_MASK)
+                              == start_of_cluster(s, *host_offset);
 
         if (*host_offset != 0 && !offset_matches) {
             *bytes = 0;
@@ -906,15 +1067,15 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         }
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
-        keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], 0,
-                                      QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
-        assert(keep_clusters <= nb_clusters);
+        keep_subclusters =
+            count_contiguous_subclusters(bs, nb_subclusters, sc_index,
+                                         l2_table, l2_index,
+                                         QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+        assert(keep_subclusters <= nb_subclusters);
 
         *bytes = MIN(*bytes,
-                 keep_clusters * s->cluster_size
-                 - offset_into_cluster(s, guest_offset));
+                 ((uint64_t) keep_subclusters << s->subcluster_bits)
+                 - (guest_offset - start_of_subcluster(s, guest_offset)));
 
         ret = 1;
     } else {
@@ -960,29 +1121,22 @@ out:
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *host_offset, unsigned int *nb_clusters)
 {
-    BDRVQcowState *s = bs->opaque;
+    int64_t cluster_offset;
+    int n = *nb_clusters;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
-        if (cluster_offset < 0) {
-            return cluster_offset;
-        }
-        *host_offset = cluster_offset;
-        return 0;
-    } else {
-        int ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
-        if (ret < 0) {
-            return ret;
-        }
-        *nb_clusters = ret;
-        return 0;
+    cluster_offset = qcow2_alloc_data_clusters(bs, *host_offset, &n);
+    if (cluster_offset < 0) {
+        return cluster_offset;
     }
+
+    *host_offset = cluster_offset;
+    *nb_clusters = n;
+    return 0;
 }
 
 /*
@@ -990,6 +1144,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
  * copy on write. If *host_offset is non-zero, clusters are only allocated if
  * the new allocation can match the specified host offset.
  *
+ * With extended L2 entries, unallocated subclusters of a cluster that already
+ * has a host cluster are allocated in that host cluster instead.
+ *
  * Note that guest_offset may not be cluster aligned. In this case, the
  * returned *host_offset points to exact byte referenced by guest_offset and
  * therefore isn't cluster aligned as well.
@@ -1011,8 +1168,9 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index;
     uint64_t *l2_table;
-    uint64_t entry;
+    uint64_t entry, l2_bitmap = 0;
     unsigned int nb_clusters;
+    bool keep_host_cluster, partial_cow;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1037,15 +1195,34 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
+
+    /*
+     * Writes to unallocated subclusters of a cluster that has a host cluster
+     * already, and isn't shared, go to that host cluster.
+     */
+    keep_host_cluster = has_subclusters(s) &&
+                        qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+                        (entry & QCOW_OFLAG_COPIED);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (keep_host_cluster) {
+        nb_clusters = 1;
+        l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    } else if (entry & QCOW_OFLAG_COMPRESSED) {
+        /* For the moment, overwrite compressed clusters one by one */
         nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
     }
 
+    /*
+     * Only the written subclusters need COW unless there is data to move
+     * to the new host clusters.
+     */
+    partial_cow = has_subclusters(s) &&
+                  (keep_host_cluster ||
+                   qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_UNALLOCATED);
+
     /* This function is only called when there were no non-COW clusters, so if
      * we can't find any unallocated or COW clusters either, something is
      * wrong with our code. */
@@ -1056,18 +1233,29 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    /* Allocate, if necessary at a given offset in the image file */
-    alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
-    }
+    if (keep_host_cluster) {
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
 
-    /* Can't extend contiguous allocation */
-    if (nb_clusters == 0) {
-        *bytes = 0;
-        return 0;
+        /* Can't extend contiguous allocation */
+        if (*host_offset &&
+            start_of_cluster(s, *host_offset) != alloc_cluster_offset) {
+            *bytes = 0;
+            return 0;
+        }
+    } else {
+        /* Allocate, if necessary at a given offset in the image file */
+        alloc_cluster_offset = start_of_cluster(s, *host_offset);
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Can't extend contiguous allocation */
+        if (nb_clusters == 0) {
+            *bytes = 0;
+            return 0;
+        }
     }
 
     /*
@@ -1083,6 +1271,10 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * nb_sectors: The number of sectors from the start of the first
      * newly allocated cluster to the end of the area that the write
      * request actually writes to (excluding COW at the end)
+     *
+     * cow_start_sector, cow_end_sector: Where the COW before the request
+     * starts and where the one after it ends, counted from the start of
+     * the first newly allocated cluster.
      */
     int requested_sectors =
         (*bytes + offset_into_cluster(s, guest_offset))
@@ -1092,8 +1284,31 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    int cow_start_sector = 0;
+    int cow_end_sector = avail_sectors;
     QCowL2Meta *old_m = *m;
 
+    if (partial_cow) {
+        int first_sc = alloc_n_start / s->subcluster_sectors;
+        int last_sc = (nb_sectors - 1) / s->subcluster_sectors;
+
+        cow_start_sector = first_sc * s->subcluster_sectors;
+        cow_end_sector = (last_sc + 1) * s->subcluster_sectors;
+
+        /*
+         * Allocated subclusters can be written concurrently by requests that
+         * don't take s->lock, so they must not be copied onto themselves.
+         */
+        if (keep_host_cluster) {
+            if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(first_sc)) {
+                cow_start_sector = alloc_n_start;
+            }
+            if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(last_sc)) {
+                cow_end_sector = nb_sectors;
+            }
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1105,12 +1320,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .nb_available   = nb_sectors,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = cow_start_sector * BDRV_SECTOR_SIZE,
+            .nb_sectors = alloc_n_start - cow_start_sector,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sector - nb_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1336,14 +1551,17 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_table, l2_index + i, 0);
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_table, l2_index + i, 0);
+        }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
@@ -1399,16 +1617,17 @@ fail:
 }
 
 /*
- * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
- * clusters.
+ * This zeroes as many subclusters of nb_subclusters as possible at once (i.e.
+ * all subclusters in the same L2 table) and returns the number of zeroed
+ * subclusters.  Without extended L2 entries, subclusters are clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
-    unsigned int nb_clusters)
+    unsigned int nb_subclusters, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l2_table;
     int l2_index;
+    unsigned int sc_index, n;
     int ret;
     int i;
 
@@ -1417,36 +1636,70 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_subclusters to one L2 table */
+    sc_index = offset_to_sc_index(s, offset);
+    nb_subclusters = MIN(nb_subclusters,
+                         (s->l2_size - l2_index) * s->subclusters_per_cluster
+                         - sc_index);
 
-    for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_offset;
+    for (i = 0; i < nb_subclusters; i += n, sc_index = 0, l2_index++) {
+        uint64_t old_offset, free_entry;
+        bool unmap;
+
+        n = MIN(nb_subclusters - i, s->subclusters_per_cluster - sc_index);
+        old_offset = get_l2_entry(s, l2_table, l2_index);
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        /* Only whole clusters can be given back.  A preallocated zero
+         * cluster is freed like a normal one. */
+        unmap = (flags & BDRV_REQ_MAY_UNMAP) &&
+                n == s->subclusters_per_cluster;
+        free_entry = (old_offset & QCOW_OFLAG_COMPRESSED) ?
+                     old_offset : old_offset & ~QCOW_OFLAG_ZERO;
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
-            qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
+        if (has_subclusters(s)) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+            if ((old_offset & QCOW_OFLAG_COMPRESSED) || unmap) {
+                /* Compressed clusters can only be zeroed as a whole */
+                if (n < s->subclusters_per_cluster) {
+                    ret = -ENOTSUP;
+                    goto out;
+                }
+                set_l2_entry(s, l2_table, l2_index, 0);
+                bitmap = 0;
+                qcow2_free_any_clusters(bs, free_entry, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            /* Otherwise the host cluster, if any, stays allocated */
+            bitmap &= ~QCOW_OFLAG_SUB_ALLOC_RANGE(sc_index, sc_index + n);
+            bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(sc_index, sc_index + n);
+            set_l2_bitmap(s, l2_table, l2_index, bitmap);
+        } else if ((old_offset & QCOW_OFLAG_COMPRESSED) || unmap) {
+            set_l2_entry(s, l2_table, l2_index, QCOW_OFLAG_ZERO);
+            qcow2_free_any_clusters(bs, free_entry, 1,
+                                    QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index, old_offset | QCOW_OFLAG_ZERO);
         }
     }
+    ret = nb_subclusters;
 
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    if (ret < 0) {
-        return ret;
+out:
+    i = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (i < 0) {
+        return i;
     }
 
-    return nb_clusters;
+    return ret;
 }
 
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    unsigned int nb_clusters;
+    unsigned int nb_subclusters;
     int ret;
 
     /* The zero flag is only supported by version 3 and newer */
@@ -1455,18 +1708,18 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
     }
 
     /* Each L2 table is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
+    nb_subclusters = size_to_subclusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     s->cache_discards = true;
 
-    while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
+    while (nb_subclusters > 0) {
+        ret = zero_single_l2(bs, offset, nb_subclusters, flags);
         if (ret < 0) {
             goto fail;
         }
 
-        nb_clusters -= ret;
-        offset += (ret * s->cluster_size);
+        nb_subclusters -= ret;
+        offset += (uint64_t) ret << s->subcluster_bits;
     }
 
     ret = 0;
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -703,6 +704,130 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Refills the data cluster allocation window with at least nb_clusters
+ * clusters.  If possible, the new window directly follows the old one, so
+ * that sequentially written data stays contiguous on the host.
+ */
+static int alloc_window_refill(BlockDriverState *bs, int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    assert(s->alloc_window_offset == s->alloc_window_end);
+
+    nb_clusters = MAX(nb_clusters,
+                      QCOW2_ALLOC_WINDOW_SIZE >> s->cluster_bits);
+
+    if (s->alloc_window_end != 0) {
+        ret = qcow2_alloc_clusters_at(bs, s->alloc_window_end, nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret > 0) {
+            s->alloc_window_end += (uint64_t) ret << s->cluster_bits;
+            goto out;
+        }
+    }
+
+    offset = qcow2_alloc_clusters(bs, (int64_t) nb_clusters << s->cluster_bits);
+    if (offset < 0) {
+        return offset;
+    }
+    s->alloc_window_offset = offset;
+    s->alloc_window_end = offset + ((uint64_t) nb_clusters << s->cluster_bits);
+
+out:
+    trace_qcow2_alloc_window_refill(qemu_coroutine_self(),
+                                    s->alloc_window_offset,
+                                    s->alloc_window_end);
+    return 0;
+}
+
+/*
+ * Allocates up to *nb_clusters contiguous clusters for guest data and stores
+ * the number of clusters actually allocated in *nb_clusters.  If offset is
+ * non-zero, the allocation must start at this host offset; if this isn't
+ * possible, *nb_clusters is set to 0.
+ *
+ * With a writeback cache, the clusters are taken from a window that is
+ * allocated in one go, so that the refcount blocks are updated (and flushed
+ * before the L2 tables) once per window instead of once per request.  In
+ * writethrough mode every request flushes its metadata anyway, and there is
+ * no point in risking leaked clusters.
+ *
+ * Returns the host offset of the first cluster or -errno.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+    int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t avail;
+    int ret;
+
+    if (s->alloc_window_offset == s->alloc_window_end) {
+        if (!bs->enable_write_cache) {
+            if (offset == 0) {
+                return qcow2_alloc_clusters(bs,
+                    (int64_t) *nb_clusters << s->cluster_bits);
+            }
+        } else if (offset == 0 || offset == s->alloc_window_end) {
+            ret = alloc_window_refill(bs, *nb_clusters);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    if (offset != 0 && (offset != s->alloc_window_offset ||
+                        s->alloc_window_offset == s->alloc_window_end))
+    {
+        ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    avail = (s->alloc_window_end - s->alloc_window_offset) >> s->cluster_bits;
+    *nb_clusters = MIN(*nb_clusters, avail);
+
+    offset = s->alloc_window_offset;
+    s->alloc_window_offset += (uint64_t) *nb_clusters << s->cluster_bits;
+
+    return offset;
+}
+
+/*
+ * Drops the references to the clusters that are left in the data cluster
+ * allocation window.  Called on every flush as well as before closing the
+ * image, so that the refcounts on disk never include the window once the
+ * image is in a consistent state: after migration with shared storage, the
+ * destination owns the image and the source must not write anything to it
+ * any more.  If this doesn't happen, the clusters are leaked.
+ */
+int qcow2_release_alloc_window(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (s->alloc_window_offset == s->alloc_window_end) {
+        return 0;
+    }
+
+    ret = update_refcount(bs, s->alloc_window_offset,
+                          s->alloc_window_end - s->alloc_window_offset, -1,
+                          QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->alloc_window_offset = s->alloc_window_end = 0;
+    return 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -861,7 +986,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             }
 
             for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 if (offset != 0) {
                     old_offset = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
@@ -903,7 +1028,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                 s->refcount_block_cache);
                         }
-                        l2_table[j] = cpu_to_be64(offset);
+                        set_l2_entry(s, l2_table, j, offset);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                     }
                 }
@@ -1018,6 +1143,43 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/*
+ * Checks the subcluster allocation bitmap of an extended L2 entry for
+ * combinations that the specification does not allow.
+ */
+static void check_l2_bitmap(BlockDriverState *bs, BdrvCheckResult *res,
+    uint64_t l2_entry, uint64_t l2_bitmap)
+{
+    uint64_t alloc = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+    uint64_t zero = (l2_bitmap & QCOW_L2_BITMAP_ALL_ZEROES) >> 32;
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        if (l2_bitmap != 0) {
+            fprintf(stderr, "ERROR l2_entry=%" PRIx64 ": subcluster bitmap "
+                "%" PRIx64 " must be zero for compressed clusters\n",
+                l2_entry, l2_bitmap);
+            res->corruptions++;
+        }
+        return;
+    }
+
+    if (l2_entry & QCOW_OFLAG_ZERO) {
+        fprintf(stderr, "ERROR l2_entry=%" PRIx64 ": zero flag must not be "
+            "set with extended L2 entries\n", l2_entry);
+        res->corruptions++;
+    }
+    if (alloc && !(l2_entry & L2E_OFFSET_MASK)) {
+        fprintf(stderr, "ERROR l2_entry=%" PRIx64 ": subclusters %" PRIx64
+            " allocated without a host cluster\n", l2_entry, alloc);
+        res->corruptions++;
+    }
+    if (alloc & zero) {
+        fprintf(stderr, "ERROR l2_entry=%" PRIx64 ": subclusters %" PRIx64
+            " both allocated and zero\n", l2_entry, alloc & zero);
+        res->corruptions++;
+    }
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
@@ -1036,7 +1198,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, refcount;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->cluster_size;
     l2_table = g_malloc(l2_size);
 
     if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
@@ -1044,7 +1206,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            check_l2_bitmap(bs, res, l2_entry,
+                            get_l2_bitmap(s, l2_table, i));
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -311,6 +312,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Generate discard requests when other clusters are freed",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
         { /* end of list */ }
     },
 };
@@ -320,10 +331,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -423,10 +435,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     if (s->crypt_method_header) {
         bs->encrypted = 1;
     }
+    if (has_subclusters(s) && header.cluster_bits < MIN_CLUSTER_BITS_EXTL2) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "Extended L2 entries need "
+                      "a cluster size of at least %d bytes",
+                      1 << MIN_CLUSTER_BITS_EXTL2);
+        ret = -EINVAL;
+        goto fail;
+    }
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_bits = s->cluster_bits - ctz32(s->subclusters_per_cluster);
+    s->subcluster_size = 1 << s->subcluster_bits;
+    s->subcluster_sectors = 1 << (s->subcluster_bits - 9);
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - 3 - (has_subclusters(s) ? 1 : 0);
     s->l2_size = 1 << s->l2_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
@@ -469,9 +494,37 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         }
     }
 
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE,
+                                      L2_CACHE_SIZE * s->cluster_size)
+                    / s->cluster_size;
+    refcount_cache_size = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+                                            REFCOUNT_CACHE_SIZE *
+                                            s->cluster_size)
+                          / s->cluster_size;
+    /* More L2 tables than the image has would never be used */
+    l2_cache_size = MIN(l2_cache_size, MAX(s->l1_size, MIN_L2_CACHE_SIZE));
+    l2_cache_size = MAX(l2_cache_size, MIN_L2_CACHE_SIZE);
+    refcount_cache_size = MAX(refcount_cache_size, REFCOUNT_CACHE_SIZE);
+    if (refcount_cache_size > INT_MAX) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR,
+                      "Refcount cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -537,15 +590,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        qerror_report_err(local_err);
-        error_free(local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
@@ -560,6 +604,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
@@ -577,6 +622,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -640,24 +688,49 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 }
 
-static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
+static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t cluster_offset;
-    int ret;
+    int index_in_cluster, ret;
+    int64_t status = 0;
 
     *pnum = nb_sectors;
-    /* FIXME We can get errors here, but the bdrv_co_is_allocated interface
-     * can't pass them on today */
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
     qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
         *pnum = 0;
+        return ret;
+    }
+
+    switch (ret) {
+    case QCOW2_CLUSTER_UNALLOCATED:
+        /* Without a backing file, unallocated clusters read as zeroes */
+        if (!bs->backing_hd) {
+            status = BDRV_BLOCK_ZERO;
+        }
+        break;
+    case QCOW2_CLUSTER_ZERO:
+        status = BDRV_BLOCK_ZERO | BDRV_BLOCK_ALLOCATED;
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        status = BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED;
+        if (!s->crypt_method) {
+            index_in_cluster = sector_num & (s->cluster_sectors - 1);
+            status |= BDRV_BLOCK_OFFSET_VALID |
+                      (cluster_offset + (index_in_cluster << 9));
+        }
+        break;
+    case QCOW2_CLUSTER_COMPRESSED:
+        status = BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED;
+        break;
+    default:
+        abort();
     }
 
-    return (cluster_offset != 0) || (ret == QCOW2_CLUSTER_ZERO);
+    return status;
 }
 
 /* handle reading after the end of the backing file */
@@ -691,8 +764,6 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         /* prepare next request */
@@ -702,8 +773,21 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
         }
 
-        ret = qcow2_get_cluster_offset(bs, sector_num << 9,
-            &cur_nr_sectors, &cluster_offset);
+        /*
+         * Only take the lock if the L2 table must be loaded first, so that
+         * reads don't wait for allocating writes.  Compressed clusters keep
+         * it until they are decompressed into s->cluster_cache.
+         */
+        ret = qcow2_get_cluster_offset_cached(bs, sector_num << 9,
+            &cur_nr_sectors, &cluster_offset, false);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset);
+            if (ret != QCOW2_CLUSTER_COMPRESSED) {
+                qemu_co_mutex_unlock(&s->lock);
+            }
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -723,10 +807,8 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                     sector_num, cur_nr_sectors);
                 if (n1 > 0) {
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &hd_qiov);
-                    qemu_co_mutex_lock(&s->lock);
                     if (ret < 0) {
                         goto fail;
                     }
@@ -745,12 +827,14 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             /* add AIO support for compressed blocks ? */
             ret = qcow2_decompress_cluster(bs, cluster_offset);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
                 s->cluster_cache + index_in_cluster * 512,
                 512 * cur_nr_sectors);
+            qemu_co_mutex_unlock(&s->lock);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -777,11 +861,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -806,8 +888,6 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
@@ -837,8 +917,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -851,8 +929,20 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
         }
 
-        ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
-            index_in_cluster, n_end, &cur_nr_sectors, &cluster_offset, &l2meta);
+        /*
+         * Overwriting clusters that are allocated already only needs the
+         * lock if their L2 table isn't cached; allocations always take it.
+         */
+        cur_nr_sectors = n_end - index_in_cluster;
+        ret = qcow2_get_cluster_offset_cached(bs, sector_num << 9,
+            &cur_nr_sectors, &cluster_offset, true);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
+                index_in_cluster, n_end, &cur_nr_sectors, &cluster_offset,
+                &l2meta);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -881,36 +971,39 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 cur_nr_sectors * 512);
         }
 
-        qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
 
-        while (l2meta != NULL) {
-            QCowL2Meta *next;
+        if (l2meta != NULL) {
+            qemu_co_mutex_lock(&s->lock);
+            while (l2meta != NULL) {
+                QCowL2Meta *next;
 
-            ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
-            if (ret < 0) {
-                goto fail;
-            }
+                ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
+                if (ret < 0) {
+                    qemu_co_mutex_unlock(&s->lock);
+                    goto fail;
+                }
 
-            /* Take the request off the list of running requests */
-            if (l2meta->nb_clusters != 0) {
-                QLIST_REMOVE(l2meta, next_in_flight);
-            }
+                /* Take the request off the list of running requests */
+                if (l2meta->nb_clusters != 0) {
+                    QLIST_REMOVE(l2meta, next_in_flight);
+                }
 
-            qemu_co_queue_restart_all(&l2meta->dependent_requests);
+                qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
-            next = l2meta->next;
-            g_free(l2meta);
-            l2meta = next;
+                next = l2meta->next;
+                g_free(l2meta);
+                l2meta = next;
+            }
+            qemu_co_mutex_unlock(&s->lock);
         }
 
         remaining_sectors -= cur_nr_sectors;
@@ -921,8 +1014,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     while (l2meta != NULL) {
         QCowL2Meta *next;
 
@@ -948,6 +1039,7 @@ static void qcow2_close(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     g_free(s->l1_table);
 
+    qcow2_release_alloc_window(bs);
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -1129,6 +1221,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
             .name = "dirty bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -1325,6 +1422,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        header.incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         goto out;
@@ -1440,6 +1542,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTENDED_L2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTENDED_L2 : 0;
         }
         options++;
     }
@@ -1456,6 +1560,20 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        if (version < 3) {
+            fprintf(stderr, "Extended L2 entries only supported with "
+                    "compatibility level 1.1 and above (use compat=1.1 or "
+                    "greater)\n");
+            return -EINVAL;
+        }
+        if (cluster_size < (1 << MIN_CLUSTER_BITS_EXTL2)) {
+            fprintf(stderr, "Extended L2 entries need a cluster size of at "
+                    "least %dk\n", 1 << (MIN_CLUSTER_BITS_EXTL2 - 10));
+            return -EINVAL;
+        }
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                          cluster_size, prealloc, options, version);
 }
@@ -1481,20 +1599,21 @@ static int qcow2_make_empty(BlockDriverState *bs)
 }
 
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     int ret;
     BDRVQcowState *s = bs->opaque;
 
     /* Emulate misaligned zero writes */
-    if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
+    if (sector_num % s->subcluster_sectors ||
+        nb_sectors % s->subcluster_sectors) {
         return -ENOTSUP;
     }
 
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+        nb_sectors, flags);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -1554,13 +1673,60 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    void *dest;
+    int dest_size;
+    const void *src;
+    int src_size;
+    int ret;
+} Qcow2CompressData;
+
+/*
+ * Compresses src into dest.  Returns the compressed size, -ENOSPC if the data
+ * doesn't fit into dest and -EINVAL on other errors.  Runs in a worker thread.
+ */
+static int qcow2_compress(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        data->ret = -EINVAL;
+        return 0;
+    }
+
+    strm.avail_in = data->src_size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->dest_size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        data->ret = strm.next_out - (uint8_t *)data->dest;
+    } else if (ret == Z_OK) {
+        data->ret = -ENOSPC;
+    } else {
+        data->ret = -EINVAL;
+    }
+
+    deflateEnd(&strm);
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static int coroutine_fn qcow2_co_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    Qcow2CompressData data;
+    ThreadPool *pool;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -1583,8 +1749,8 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
             memset(pad_buf, 0, s->cluster_size);
             memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
             qemu_vfree(pad_buf);
         }
         return ret;
@@ -1592,47 +1758,40 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    /* Compression is what takes time, so let several requests do it at once
+     * in worker threads */
+    data = (Qcow2CompressData) {
+        .dest       = out_buf,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    thread_pool_submit_co(pool, qcow2_compress, &data);
+    out_len = data.ret;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == -ENOSPC || out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = out_len;
+        goto fail;
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -1650,6 +1809,12 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_release_alloc_window(bs);
+    if (ret < 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
@@ -1681,6 +1846,17 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_metadata_cache_stats(const BlockDriverState *bs,
+                                           BlockMetadataCacheStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &stats->l2_size,
+                          &stats->l2_hits, &stats->l2_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache, &stats->refcount_size,
+                          &stats->refcount_hits, &stats->refcount_misses);
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -1774,6 +1950,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTENDED_L2,
+        .type = OPT_FLAG,
+        .help = "Allocate clusters in 32 independent subclusters",
+    },
     { NULL }
 };
 
@@ -1786,7 +1967,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_create        = qcow2_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
-    .bdrv_co_is_allocated = qcow2_co_is_allocated,
+    .bdrv_co_get_block_status = qcow2_co_get_block_status,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1797,7 +1978,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1805,6 +1986,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_metadata_cache_stats = qcow2_get_metadata_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
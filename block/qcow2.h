@@ -46,12 +46,37 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1LL << 0)
 
+/* Subclusters per cluster with extended L2 entries */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+
+/* The second half of an extended L2 entry, the subcluster bitmap */
+#define QCOW_OFLAG_SUB_ALLOC(x)     (1ULL << (x))
+#define QCOW_OFLAG_SUB_ZERO(x)      (QCOW_OFLAG_SUB_ALLOC(x) << 32)
+/* Subclusters [x, y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(x, y) \
+    (QCOW_OFLAG_SUB_ALLOC(y) - QCOW_OFLAG_SUB_ALLOC(x))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(x, y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(x, y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC \
+    QCOW_OFLAG_SUB_ALLOC_RANGE(0, QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)
+#define QCOW_L2_BITMAP_ALL_ZEROES \
+    QCOW_OFLAG_SUB_ZERO_RANGE(0, QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Subclusters must be at least one sector */
+#define MIN_CLUSTER_BITS_EXTL2 14
+
+/* Data clusters are taken from a window of this many bytes that is allocated
+ * in a single refcount update */
+#define QCOW2_ALLOC_WINDOW_SIZE (8 * 1024 * 1024)
+
+/* Default and smallest cache sizes, in tables */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
@@ -63,6 +88,8 @@
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -120,8 +147,11 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 1,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY,
+    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -158,6 +188,11 @@ typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    /* Without extended L2 entries, a subcluster is the whole cluster */
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
+    int subclusters_per_cluster;
     int l2_bits;
     int l2_size;
     int l1_size;
@@ -182,6 +217,10 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* Data clusters that are counted as used, but not referenced yet */
+    uint64_t alloc_window_offset;
+    uint64_t alloc_window_end;
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -324,6 +363,60 @@ static inline int64_t align_offset(int64_t offset, int n)
     return offset;
 }
 
+static inline bool has_subclusters(BDRVQcowState *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline int64_t start_of_subcluster(BDRVQcowState *s, int64_t offset)
+{
+    return offset & ~(s->subcluster_size - 1);
+}
+
+static inline int size_to_subclusters(BDRVQcowState *s, int64_t size)
+{
+    return (size + (s->subcluster_size - 1)) >> s->subcluster_bits;
+}
+
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) & (s->subclusters_per_cluster - 1);
+}
+
+/* Size of an L2 table entry in uint64_t */
+static inline int l2_entry_size(BDRVQcowState *s)
+{
+    return has_subclusters(s) ? 2 : 1;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx * l2_entry_size(s)]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx * l2_entry_size(s)] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    if (!has_subclusters(s)) {
+        return 0;
+    }
+    return be64_to_cpu(l2_table[idx * 2 + 1]);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    l2_table[idx * 2 + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int qcow2_get_cluster_type(uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
@@ -337,6 +430,36 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * The type of subcluster @sc_index of the cluster described by @l2_entry and
+ * @l2_bitmap, or -EIO if the entry is invalid.  Without extended L2 entries
+ * this is the type of the cluster.  Compressed clusters have no subclusters.
+ */
+static inline int qcow2_get_subcluster_type(BDRVQcowState *s,
+                                            uint64_t l2_entry,
+                                            uint64_t l2_bitmap,
+                                            unsigned int sc_index)
+{
+    int type = qcow2_get_cluster_type(l2_entry);
+
+    if (!has_subclusters(s) || type == QCOW2_CLUSTER_COMPRESSED) {
+        return type;
+    } else if (type == QCOW2_CLUSTER_ZERO) {
+        /* The zero flag is reserved with extended L2 entries */
+        return -EIO;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        if (type == QCOW2_CLUSTER_UNALLOCATED ||
+            (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index))) {
+            return -EIO;
+        }
+        return QCOW2_CLUSTER_NORMAL;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -370,6 +493,9 @@ void qcow2_refcount_close(BlockDriverState *bs);
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+    int *nb_clusters);
+int qcow2_release_alloc_window(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -397,6 +523,8 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_get_cluster_offset_cached(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool for_write);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -406,7 +534,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    int flags);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -421,6 +550,8 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, int64_t *size, int64_t *hits,
+                           int64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -432,6 +563,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_cached(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
 #endif
@@ -471,6 +471,8 @@ static BlockDriver bdrv_file = {
                         = raw_get_allocated_file_size,
 
     .create_options = raw_create_options,
+
+    .bdrv_needs_main_loop = true,
 };
 
 /***********************************************/
@@ -586,6 +588,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_needs_main_loop = true,
 };
 
 static void bdrv_file_init(void)
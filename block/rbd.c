@@ -1020,6 +1020,7 @@ static BlockDriver bdrv_rbd = {
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
     .bdrv_snapshot_list     = qemu_rbd_snap_list,
     .bdrv_snapshot_goto     = qemu_rbd_snap_rollback,
+    .bdrv_needs_main_loop   = true,
 };
 
 static void bdrv_rbd_init(void)
@@ -2366,6 +2366,8 @@ static BlockDriver bdrv_sheepdog = {
     .bdrv_load_vmstate  = sd_load_vmstate,
 
     .create_options = sd_create_options,
+
+    .bdrv_needs_main_loop = true,
 };
 
 static BlockDriver bdrv_sheepdog_tcp = {
@@ -2394,6 +2396,8 @@ static BlockDriver bdrv_sheepdog_tcp = {
     .bdrv_load_vmstate  = sd_load_vmstate,
 
     .create_options = sd_create_options,
+
+    .bdrv_needs_main_loop = true,
 };
 
 static BlockDriver bdrv_sheepdog_unix = {
@@ -2422,6 +2426,8 @@ static BlockDriver bdrv_sheepdog_unix = {
     .bdrv_load_vmstate  = sd_load_vmstate,
 
     .create_options = sd_create_options,
+
+    .bdrv_needs_main_loop = true,
 };
 
 static void bdrv_sheepdog_init(void)
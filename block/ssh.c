@@ -1058,6 +1058,8 @@ static BlockDriver bdrv_ssh = {
     .bdrv_getlength               = ssh_getlength,
     .bdrv_co_flush_to_disk        = ssh_co_flush,
     .create_options               = ssh_create_options,
+
+    .bdrv_needs_main_loop         = true,
 };
 
 static void bdrv_ssh_init(void)
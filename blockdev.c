@@ -281,6 +281,18 @@ static int parse_block_error_action(const char *buf, bool is_read)
     }
 }
 
+static int parse_detect_zeroes(const char *buf)
+{
+    int i;
+
+    for (i = 0; i < BLOCKDEV_DETECT_ZEROES_OPTIONS_MAX; i++) {
+        if (!strcmp(buf, BlockdevDetectZeroesOptions_lookup[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static bool do_check_io_limits(BlockIOLimit *io_limits, Error **errp)
 {
     bool bps_flag;
@@ -334,6 +346,7 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
     BlockIOLimit io_limits;
     int snapshot = 0;
     bool copy_on_read;
+    int detect_zeroes;
     int ret;
     Error *error = NULL;
     QemuOpts *opts;
@@ -446,13 +459,6 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
 	}
     }
 
-    if ((buf = qemu_opt_get(opts, "discard")) != NULL) {
-        if (bdrv_parse_discard_flags(buf, &bdrv_flags) != 0) {
-            error_report("invalid discard option");
-            return NULL;
-        }
-    }
-
     bdrv_flags = 0;
     if (qemu_opt_get_bool(opts, "cache.writeback", true)) {
         bdrv_flags |= BDRV_O_CACHE_WB;
@@ -464,6 +470,29 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
+    /* after the cache flags, which start from scratch */
+    if ((buf = qemu_opt_get(opts, "discard")) != NULL) {
+        if (bdrv_parse_discard_flags(buf, &bdrv_flags) != 0) {
+            error_report("invalid discard option");
+            return NULL;
+        }
+    }
+
+    detect_zeroes = BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+    if ((buf = qemu_opt_get(opts, "detect-zeroes")) != NULL) {
+        detect_zeroes = parse_detect_zeroes(buf);
+        if (detect_zeroes < 0) {
+            error_report("invalid detect-zeroes option '%s'", buf);
+            return NULL;
+        }
+        if (detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP &&
+            !(bdrv_flags & BDRV_O_UNMAP)) {
+            error_report("setting detect-zeroes to unmap is not allowed "
+                         "without setting discard operation to unmap");
+            return NULL;
+        }
+    }
+
 #ifdef CONFIG_LINUX_AIO
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
         if (!strcmp(buf, "native")) {
@@ -627,6 +656,7 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    dinfo->bdrv->detect_zeroes = detect_zeroes;
 
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
@@ -1264,6 +1294,7 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
+    AioContext *aio_context;
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1282,6 +1313,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     bs->io_limits = io_limits;
 
     if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
@@ -1293,6 +1327,8 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
             qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
         }
     }
+
+    aio_context_release(aio_context);
 }
 
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -1915,6 +1951,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "discard",
             .type = QEMU_OPT_STRING,
             .help = "discard operation (ignore/off, unmap/on)",
+        },{
+            .name = "detect-zeroes",
+            .type = QEMU_OPT_STRING,
+            .help = "try to optimize zero writes (off, on, unmap)",
         },{
             .name = "cache.writeback",
             .type = QEMU_OPT_BOOL,
@@ -2044,6 +2084,10 @@ QemuOptsList qemu_old_drive_opts = {
             .name = "discard",
             .type = QEMU_OPT_STRING,
             .help = "discard operation (ignore/off, unmap/on)",
+        },{
+            .name = "detect-zeroes",
+            .type = QEMU_OPT_STRING,
+            .help = "try to optimize zero writes (off, on, unmap)",
         },{
             .name = "cache",
             .type = QEMU_OPT_STRING,
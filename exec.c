@@ -710,6 +710,98 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/*
+ * The dirty flags are one byte per page, so eight pages are handled with a
+ * single 64-bit load.  They are cleared with an atomic and, because a thread
+ * that does not hold the BQL may set the flags of a neighbouring page at
+ * the same time and a plain store would lose its update.  Multiplying the flag bits (moved down to bit 0 of
+ * each byte) by this constant gathers them into the top byte, page 0 first.
+ */
+#define DIRTY_FLAGS_GATHER 0x0102040810204080ULL
+
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                               ram_addr_t start,
+                                               ram_addr_t length,
+                                               int dirty_flag)
+{
+    uint64_t flag_mask = 0x0101010101010101ULL * (uint8_t)dirty_flag;
+    int flag_shift = ctz32(dirty_flag);
+    uint8_t *flags = ram_list.phys_dirty;
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    uint64_t num_dirty = 0;
+
+    assert(is_power_of_2(dirty_flag) && dirty_flag <= 0x80);
+
+    while (page < end) {
+        unsigned long word = 0;
+        unsigned long *dest_word = dest + BIT_WORD(page);
+        unsigned int bit = page % BITS_PER_LONG;
+
+        if (bit == 0 && end - page >= BITS_PER_LONG) {
+            for (bit = 0; bit < BITS_PER_LONG; bit += 8) {
+                uint64_t *p = (uint64_t *)(flags + page + bit);
+                uint64_t hit;
+
+                /* flag_mask is the same byte repeated, in either order */
+                if (atomic_read(p) & flag_mask) {
+                    hit = le64_to_cpu(atomic_fetch_and(p, ~flag_mask)) &
+                          flag_mask;
+                    word |= (unsigned long)
+                        (((hit >> flag_shift) * DIRTY_FLAGS_GATHER) >> 56)
+                        << bit;
+                }
+            }
+            page += BITS_PER_LONG;
+        } else {
+            if ((flags[page] & dirty_flag) &&
+                (atomic_fetch_and(&flags[page], ~dirty_flag) & dirty_flag)) {
+                word = 1UL << bit;
+            }
+            page++;
+        }
+
+        if (word) {
+            /* another range may share the word at its edges */
+            unsigned long old = atomic_fetch_or(dest_word, word);
+            num_dirty += ctpopl(word & ~old);
+        }
+    }
+
+    if (num_dirty && tcg_enabled()) {
+        start &= TARGET_PAGE_MASK;
+        tlb_reset_dirty_range_all(start, end << TARGET_PAGE_BITS,
+                                  (end << TARGET_PAGE_BITS) - start);
+    }
+
+    return num_dirty;
+}
+
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    unsigned long i, len = BITS_TO_LONGS(pages);
+
+    for (i = 0; i < len; i++, page += BITS_PER_LONG) {
+        unsigned long c = leul_to_cpu(bitmap[i]);
+
+        if (!c) {
+            continue;
+        }
+        if (c == ~0UL && pages - i * BITS_PER_LONG >= BITS_PER_LONG) {
+            memset(ram_list.phys_dirty + page, 0xff, BITS_PER_LONG);
+            continue;
+        }
+        do {
+            ram_list.phys_dirty[page + ctzl(c)] = 0xff;
+            c &= c - 1;
+        } while (c);
+    }
+    xen_modified_memory(start, pages << TARGET_PAGE_BITS);
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -1107,6 +1199,20 @@ static int memory_try_enable_merging(void *addr, size_t len)
     return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
 }
 
+/*
+ * Mapping something else over guest RAM drops the madvise() settings it
+ * got when it was allocated; apply them again to [@addr, @addr + @size).
+ */
+void qemu_ram_setup_mapping(void *addr, ram_addr_t size)
+{
+    memory_try_enable_merging(addr, size);
+    qemu_ram_setup_dump(addr, size);
+    qemu_madvise(addr, size, QEMU_MADV_HUGEPAGE);
+    if (kvm_enabled()) {
+        kvm_setup_guest_memory(addr, size);
+    }
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
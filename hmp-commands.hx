@@ -894,6 +894,9 @@ STEXI
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+A @code{tcp:} or @code{unix:} @var{uri} may end in @code{,channels=@var{n}}
+to spread RAM over several connections.  @code{file:@var{path}} saves the
+guest into a file for @code{-incoming file:@var{path}}.
 ETEXI
 
     {
@@ -971,6 +974,20 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration.
 ETEXI
 
     {
@@ -1615,6 +1632,8 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info iothreads
+show iothreads
 @item info history
 show the command line history
 @item info irq
@@ -1663,6 +1682,8 @@ show user network stack connection states
 show migration status
 @item info migrate_capabilities
 show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
 @item info migrate_cache_size
 show current migration XBZRLE cache size
 @item info balloon
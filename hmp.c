@@ -160,6 +160,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
                            info->expected_downtime);
         }
+        if (info->has_rounds_to_converge) {
+            monitor_printf(mon, "rounds to converge: %" PRId64 "\n",
+                           info->rounds_to_converge);
+        }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle: %" PRId64 " %%\n",
+                           info->cpu_throttle_percentage);
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
@@ -191,6 +199,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->has_dirty_sync_count) {
+            monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                           info->ram->dirty_sync_count);
+        }
+        if (info->ram->has_dirty_sync_time) {
+            monitor_printf(mon, "dirty sync time: %" PRIu64 " microseconds\n",
+                           info->ram->dirty_sync_time);
+        }
     }
 
     if (info->has_disk) {
@@ -211,10 +227,26 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->pages);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 " (%0.2f%%)\n",
+                       info->xbzrle_cache->cache_hit,
+                       info->xbzrle_cache->cache_hit_rate * 100);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->evictions);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -238,6 +270,32 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+            params->compress_level);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+            params->compress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+            params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS],
+            params->x_postcopy_rounds);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -282,6 +340,22 @@ void hmp_info_cpus(Monitor *mon, const QDict *qdict)
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
+{
+    IOThreadInfoList *info_list, *info;
+
+    info_list = qmp_query_iothreads(NULL);
+
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "%s: thread_id=%" PRId64
+                       " busy_ns=%" PRId64 " idle_ns=%" PRId64 "\n",
+                       info->value->id, info->value->thread_id,
+                       info->value->busy_ns, info->value->idle_ns);
+    }
+
+    qapi_free_IOThreadInfoList(info_list);
+}
+
 void hmp_info_block(Monitor *mon, const QDict *qdict)
 {
     BlockInfoList *block_list, *info;
@@ -335,6 +409,13 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                            info->value->inserted->backing_file_depth);
         }
 
+        if (info->value->inserted->detect_zeroes !=
+            BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF) {
+            monitor_printf(mon, "    Detect zeroes:    %s\n",
+                BlockdevDetectZeroesOptions_lookup[
+                    info->value->inserted->detect_zeroes]);
+        }
+
         if (info->value->inserted->bps
             || info->value->inserted->bps_rd
             || info->value->inserted->bps_wr
@@ -401,6 +482,26 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->wr_zero_detected_operations) {
+            monitor_printf(mon, "    wr_zero_detected_operations=%" PRId64
+                           " wr_zero_detected_bytes=%" PRId64 "\n",
+                           stats->value->stats->wr_zero_detected_operations,
+                           stats->value->stats->wr_zero_detected_bytes);
+        }
+        if (stats->value->has_metadata_cache) {
+            BlockMetadataCacheStats *c = stats->value->metadata_cache;
+
+            monitor_printf(mon, "    l2_cache_size=%" PRId64
+                           " l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_size=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64
+                           "\n",
+                           c->l2_size, c->l2_hits, c->l2_misses,
+                           c->refcount_size, c->refcount_hits,
+                           c->refcount_misses);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -1024,6 +1125,53 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_compress_level = false;
+    bool has_compress_threads = false;
+    bool has_decompress_threads = false;
+    bool has_x_postcopy_rounds = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_COMPRESS_LEVEL:
+                has_compress_level = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_THREADS:
+                has_compress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
+                has_decompress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS:
+                has_x_postcopy_rounds = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_compress_level, value,
+                                       has_compress_threads, value,
+                                       has_decompress_threads, value,
+                                       has_x_postcopy_rounds, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1507,7 +1655,11 @@ void hmp_qemu_io(Monitor *mon, const QDict *qdict)
 
     bs = bdrv_find(device);
     if (bs) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         qemuio_command(bs, command);
+        aio_context_release(aio_context);
     } else {
         error_set(&err, QERR_DEVICE_NOT_FOUND, device);
     }
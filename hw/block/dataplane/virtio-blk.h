@@ -25,5 +25,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_drain(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_get_poll_stats(VirtIOBlockDataPlane *s,
+                                          uint64_t *hits, uint64_t *misses);
 
 #endif /* HW_DATAPLANE_VIRTIO_BLK_H */
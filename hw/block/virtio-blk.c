@@ -17,9 +17,10 @@
 #include "hw/block/block.h"
 #include "sysemu/blockdev.h"
 #include "hw/virtio/virtio-blk.h"
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
 # include "dataplane/virtio-blk.h"
 # include "migration/migration.h"
+# include "qapi/visitor.h"
 #endif
 #include "block/scsi.h"
 #ifdef __linux__
@@ -399,7 +400,7 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .num_writes = 0,
     };
 
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
      * dataplane here instead of waiting for .set_status().
      */
@@ -409,11 +410,16 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
-    }
+    bdrv_io_plug(s->bs);
+    do {
+        virtqueue_batch_begin(s->vq);
+        while ((req = virtio_blk_get_request(s))) {
+            virtio_blk_handle_request(req, &mrb);
+        }
+    } while (virtqueue_batch_end(s->vq));
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -435,12 +441,14 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -460,7 +468,7 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     if (s->dataplane) {
@@ -552,7 +560,7 @@ static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     uint32_t features;
 
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
                                     VIRTIO_CONFIG_S_DRIVER_OK))) {
         virtio_blk_data_plane_stop(s->dataplane);
@@ -629,7 +637,7 @@ void virtio_blk_set_conf(DeviceState *dev, VirtIOBlkConf *blk)
     memcpy(&(s->blk), blk, sizeof(struct VirtIOBlkConf));
 }
 
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
 /* Disable dataplane thread during live migration since it does not
  * update the dirty memory bitmap yet.
  */
@@ -655,7 +663,30 @@ static void virtio_blk_migration_state_changed(Notifier *notifier, void *data)
                                      &s->dataplane);
     }
 }
-#endif /* CONFIG_VIRTIO_BLK_DATA_PLANE */
+
+static void virtio_blk_get_poll_stat(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    uint64_t hits = 0, misses = 0;
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_get_poll_stats(s->dataplane, &hits, &misses);
+    }
+    visit_type_uint64(v, opaque ? &misses : &hits, name, errp);
+}
+
+/* Read-only counters for tuning x-poll-max-ns, or the poll-max-ns of the
+ * iothread, whose counters cover all devices that share it
+ */
+static void virtio_blk_instance_init(Object *obj)
+{
+    object_property_add(obj, "x-poll-hits", "uint64",
+                        virtio_blk_get_poll_stat, NULL, NULL, NULL, NULL);
+    object_property_add(obj, "x-poll-misses", "uint64",
+                        virtio_blk_get_poll_stat, NULL, NULL, (void *)1, NULL);
+}
+#endif /* CONFIG_VIRTIO_DATA_PLANE */
 
 static int virtio_blk_device_init(VirtIODevice *vdev)
 {
@@ -688,7 +719,7 @@ static int virtio_blk_device_init(VirtIODevice *vdev)
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     if (!virtio_blk_data_plane_create(vdev, blk, &s->dataplane)) {
         virtio_cleanup(vdev);
         return -1;
@@ -713,7 +744,7 @@ static int virtio_blk_device_exit(DeviceState *dev)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     remove_migration_state_change_notifier(&s->migration_state_notifier);
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
@@ -749,6 +780,9 @@ static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_BLK,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIOBlock),
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    .instance_init = virtio_blk_instance_init,
+#endif
     .class_init = virtio_blk_class_init,
 };
 
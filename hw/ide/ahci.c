@@ -431,15 +431,23 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockDriverState *bs = s->dev[port].port.ifs[0].bs;
     int slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* submit the NCQ commands issued together as one batch */
+        if (bs) {
+            bdrv_io_plug(bs);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1 << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1 << slot);
             }
         }
+        if (bs) {
+            bdrv_io_unplug(bs);
+        }
     }
 }
 
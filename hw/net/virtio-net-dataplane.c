@@ -0,0 +1,510 @@
+/*
+ * Dedicated thread for virtio-net transmission
+ *
+ * Each transmit virtqueue is served by an iothread, one of its own or the
+ * one named by x-iothread.  Packets go straight from the vring to the tap
+ * file descriptor with writev(): the iovecs point into guest memory, so the
+ * payload is never copied, and the guest is notified once per burst instead
+ * of once per packet.  Receive and the control virtqueue stay in the main
+ * loop.
+ *
+ * The dataplane only runs while the peer is a tap device without vhost.  If
+ * tap cannot take a packet, the thread waits for the file descriptor to
+ * become writable, like the net layer's queue does in the main loop.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-bus.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+
+typedef struct {
+    VirtIONetDataPlane *s;
+    int n;                          /* virtqueue index */
+    Vring vring;
+
+    IOThread *iothread;             /* x-iothread, or one of our own */
+    AioContext *ctx;
+    int tap_fd;
+
+    /* Assigned by value, see hw/block/dataplane/virtio-blk.c */
+    EventNotifier host_notifier;    /* doorbell */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Interrupts are collected here while the guest masks the vector */
+    EventNotifier masked_notifier;
+    bool masked;
+
+    /* The packet being sent, head is -1 if there is none.  It stays here
+     * while tap is full.
+     */
+    int head;
+    struct iovec *out_sg;
+    unsigned int out_num;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];   /* guest buffers */
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];    /* same, minus the guest header */
+} VirtIONetTxVring;
+
+struct VirtIONetDataPlane {
+    VirtIONet *n;
+    bool started;
+    bool stopping;
+    bool disabled;                  /* could not start, until the next reset */
+
+    int queues;                     /* transmit queues served while started */
+    int nvqs;                       /* virtqueues with guest notifiers */
+    size_t host_hdr_len;            /* the header that tap expects */
+    size_t guest_hdr_len;
+    VirtIONetTxVring *tx_vrings;    /* one per queue pair */
+};
+
+static int flush_true(EventNotifier *e)
+{
+    return true;
+}
+
+static int flush_tap_true(void *opaque)
+{
+    return true;
+}
+
+static void virtio_net_tx_vring_notify(VirtIONetTxVring *r)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(r->s->n);
+
+    if (vring_should_notify(vdev, &r->vring)) {
+        event_notifier_set(r->masked ? &r->masked_notifier : r->guest_notifier);
+    }
+}
+
+/* Returns false if there is no packet in the vring */
+static bool virtio_net_tx_vring_pop(VirtIONetTxVring *r)
+{
+    VirtIONetDataPlane *s = r->s;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->n);
+    unsigned int out_num, in_num;
+    int head;
+
+    head = vring_pop(vdev, &r->vring, r->iov, &r->iov[VIRTQUEUE_MAX_SIZE],
+                     &out_num, &in_num);
+    if (head < 0) {
+        if (head != -EAGAIN) {
+            vring_set_broken(&r->vring);
+        }
+        return false;
+    }
+    if (out_num < 1) {
+        error_report("virtio-net header not in first element");
+        vring_set_broken(&r->vring);
+        return false;
+    }
+
+    r->head = head;
+    r->out_sg = r->iov;
+    r->out_num = out_num;
+
+    /* Leave out the part of the guest header that tap does not know about.
+     * Only the iovecs are rewritten, the payload stays where it is.
+     */
+    if (s->host_hdr_len != s->guest_hdr_len) {
+        unsigned int sg_num = iov_copy(r->sg, ARRAY_SIZE(r->sg),
+                                       r->iov, out_num,
+                                       0, s->host_hdr_len);
+        sg_num += iov_copy(r->sg + sg_num, ARRAY_SIZE(r->sg) - sg_num,
+                           r->iov, out_num,
+                           s->guest_hdr_len, -1);
+        r->out_sg = r->sg;
+        r->out_num = sg_num;
+    }
+    return true;
+}
+
+/* Returns false if tap is full.  Like tap_write_packet(), other errors drop
+ * the packet.
+ */
+static bool virtio_net_tx_vring_write(VirtIONetTxVring *r)
+{
+    ssize_t len;
+
+    do {
+        len = writev(r->tap_fd, r->out_sg, r->out_num);
+    } while (len == -1 && errno == EINTR);
+
+    return !(len == -1 && errno == EAGAIN);
+}
+
+static void virtio_net_tx_vring_writable(void *opaque);
+
+static void virtio_net_tx_vring_flush(VirtIONetTxVring *r)
+{
+    VirtIONet *n = r->s->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    unsigned int packets = 0;
+    int burst = 0;                  /* packets since the last notify */
+
+    do {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &r->vring);
+
+        for (;;) {
+            if (r->head < 0 && !virtio_net_tx_vring_pop(r)) {
+                break;
+            }
+            if (!virtio_net_tx_vring_write(r)) {
+                /* Keep guest notifies disabled, nothing moves until tap
+                 * has room again.
+                 */
+                aio_set_fd_handler(r->ctx, r->tap_fd, NULL,
+                                   virtio_net_tx_vring_writable,
+                                   flush_tap_true, r);
+                trace_virtio_net_data_plane_tx_flush(r->s, r->n, packets,
+                                                     true);
+                if (burst) {
+                    virtio_net_tx_vring_notify(r);
+                }
+                return;
+            }
+            vring_push(&r->vring, r->head, 0);
+            r->head = -1;
+            packets++;
+
+            /* Let the guest reuse the buffers of a whole burst */
+            if (++burst >= n->tx_burst) {
+                virtio_net_tx_vring_notify(r);
+                burst = 0;
+            }
+        }
+
+        /* Re-enable guest->host notifies and stop processing the vring.
+         * But if the guest has snuck in more descriptors, keep processing.
+         */
+    } while (!r->vring.broken && !vring_enable_notification(vdev, &r->vring));
+
+    trace_virtio_net_data_plane_tx_flush(r->s, r->n, packets, false);
+    if (burst) {
+        virtio_net_tx_vring_notify(r);
+    }
+}
+
+static void virtio_net_tx_vring_writable(void *opaque)
+{
+    VirtIONetTxVring *r = opaque;
+
+    aio_set_fd_handler(r->ctx, r->tap_fd, NULL, NULL, NULL, NULL);
+    virtio_net_tx_vring_flush(r);
+}
+
+static void virtio_net_data_plane_handle_tx(EventNotifier *notifier)
+{
+    VirtIONetTxVring *r = container_of(notifier, VirtIONetTxVring,
+                                       host_notifier);
+
+    event_notifier_test_and_clear(notifier);
+
+    /* The tap file descriptor handler resumes the flush */
+    if (r->head >= 0) {
+        return;
+    }
+    virtio_net_tx_vring_flush(r);
+}
+
+/* While busy polling, send packets as soon as the guest adds them */
+static bool virtio_net_data_plane_poll_tx(EventNotifier *notifier)
+{
+    VirtIONetTxVring *r = container_of(notifier, VirtIONetTxVring,
+                                       host_notifier);
+
+    if (r->vring.broken || r->head >= 0 || !vring_more_avail(&r->vring)) {
+        return false;
+    }
+
+    virtio_net_tx_vring_flush(r);
+    return true;
+}
+
+bool virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane)
+{
+    VirtIONetDataPlane *s;
+    IOThread *iothread = NULL;
+    int i;
+
+    *dataplane = NULL;
+
+    if (!n->net_conf.data_plane && !n->net_conf.iothread) {
+        return true;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            error_report("x-data-plane requires a tap netdev");
+            return false;
+        }
+        if (tap_get_vhost_net(peer)) {
+            error_report("x-data-plane cannot be used together with vhost");
+            return false;
+        }
+    }
+
+    if (n->net_conf.iothread) {
+        iothread = iothread_find(n->net_conf.iothread);
+        if (!iothread) {
+            error_report("iothread '%s' not found", n->net_conf.iothread);
+            return false;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->n = n;
+    s->tx_vrings = g_new0(VirtIONetTxVring, n->max_queues);
+
+    /* Without x-iothread every queue gets a thread of its own */
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetTxVring *r = &s->tx_vrings[i];
+
+        r->s = s;
+        r->n = 2 * i + 1;
+        r->head = -1;
+        if (iothread) {
+            object_ref(OBJECT(iothread));
+            r->iothread = iothread;
+        } else {
+            r->iothread = IOTHREAD(object_new(TYPE_IOTHREAD));
+        }
+        r->ctx = iothread_get_aio_context(r->iothread);
+        event_notifier_init(&r->masked_notifier, 0);
+    }
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    for (i = 0; i < s->n->max_queues; i++) {
+        VirtIONetTxVring *r = &s->tx_vrings[i];
+
+        event_notifier_cleanup(&r->masked_notifier);
+        object_unref(OBJECT(r->iothread));
+    }
+    g_free(s->tx_vrings);
+    g_free(s);
+}
+
+/* Returns true if the dataplane threads now transmit for the first @queues
+ * queue pairs.  Starting again with a different number of queues restarts
+ * the dataplane.
+ */
+bool virtio_net_data_plane_start(VirtIONetDataPlane *s, int queues)
+{
+    VirtIONet *n = s->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    /* Wait until the main loop is done with a packet that tap queued, and
+     * leave packets to the net layer while the tap side is disconnected,
+     * like vhost does.  This is checked first so that set_link off stops a
+     * running dataplane: the caller stops it when this returns false.
+     */
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (n->vqs[i].async_tx.elem.out_num || nc->peer->link_down) {
+            return false;
+        }
+    }
+
+    if (s->started) {
+        if (s->queues == queues) {
+            return true;
+        }
+        virtio_net_data_plane_stop(s);
+    }
+    if (s->disabled) {
+        return false;
+    }
+
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    s->host_hdr_len = n->host_hdr_len;
+    s->guest_hdr_len = n->guest_hdr_len;
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetTxVring *r = &s->tx_vrings[i];
+        VirtQueue *vq = virtio_get_queue(vdev, r->n);
+
+        r->guest_notifier = virtio_queue_get_guest_notifier(vq);
+        r->tap_fd = tap_get_fd(qemu_get_subqueue(n->nic, i)->peer);
+        event_notifier_test_and_clear(&r->masked_notifier);
+    }
+
+    /* Set up guest notifiers (irq), receive stays in the main loop but the
+     * call sets up all queue pairs.
+     */
+    s->nvqs = n->multiqueue ? n->max_queues * 2 : 2;
+    if (k->set_guest_notifiers(qbus->parent, s->nvqs, true) != 0) {
+        error_report("virtio-net failed to set guest notifiers, "
+                     "ensure -enable-kvm is set");
+        s->disabled = true;
+        return false;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetTxVring *r = &s->tx_vrings[i];
+
+        if (!vring_setup(&r->vring, vdev, r->n)) {
+            error_report("virtio-net failed to map virtqueue %d", r->n);
+            goto fail_vrings;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetTxVring *r = &s->tx_vrings[i];
+        VirtQueue *vq = virtio_get_queue(vdev, r->n);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, r->n, true) != 0) {
+            fprintf(stderr, "virtio-net failed to set host notifier\n");
+            exit(1);
+        }
+        r->host_notifier = *virtio_queue_get_host_notifier(vq);
+
+        /* The iothread may already run, and serve other devices too */
+        aio_context_acquire(r->ctx);
+        aio_set_event_notifier(r->ctx, &r->host_notifier,
+                               virtio_net_data_plane_handle_tx, flush_true);
+        aio_set_event_notifier_poll(r->ctx, &r->host_notifier,
+                                    virtio_net_data_plane_poll_tx);
+        aio_context_release(r->ctx);
+    }
+
+    s->queues = queues;
+    s->started = true;
+    trace_virtio_net_data_plane_start(s, queues);
+
+    /* Kick right away to begin sending packets already in the vrings */
+    for (i = 0; i < queues; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, s->tx_vrings[i].n);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    return true;
+
+fail_vrings:
+    while (--i >= 0) {
+        vring_teardown(&s->tx_vrings[i].vring, vdev, s->tx_vrings[i].n);
+    }
+    k->set_guest_notifiers(qbus->parent, s->nvqs, false);
+    s->disabled = true;
+    return false;
+}
+
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_net_data_plane_stop(s);
+
+    for (i = 0; i < s->queues; i++) {
+        VirtIONetTxVring *r = &s->tx_vrings[i];
+
+        aio_context_acquire(r->ctx);
+        aio_set_event_notifier(r->ctx, &r->host_notifier, NULL, NULL);
+        if (r->head >= 0) {
+            aio_set_fd_handler(r->ctx, r->tap_fd, NULL, NULL, NULL, NULL);
+
+            /* Give the packet that tap did not take back to the vring, the
+             * main loop sends it after the ones that went before it.
+             */
+            r->vring.last_avail_idx--;
+            r->head = -1;
+        }
+        aio_context_release(r->ctx);
+
+        k->set_host_notifier(qbus->parent, r->n, false);
+        vring_teardown(&r->vring, vdev, r->n);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->nvqs, false);
+
+    s->started = false;
+    s->stopping = false;
+}
+
+/* Called on device reset, gives the dataplane another chance to start */
+void virtio_net_data_plane_reset(VirtIONetDataPlane *s)
+{
+    virtio_net_data_plane_stop(s);
+    s->disabled = false;
+}
+
+/* Returns the number of queue pairs whose transmit virtqueue the dataplane
+ * serves, zero if it is not running.
+ */
+int virtio_net_data_plane_get_queues(VirtIONetDataPlane *s)
+{
+    return s->started ? s->queues : 0;
+}
+
+/* The guest notifier mask callbacks of virtio-net call these when vhost is
+ * not running.  They do what vhost does with its masked notifier: while the
+ * vector is masked, the thread signals a private event notifier instead of
+ * the irq, and unmasking reports whether it fired.
+ */
+void virtio_net_data_plane_guest_notifier_mask(VirtIONetDataPlane *s,
+                                               int idx, bool mask)
+{
+    VirtIONetTxVring *r;
+
+    /* Receive and control virtqueues notify from the main loop */
+    if (idx % 2 == 0 || idx / 2 >= s->n->max_queues) {
+        return;
+    }
+    r = &s->tx_vrings[idx / 2];
+
+    aio_context_acquire(r->ctx);
+    r->masked = mask;
+    aio_context_release(r->ctx);
+}
+
+bool virtio_net_data_plane_guest_notifier_pending(VirtIONetDataPlane *s,
+                                                  int idx)
+{
+    VirtIONetTxVring *r;
+
+    if (idx % 2 == 0 || idx / 2 >= s->n->max_queues) {
+        return false;
+    }
+    r = &s->tx_vrings[idx / 2];
+    return event_notifier_test_and_clear(&r->masked_notifier);
+}
@@ -23,6 +23,9 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
 #include "monitor/monitor.h"
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+# include "migration/migration.h"
+#endif
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -138,19 +141,50 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+/* Returns the number of queues that the dataplane transmits for */
+static int virtio_net_data_plane_status(VirtIONet *n, uint8_t status)
+{
+    int queues = n->multiqueue ? n->curr_queues : 1;
+    int i;
+
+    if (!n->dataplane) {
+        return 0;
+    }
+
+    if (virtio_net_started(n, status) && !n->vhost_started &&
+        virtio_net_data_plane_start(n->dataplane, queues)) {
+        return queues;
+    }
+
+    /* Let the main loop send what the threads left in the vrings */
+    queues = virtio_net_data_plane_get_queues(n->dataplane);
+    virtio_net_data_plane_stop(n->dataplane);
+    for (i = 0; i < queues; i++) {
+        n->vqs[i].tx_waiting = 1;
+    }
+    return 0;
+}
+#endif
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
+    int data_plane_queues = 0;
 
     virtio_net_vhost_status(n, status);
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    data_plane_queues = virtio_net_data_plane_status(n, status);
+#endif
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
 
-        if ((!n->multiqueue && i != 0) || i >= n->curr_queues) {
+        if ((!n->multiqueue && i != 0) || i >= n->curr_queues ||
+            i < data_plane_queues) {
             queue_status = 0;
         } else {
             queue_status = status;
@@ -307,6 +341,12 @@ static void virtio_net_reset(VirtIODevice *vdev)
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (n->dataplane) {
+        virtio_net_data_plane_reset(n->dataplane);
+    }
+#endif
+
     /* Flush any MAC and VLAN filter table state */
     n->mac_table.in_use = 0;
     n->mac_table.first_multi = 0;
@@ -1045,6 +1085,16 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     q->async_tx.elem.out_num = q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    /* The dataplane waits for the main loop to finish with the queue */
+    if (n->dataplane) {
+        virtio_net_set_status(vdev, vdev->status);
+        if (vq2q(virtio_get_queue_index(q->tx_vq)) <
+            virtio_net_data_plane_get_queues(n->dataplane)) {
+            return;
+        }
+    }
+#endif
     virtio_net_flush_tx(q);
 }
 
@@ -1067,6 +1117,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+again:
+    virtqueue_batch_begin(q->tx_vq);
     while (virtqueue_pop(q->tx_vq, &elem)) {
         ssize_t ret, len;
         unsigned int out_num = elem.out_num;
@@ -1103,7 +1155,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
-            return -EBUSY;
+            num_packets = -EBUSY;
+            break;
         }
 
         len += ret;
@@ -1115,6 +1168,11 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             break;
         }
     }
+    /* buffers the guest added without kicking are sent as well */
+    if (virtqueue_batch_end(q->tx_vq) && num_packets >= 0 &&
+        num_packets < n->tx_burst) {
+        goto again;
+    }
     return num_packets;
 }
 
@@ -1435,6 +1493,11 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (!n->vhost_started && n->dataplane) {
+        return virtio_net_data_plane_guest_notifier_pending(n->dataplane, idx);
+    }
+#endif
     assert(n->vhost_started);
     return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
 }
@@ -1444,6 +1507,12 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (!n->vhost_started && n->dataplane) {
+        virtio_net_data_plane_guest_notifier_mask(n->dataplane, idx, mask);
+        return;
+    }
+#endif
     assert(n->vhost_started);
     vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
                              vdev, idx, mask);
@@ -1484,6 +1553,37 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+/* Disable dataplane threads during live migration since they do not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_status(n, 0);
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_create(n, &n->dataplane);
+    } else {
+        return;
+    }
+    virtio_net_set_status(vdev, vdev->status);
+}
+#endif /* CONFIG_VIRTIO_DATA_PLANE */
+
 static int virtio_net_device_init(VirtIODevice *vdev)
 {
     int i;
@@ -1561,6 +1661,15 @@ static int virtio_net_device_init(VirtIODevice *vdev)
     nc->rxfilter_notify_enabled = 1;
 
     n->qdev = qdev;
+
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (!virtio_net_data_plane_create(n, &n->dataplane)) {
+        return -1;
+    }
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+#endif
+
     register_savevm(qdev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
 
@@ -1577,6 +1686,12 @@ static int virtio_net_device_exit(DeviceState *qdev)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+#endif
+
     unregister_savevm(qdev, "virtio-net", n);
 
     if (n->netclient_name) {
@@ -1629,6 +1744,10 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONet, net_conf.data_plane, 0, false),
+    DEFINE_PROP_STRING("x-iothread", VirtIONet, net_conf.iothread),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
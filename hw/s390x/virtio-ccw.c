@@ -1003,6 +1003,11 @@ static Property virtio_ccw_net_properties[] = {
     DEFINE_NIC_PROPERTIES(VirtIONetCcw, vdev.nic_conf),
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONetCcw, vdev.net_conf.data_plane,
+                    0, false),
+    DEFINE_PROP_STRING("x-iothread", VirtIONetCcw, vdev.net_conf.iothread),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1031,8 +1036,10 @@ static Property virtio_ccw_blk_properties[] = {
     DEFINE_VIRTIO_BLK_PROPERTIES(VirtIOBlkCcw, blk),
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkCcw, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-max-ns", VirtIOBlkCcw, blk.poll_max_ns, 0),
+    DEFINE_PROP_STRING("x-iothread", VirtIOBlkCcw, blk.iothread),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1117,6 +1124,12 @@ static Property virtio_ccw_scsi_properties[] = {
     DEFINE_VIRTIO_SCSI_FEATURES(VirtioCcwDevice, host_features[0]),
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOSCSICcw,
+                    vdev.parent_obj.conf.data_plane, 0, false),
+    DEFINE_PROP_STRING("x-iothread", VirtIOSCSICcw,
+                       vdev.parent_obj.conf.iothread),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -124,7 +124,10 @@ static void scsi_dma_restart_cb(void *opaque, int running, RunState state)
         return;
     }
     if (!s->bh) {
-        s->bh = qemu_bh_new(scsi_dma_restart_bh, s);
+        /* restart the requests in the thread that runs the device */
+        AioContext *ctx = bdrv_get_aio_context(s->conf.bs);
+
+        s->bh = aio_bh_new(ctx, scsi_dma_restart_bh, s);
         qemu_bh_schedule(s->bh);
     }
 }
@@ -698,6 +701,11 @@ static void scsi_req_enqueue_internal(SCSIRequest *req)
     } else {
         req->sg = NULL;
     }
+    if (!req->sg && req->bus->info->get_iov) {
+        req->iov = req->bus->info->get_iov(req);
+    } else {
+        req->iov = NULL;
+    }
     req->enqueued = true;
     QTAILQ_INSERT_TAIL(&req->dev->requests, req, next);
 }
@@ -1553,7 +1561,7 @@ void scsi_req_data(SCSIRequest *req, int len)
     }
     trace_scsi_req_data(req->dev->id, req->lun, req->tag, len);
     assert(req->cmd.mode != SCSI_XFER_NONE);
-    if (!req->sg) {
+    if (!req->sg && !req->iov) {
         req->resid -= len;
         req->bus->info->transfer_data(req, len);
         return;
@@ -1566,7 +1574,15 @@ void scsi_req_data(SCSIRequest *req, int len)
     req->dma_started = true;
 
     buf = scsi_req_get_buf(req);
-    if (req->cmd.mode == SCSI_XFER_FROM_DEV) {
+    if (req->iov) {
+        len = MIN(len, req->iov->size);
+        if (req->cmd.mode == SCSI_XFER_FROM_DEV) {
+            qemu_iovec_from_buf(req->iov, 0, buf, len);
+        } else {
+            qemu_iovec_to_buf(req->iov, 0, buf, len);
+        }
+        req->resid = req->iov->size - len;
+    } else if (req->cmd.mode == SCSI_XFER_FROM_DEV) {
         req->resid = dma_buf_read(buf, len, req->sg);
     } else {
         req->resid = dma_buf_write(buf, len, req->sg);
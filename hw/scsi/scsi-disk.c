@@ -348,6 +348,13 @@ static void scsi_do_read(void *opaque, int ret)
         r->req.resid -= r->req.sg->size;
         r->req.aiocb = dma_bdrv_read(s->qdev.conf.bs, r->req.sg, r->sector,
                                      scsi_dma_complete, r);
+    } else if (r->req.iov) {
+        n = r->req.iov->size / BDRV_SECTOR_SIZE;
+        bdrv_acct_start(s->qdev.conf.bs, &r->acct, r->req.iov->size,
+                        BDRV_ACCT_READ);
+        r->req.resid -= r->req.iov->size;
+        r->req.aiocb = bdrv_aio_readv(s->qdev.conf.bs, r->sector, r->req.iov,
+                                      n, scsi_dma_complete, r);
     } else {
         n = scsi_init_iovec(r, SCSI_DMA_BUF_SIZE);
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, n * BDRV_SECTOR_SIZE, BDRV_ACCT_READ);
@@ -492,7 +499,7 @@ static void scsi_write_data(SCSIRequest *req)
         return;
     }
 
-    if (!r->req.sg && !r->qiov.size) {
+    if (!r->req.sg && !r->req.iov && !r->qiov.size) {
         /* Called for the first time.  Ask the driver to send us more data.  */
         r->started = true;
         scsi_write_complete(r, 0);
@@ -505,7 +512,7 @@ static void scsi_write_data(SCSIRequest *req)
 
     if (r->req.cmd.buf[0] == VERIFY_10 || r->req.cmd.buf[0] == VERIFY_12 ||
         r->req.cmd.buf[0] == VERIFY_16) {
-        if (r->req.sg) {
+        if (r->req.sg || r->req.iov) {
             scsi_dma_complete_noio(r, 0);
         } else {
             scsi_write_complete(r, 0);
@@ -518,6 +525,13 @@ static void scsi_write_data(SCSIRequest *req)
         r->req.resid -= r->req.sg->size;
         r->req.aiocb = dma_bdrv_write(s->qdev.conf.bs, r->req.sg, r->sector,
                                       scsi_dma_complete, r);
+    } else if (r->req.iov) {
+        n = r->req.iov->size / BDRV_SECTOR_SIZE;
+        bdrv_acct_start(s->qdev.conf.bs, &r->acct, r->req.iov->size,
+                        BDRV_ACCT_WRITE);
+        r->req.resid -= r->req.iov->size;
+        r->req.aiocb = bdrv_aio_writev(s->qdev.conf.bs, r->sector, r->req.iov,
+                                       n, scsi_dma_complete, r);
     } else {
         n = r->qiov.size / 512;
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, n * BDRV_SECTOR_SIZE, BDRV_ACCT_WRITE);
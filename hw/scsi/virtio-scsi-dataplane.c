@@ -0,0 +1,370 @@
+/*
+ * Dedicated thread for virtio-scsi command processing
+ *
+ * The command virtqueues of the HBA are served by an iothread, either the
+ * one named by x-iothread or one of its own.  Requests go through the SCSI
+ * layer and the block layer like they do in the main loop; the disks on the
+ * bus are moved to the iothread's AioContext while the dataplane runs, and
+ * moved back when it stops.  The control and event virtqueues stay in the
+ * main loop.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-scsi.h"
+#include "hw/virtio/virtio-bus.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+
+struct VirtIOSCSIVring {
+    VirtIOSCSIDataPlane *s;
+    int n;                          /* virtqueue index */
+    Vring vring;
+
+    /* Assigned by value, see hw/block/dataplane/virtio-blk.c */
+    EventNotifier host_notifier;    /* doorbell */
+    EventNotifier *guest_notifier;  /* irq */
+};
+
+struct VirtIOSCSIDataPlane {
+    VirtIOSCSI *vs;
+    bool started;
+    bool stopping;
+    bool disabled;                  /* could not start, until the next reset */
+
+    IOThread *iothread;             /* x-iothread, or one of our own */
+    AioContext *ctx;
+    VirtIOSCSIVring *cmd_vrings;    /* one per command virtqueue */
+};
+
+static int flush_true(EventNotifier *e)
+{
+    return true;
+}
+
+void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req, unsigned int len)
+{
+    VirtIOSCSIVring *r = req->vring;
+    VirtIODevice *vdev = VIRTIO_DEVICE(req->dev);
+
+    vring_push(&r->vring, req->elem.index, len);
+    if (vring_should_notify(vdev, &r->vring)) {
+        event_notifier_set(r->guest_notifier);
+    }
+}
+
+static VirtIOSCSIReq *virtio_scsi_vring_pop(VirtIOSCSIDataPlane *s,
+                                            VirtIOSCSIVring *r)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->vs);
+    VirtIOSCSIReq *req;
+    VirtQueueElement *elem;
+    int head;
+
+    req = g_malloc(sizeof(*req));
+    elem = &req->elem;
+
+    /* vring_pop() writes the out iovecs followed by the in iovecs */
+    head = vring_pop(vdev, &r->vring, elem->out_sg,
+                     &elem->out_sg[VIRTQUEUE_MAX_SIZE],
+                     &elem->out_num, &elem->in_num);
+    if (head < 0) {
+        if (head != -EAGAIN) {
+            vring_set_broken(&r->vring);
+        }
+        g_free(req);
+        return NULL;
+    }
+
+    trace_virtio_scsi_data_plane_process_request(s, elem->out_num,
+                                                 elem->in_num, head);
+
+    elem->index = head;
+    memcpy(elem->in_sg, &elem->out_sg[elem->out_num],
+           elem->in_num * sizeof(struct iovec));
+
+    req->vring = r;
+    virtio_scsi_parse_req(s->vs, virtio_get_queue(vdev, r->n), req);
+    return req;
+}
+
+static void virtio_scsi_data_plane_handle_cmd(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *r = container_of(notifier, VirtIOSCSIVring,
+                                      host_notifier);
+    VirtIOSCSIDataPlane *s = r->s;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->vs);
+    VirtIOSCSIReq *req;
+
+    event_notifier_test_and_clear(notifier);
+    virtio_scsi_io_plug(s->vs, true);
+    do {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &r->vring);
+
+        while ((req = virtio_scsi_vring_pop(s, r))) {
+            virtio_scsi_handle_cmd_req(s->vs, req);
+        }
+
+        /* Re-enable guest->host notifies and stop processing the vring.
+         * But if the guest has snuck in more descriptors, keep processing.
+         */
+    } while (!r->vring.broken && !vring_enable_notification(vdev, &r->vring));
+    virtio_scsi_io_plug(s->vs, false);
+}
+
+/* Block jobs only work in the main loop */
+static bool virtio_scsi_data_plane_check_devices(VirtIOSCSIDataPlane *s)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->vs->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        if (bdrv_in_use(d->conf.bs)) {
+            error_report("cannot start dataplane thread while device '%s' "
+                         "is in use", bdrv_get_device_name(d->conf.bs));
+            return false;
+        }
+        if (!bdrv_can_set_aio_context(d->conf.bs)) {
+            error_report("cannot start dataplane thread, the image of "
+                         "device '%s' cannot be used from an iothread",
+                         bdrv_get_device_name(d->conf.bs));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Called with the old AioContext of the devices acquired.  While they are
+ * in the dataplane thread, they are marked in use so that block operations
+ * that conflict with it are refused.
+ */
+static void virtio_scsi_data_plane_move_devices(VirtIOSCSIDataPlane *s,
+                                                AioContext *ctx)
+{
+    bool in_use = ctx != qemu_get_aio_context();
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->vs->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        if (in_use) {
+            bdrv_set_in_use(d->conf.bs, 1);
+        }
+        bdrv_set_aio_context(d->conf.bs, ctx);
+        if (!in_use) {
+            bdrv_set_in_use(d->conf.bs, 0);
+        }
+    }
+}
+
+/* Complete the requests that the dataplane thread could not finish, such as
+ * those waiting to be retried after an I/O error.  They refer to the vring,
+ * which is going away.
+ */
+static void virtio_scsi_data_plane_cancel_requests(VirtIOSCSIDataPlane *s)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->vs->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+        SCSIRequest *r, *next;
+
+        QTAILQ_FOREACH_SAFE(r, &d->requests, next, next) {
+            VirtIOSCSIReq *req = r->hba_private;
+
+            if (req && req->vring) {
+                scsi_req_cancel(r);
+            }
+        }
+    }
+}
+
+bool virtio_scsi_data_plane_create(VirtIOSCSI *vs,
+                                   VirtIOSCSIDataPlane **dataplane)
+{
+    VirtIOSCSICommon *vsc = VIRTIO_SCSI_COMMON(vs);
+    VirtIOSCSIDataPlane *s;
+    IOThread *iothread = NULL;
+
+    *dataplane = NULL;
+
+    if (!vsc->conf.data_plane && !vsc->conf.iothread) {
+        return true;
+    }
+
+    if (vsc->conf.iothread) {
+        iothread = iothread_find(vsc->conf.iothread);
+        if (!iothread) {
+            error_report("iothread '%s' not found", vsc->conf.iothread);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+    } else {
+        iothread = IOTHREAD(object_new(TYPE_IOTHREAD));
+    }
+
+    s = g_new0(VirtIOSCSIDataPlane, 1);
+    s->vs = vs;
+    s->cmd_vrings = g_new0(VirtIOSCSIVring, vsc->conf.num_queues);
+    s->iothread = iothread;
+    s->ctx = iothread_get_aio_context(iothread);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_scsi_data_plane_stop(s);
+    object_unref(OBJECT(s->iothread));
+    g_free(s->cmd_vrings);
+    g_free(s);
+}
+
+/* Returns true if the dataplane thread now processes the command queues */
+bool virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s)
+{
+    VirtIOSCSICommon *vsc = VIRTIO_SCSI_COMMON(s->vs);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->vs);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = 2 + vsc->conf.num_queues;
+    int i;
+
+    if (s->started) {
+        return true;
+    }
+    if (s->disabled) {
+        return false;
+    }
+    if (!virtio_scsi_data_plane_check_devices(s)) {
+        s->disabled = true;
+        return false;
+    }
+
+    /* Set up guest notifiers (irq), the first two queues stay in the
+     * main loop but the call sets up all of them.
+     */
+    if (k->set_guest_notifiers(qbus->parent, nvqs, true) != 0) {
+        error_report("virtio-scsi failed to set guest notifiers, "
+                     "ensure -enable-kvm is set");
+        s->disabled = true;
+        return false;
+    }
+
+    for (i = 0; i < vsc->conf.num_queues; i++) {
+        VirtIOSCSIVring *r = &s->cmd_vrings[i];
+
+        r->s = s;
+        r->n = 2 + i;
+        if (!vring_setup(&r->vring, vdev, r->n)) {
+            error_report("virtio-scsi failed to map virtqueue %d", r->n);
+            goto fail_vrings;
+        }
+    }
+
+    /* The iothread may already run, and serve other devices too */
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < vsc->conf.num_queues; i++) {
+        VirtIOSCSIVring *r = &s->cmd_vrings[i];
+        VirtQueue *vq = virtio_get_queue(vdev, r->n);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, r->n, true) != 0) {
+            fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+            exit(1);
+        }
+        r->host_notifier = *virtio_queue_get_host_notifier(vq);
+        r->guest_notifier = virtio_queue_get_guest_notifier(vq);
+        aio_set_event_notifier(s->ctx, &r->host_notifier,
+                               virtio_scsi_data_plane_handle_cmd, flush_true);
+    }
+
+    virtio_scsi_data_plane_move_devices(s, s->ctx);
+    aio_context_release(s->ctx);
+    s->started = true;
+    trace_virtio_scsi_data_plane_start(s);
+
+    /* Kick right away to begin processing requests already in the vrings */
+    for (i = 0; i < vsc->conf.num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, s->cmd_vrings[i].n);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    return true;
+
+fail_vrings:
+    while (--i >= 0) {
+        vring_teardown(&s->cmd_vrings[i].vring, vdev, s->cmd_vrings[i].n);
+    }
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    s->disabled = true;
+    return false;
+}
+
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s)
+{
+    VirtIOSCSICommon *vsc = VIRTIO_SCSI_COMMON(s->vs);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s->vs);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_scsi_data_plane_stop(s);
+
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < vsc->conf.num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i].host_notifier,
+                               NULL, NULL);
+    }
+
+    /* This drains the requests, their completions still use the vrings */
+    virtio_scsi_data_plane_move_devices(s, qemu_get_aio_context());
+    virtio_scsi_data_plane_cancel_requests(s);
+    aio_context_release(s->ctx);
+
+    for (i = 0; i < vsc->conf.num_queues; i++) {
+        VirtIOSCSIVring *r = &s->cmd_vrings[i];
+
+        k->set_host_notifier(qbus->parent, r->n, false);
+        vring_teardown(&r->vring, vdev, r->n);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, 2 + vsc->conf.num_queues, false);
+
+    s->started = false;
+    s->stopping = false;
+}
+
+/* Called on device reset, gives the dataplane another chance to start */
+void virtio_scsi_data_plane_reset(VirtIOSCSIDataPlane *s)
+{
+    virtio_scsi_data_plane_stop(s);
+    s->disabled = false;
+}
+
+/* Returns the AioContext of the thread, or NULL if it is not running */
+AioContext *virtio_scsi_data_plane_get_aio_context(VirtIOSCSIDataPlane *s)
+{
+    return s->started ? s->ctx : NULL;
+}
@@ -15,30 +15,13 @@
 
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
-
-typedef struct VirtIOSCSIReq {
-    VirtIOSCSI *dev;
-    VirtQueue *vq;
-    VirtQueueElement elem;
-    QEMUSGList qsgl;
-    SCSIRequest *sreq;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdReq      *cmd;
-        VirtIOSCSICtrlTMFReq  *tmf;
-        VirtIOSCSICtrlANReq   *an;
-    } req;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdResp     *cmd;
-        VirtIOSCSICtrlTMFResp *tmf;
-        VirtIOSCSICtrlANResp  *an;
-        VirtIOSCSIEvent       *event;
-    } resp;
-} VirtIOSCSIReq;
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+# include "migration/migration.h"
+#endif
 
 static inline int virtio_scsi_get_lun(uint8_t *lun)
 {
@@ -56,18 +39,46 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
-static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+/* Size of the data buffers that follow the request and response headers */
+static size_t virtio_scsi_data_size(VirtIOSCSIReq *req)
+{
+    if (!req->vring) {
+        return req->qsgl.size;
+    }
+    if (req->elem.out_num > 1) {
+        return iov_size(&req->elem.out_sg[1], req->elem.out_num - 1);
+    }
+    return iov_size(&req->elem.in_sg[1], req->elem.in_num - 1);
+}
+
+static void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
-    VirtIOSCSI *s = req->dev;
-    VirtQueue *vq = req->vq;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
-    qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
     g_free(req);
+}
+
+static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+{
+    VirtIOSCSI *s = req->dev;
+    VirtQueue *vq = req->vq;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned int len = virtio_scsi_data_size(req) + req->elem.in_sg[0].iov_len;
+
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (req->vring) {
+        virtio_scsi_vring_push_notify(req, len);
+        qemu_iovec_destroy(&req->qiov);
+        virtio_scsi_free_req(req);
+        return;
+    }
+#endif
+
+    virtqueue_push(vq, &req->elem, len);
+    qemu_sglist_destroy(&req->qsgl);
+    virtio_scsi_free_req(req);
     virtio_notify(vdev, vq);
 }
 
@@ -88,8 +99,13 @@ static void qemu_sgl_init_external(VirtIOSCSIReq *req, struct iovec *sg,
     }
 }
 
-static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
-                                  VirtIOSCSIReq *req)
+/* The dataplane sets req->vring before parsing.  The guest buffers are then
+ * already mapped, and virtio_scsi_get_iov() hands them to the SCSI layer.
+ */
+#ifndef CONFIG_VIRTIO_DATA_PLANE
+static
+#endif
+void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req)
 {
     assert(req->elem.in_num);
     req->vq = vq;
@@ -100,7 +116,10 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
     }
     req->resp.buf = req->elem.in_sg[0].iov_base;
 
-    if (req->elem.out_num > 1) {
+    if (req->vring) {
+        memset(&req->qiov, 0, sizeof(req->qiov));
+        memset(&req->qsgl, 0, sizeof(req->qsgl));
+    } else if (req->elem.out_num > 1) {
         qemu_sgl_init_external(req, &req->elem.out_sg[1],
                                &req->elem.out_addr[1],
                                req->elem.out_num - 1);
@@ -115,6 +134,7 @@ static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
     req = g_malloc(sizeof(*req));
+    req->vring = NULL;
     if (!virtqueue_pop(vq, &req->elem)) {
         g_free(req);
         return NULL;
@@ -144,6 +164,7 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     uint32_t n;
 
     req = g_malloc(sizeof(*req));
+    req->vring = NULL;
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
     qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
@@ -266,11 +287,31 @@ fail:
     req->resp.tmf->response = VIRTIO_SCSI_S_BAD_TARGET;
 }
 
+/* The control queue stays in the main loop.  While the dataplane runs the
+ * commands, take its AioContext so that task management functions can
+ * cancel them.
+ */
+static AioContext *virtio_scsi_get_aio_context(VirtIOSCSI *s)
+{
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (s->dataplane) {
+        AioContext *ctx = virtio_scsi_data_plane_get_aio_context(s->dataplane);
+
+        if (ctx) {
+            return ctx;
+        }
+    }
+#endif
+    return qemu_get_aio_context();
+}
+
 static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    AioContext *ctx = virtio_scsi_get_aio_context(s);
     VirtIOSCSIReq *req;
 
+    aio_context_acquire(ctx);
     while ((req = virtio_scsi_pop_req(s, vq))) {
         int out_size, in_size;
         if (req->elem.out_num < 1 || req->elem.in_num < 1) {
@@ -298,6 +339,7 @@ static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         }
         virtio_scsi_complete_req(req);
     }
+    aio_context_release(ctx);
 }
 
 static void virtio_scsi_command_complete(SCSIRequest *r, uint32_t status,
@@ -323,7 +365,26 @@ static QEMUSGList *virtio_scsi_get_sg_list(SCSIRequest *r)
 {
     VirtIOSCSIReq *req = r->hba_private;
 
-    return &req->qsgl;
+    return req->vring ? NULL : &req->qsgl;
+}
+
+static QEMUIOVector *virtio_scsi_get_iov(SCSIRequest *r)
+{
+    VirtIOSCSIReq *req = r->hba_private;
+
+    if (!req->vring) {
+        return NULL;
+    }
+    if (req->elem.out_num > 1) {
+        qemu_iovec_init(&req->qiov, req->elem.out_num - 1);
+        qemu_iovec_concat_iov(&req->qiov, &req->elem.out_sg[1],
+                              req->elem.out_num - 1, 0, r->cmd.xfer);
+    } else {
+        qemu_iovec_init(&req->qiov, req->elem.in_num - 1);
+        qemu_iovec_concat_iov(&req->qiov, &req->elem.in_sg[1],
+                              req->elem.in_num - 1, 0, r->cmd.xfer);
+    }
+    return &req->qiov;
 }
 
 static void virtio_scsi_request_cancelled(SCSIRequest *r)
@@ -347,63 +408,110 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
-static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+/* Batch the I/O of all the commands in the virtqueue, see bdrv_io_plug() */
+#ifndef CONFIG_VIRTIO_DATA_PLANE
+static
+#endif
+void virtio_scsi_io_plug(VirtIOSCSI *s, bool plug)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        if (!d->conf.bs) {
+            continue;
+        }
+        if (plug) {
+            bdrv_io_plug(d->conf.bs);
+        } else {
+            bdrv_io_unplug(d->conf.bs);
+        }
+    }
+}
+
+/* Shared by the virtqueue handler and the dataplane thread */
+#ifndef CONFIG_VIRTIO_DATA_PLANE
+static
+#endif
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     /* use non-QOM casts in the data path */
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSICommon *vs = &s->parent_obj;
-
-    VirtIOSCSIReq *req;
+    SCSIDevice *d;
+    int out_size, in_size;
     int n;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
-            virtio_scsi_bad_req();
-        }
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
+        virtio_scsi_bad_req();
+    }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > virtio_scsi_data_size(req)) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
             virtio_scsi_complete_req(req);
-            continue;
-        }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
+            return;
         }
+    }
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
-        }
+    n = scsi_req_enqueue(req->sreq);
+    if (n) {
+        scsi_req_continue(req->sreq);
     }
 }
 
+static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* use non-QOM casts in the data path */
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().  If it cannot
+     * run, the requests are processed here as usual.
+     */
+    if (s->dataplane && virtio_scsi_data_plane_start(s->dataplane)) {
+        return;
+    }
+#endif
+
+    virtio_scsi_io_plug(s, true);
+    do {
+        virtqueue_batch_begin(vq);
+        while ((req = virtio_scsi_pop_req(s, vq))) {
+            virtio_scsi_handle_cmd_req(s, req);
+        }
+    } while (virtqueue_batch_end(vq));
+    virtio_scsi_io_plug(s, false);
+}
+
 static void virtio_scsi_get_config(VirtIODevice *vdev,
                                    uint8_t *config)
 {
@@ -449,6 +557,12 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     VirtIOSCSI *s = VIRTIO_SCSI(vdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(vdev);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_reset(s->dataplane);
+    }
+#endif
+
     s->resetting++;
     qbus_reset_all(&s->bus.qbus);
     s->resetting--;
@@ -458,12 +572,32 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     s->events_dropped = false;
 }
 
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    VirtIOSCSI *s = VIRTIO_SCSI(vdev);
+
+    if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+}
+
 /* The device does not have anything to save beyond the virtio data.
  * Request data is saved with callbacks from SCSI devices.
  */
 static void virtio_scsi_save(QEMUFile *f, void *opaque)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    VirtIOSCSI *s = VIRTIO_SCSI(vdev);
+
+    /* Put the requests and the vring indices back in the VirtQueues */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
     virtio_save(vdev, f);
 }
 
@@ -556,6 +690,13 @@ static void virtio_scsi_hotplug(SCSIBus *bus, SCSIDevice *dev)
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    /* The next kick restarts the dataplane with the new device */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+
     if ((vdev->guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_RESCAN);
@@ -567,6 +708,13 @@ static void virtio_scsi_hot_unplug(SCSIBus *bus, SCSIDevice *dev)
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    /* Give the device back to the main loop before it goes away */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+
     if ((vdev->guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_REMOVED);
@@ -585,6 +733,7 @@ static struct SCSIBusInfo virtio_scsi_scsi_info = {
     .hotplug = virtio_scsi_hotplug,
     .hot_unplug = virtio_scsi_hot_unplug,
     .get_sg_list = virtio_scsi_get_sg_list,
+    .get_iov = virtio_scsi_get_iov,
     .save_request = virtio_scsi_save_request,
     .load_request = virtio_scsi_load_request,
 };
@@ -613,6 +762,33 @@ int virtio_scsi_common_init(VirtIOSCSICommon *s)
     return 0;
 }
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+/* Disable dataplane thread during live migration since it does not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_scsi_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIOSCSI *s = container_of(notifier, VirtIOSCSI,
+                                 migration_state_notifier);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        if (!s->dataplane) {
+            return;
+        }
+        virtio_scsi_data_plane_destroy(s->dataplane);
+        s->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (s->dataplane) {
+            return;
+        }
+        bdrv_drain_all(); /* complete in-flight non-dataplane requests */
+        virtio_scsi_data_plane_create(s, &s->dataplane);
+    }
+}
+#endif /* CONFIG_VIRTIO_DATA_PLANE */
+
 static int virtio_scsi_device_init(VirtIODevice *vdev)
 {
     DeviceState *qdev = DEVICE(vdev);
@@ -637,6 +813,14 @@ static int virtio_scsi_device_init(VirtIODevice *vdev)
         }
     }
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    if (!virtio_scsi_data_plane_create(s, &s->dataplane)) {
+        return -1;
+    }
+    s->migration_state_notifier.notify = virtio_scsi_migration_state_changed;
+    add_migration_state_change_notifier(&s->migration_state_notifier);
+#endif
+
     register_savevm(qdev, "virtio-scsi", virtio_scsi_id++, 1,
                     virtio_scsi_save, virtio_scsi_load, s);
 
@@ -657,6 +841,11 @@ static int virtio_scsi_device_exit(DeviceState *qdev)
     VirtIOSCSI *s = VIRTIO_SCSI(qdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(qdev);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    remove_migration_state_change_notifier(&s->migration_state_notifier);
+    virtio_scsi_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(qdev, "virtio-scsi", s);
     return virtio_scsi_common_exit(vs);
 }
@@ -686,6 +875,7 @@ static void virtio_scsi_class_init(ObjectClass *klass, void *data)
     vdc->set_config = virtio_scsi_set_config;
     vdc->get_features = virtio_scsi_get_features;
     vdc->reset = virtio_scsi_reset;
+    vdc->set_status = virtio_scsi_set_status;
 }
 
 static const TypeInfo virtio_scsi_common_info = {
@@ -1040,8 +1040,10 @@ static Property virtio_blk_pci_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                     VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkPCI, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-max-ns", VirtIOBlkPCI, blk.poll_max_ns, 0),
+    DEFINE_PROP_STRING("x-iothread", VirtIOBlkPCI, blk.iothread),
 #endif
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_VIRTIO_BLK_PROPERTIES(VirtIOBlkPCI, blk),
@@ -1099,6 +1101,12 @@ static Property virtio_scsi_pci_properties[] = {
                        DEV_NVECTORS_UNSPECIFIED),
     DEFINE_VIRTIO_SCSI_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOSCSIPCI, vdev.parent_obj.conf),
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOSCSIPCI,
+                    vdev.parent_obj.conf.data_plane, 0, false),
+    DEFINE_PROP_STRING("x-iothread", VirtIOSCSIPCI,
+                       vdev.parent_obj.conf.iothread),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1393,6 +1401,11 @@ static Property virtio_net_properties[] = {
     DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_NIC_PROPERTIES(VirtIONetPCI, vdev.nic_conf),
     DEFINE_VIRTIO_NET_PROPERTIES(VirtIONetPCI, vdev.net_conf),
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONetPCI, vdev.net_conf.data_plane,
+                    0, false),
+    DEFINE_PROP_STRING("x-iothread", VirtIONetPCI, vdev.net_conf.iothread),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
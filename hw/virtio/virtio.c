@@ -63,6 +63,17 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/* A descriptor table, the one of the ring or an indirect one.  It is mapped
+ * while it is used if it is in RAM, otherwise descriptors are read through
+ * the memory API.
+ */
+typedef struct VRingDescTable
+{
+    hwaddr pa;
+    unsigned int num;
+    VRingDesc *map;
+} VRingDescTable;
+
 struct VirtQueue
 {
     VRing vring;
@@ -86,6 +97,14 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /* State between virtqueue_batch_begin() and virtqueue_batch_end() */
+    bool batch;
+    uint16_t batch_avail_idx;       /* avail idx last read from the ring */
+    unsigned int batch_popped;
+    unsigned int batch_used;        /* filled but not flushed yet */
+    bool batch_notify;              /* virtio_notify() was called */
+    VRingDescTable desc_table;
 };
 
 /* virt queue functions */
@@ -100,32 +119,65 @@ static void virtqueue_init(VirtQueue *vq)
                                  vq->vring.align);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static void vring_desc_table_init(VRingDescTable *table, hwaddr pa,
+                                  unsigned int num)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    table->pa = pa;
+    table->num = num;
+    table->map = NULL;
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static void vring_desc_table_map(VRingDescTable *table)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    hwaddr size = table->num * sizeof(VRingDesc);
+    hwaddr len = size;
+
+    table->map = cpu_physical_memory_map(table->pa, &len, 0);
+    if (table->map && len != size) {
+        cpu_physical_memory_unmap(table->map, len, 0, 0);
+        table->map = NULL;
+    }
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static void vring_desc_table_unmap(VRingDescTable *table)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    if (table->map) {
+        cpu_physical_memory_unmap(table->map, table->num * sizeof(VRingDesc),
+                                  0, 0);
+        table->map = NULL;
+    }
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+/* Reads a whole descriptor at once, the guest cannot change it halfway */
+static void vring_desc_read(VRingDescTable *table, unsigned int i,
+                            VRingDesc *desc)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    if (table->map) {
+        *desc = table->map[i];
+    } else {
+        cpu_physical_memory_read(table->pa + sizeof(VRingDesc) * i,
+                                 desc, sizeof(*desc));
+    }
+    desc->addr = tswap64(desc->addr);
+    desc->len = tswap32(desc->len);
+    desc->flags = tswap16(desc->flags);
+    desc->next = tswap16(desc->next);
+}
+
+/* Maps the indirect table that @desc points to and returns its size in
+ * descriptors.
+ */
+static unsigned int vring_desc_indirect(VRingDescTable *table,
+                                        const VRingDesc *desc)
+{
+    if (desc->len % sizeof(VRingDesc) || desc->len == 0) {
+        error_report("Invalid size for indirect buffer table");
+        exit(1);
+    }
+
+    vring_desc_table_init(table, desc->addr, desc->len / sizeof(VRingDesc));
+    vring_desc_table_map(table);
+    return table->num;
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
@@ -280,6 +332,12 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
+    if (vq->batch) {
+        /* virtqueue_batch_end() publishes it */
+        virtqueue_fill(vq, elem, len, vq->batch_used++);
+        return;
+    }
+
     virtqueue_fill(vq, elem, len, 0);
     virtqueue_flush(vq, 1);
 }
@@ -320,20 +378,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
-    /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
-
+    /* Check they're not leading us off end of descriptors.  The descriptor
+     * is a copy, so the guest cannot change next after this check.
+     */
+    next = desc->next;
     if (next >= max) {
         error_report("Desc next is %u", next);
         exit(1);
@@ -354,20 +410,22 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
-        hwaddr desc_pa;
+        VRingDescTable ring, indirect_table, *table;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
-
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-                error_report("Invalid size for indirect buffer table");
-                exit(1);
-            }
+        if (vq->batch) {
+            table = &vq->desc_table;
+        } else {
+            vring_desc_table_init(&ring, vq->vring.desc, vq->vring.num);
+            table = &ring;
+        }
+        vring_desc_read(table, i, &desc);
 
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
             /* If we've got too many, that implies a descriptor loop. */
             if (num_bufs >= max) {
                 error_report("Looped descriptor");
@@ -376,27 +434,41 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_indirect(&indirect_table, &desc);
+            table = &indirect_table;
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            vring_desc_read(table, i, &desc);
         }
 
-        do {
+        for (;;) {
             /* If we've got too many, that implies a descriptor loop. */
             if (++num_bufs > max) {
                 error_report("Looped descriptor");
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
-                goto done;
+                break;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i == max) {
+                break;
+            }
+            vring_desc_read(table, i, &desc);
+        }
+
+        if (indirect) {
+            vring_desc_table_unmap(&indirect_table);
+        }
+        if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+            goto done;
+        }
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -440,10 +512,25 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
-
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    VRingDescTable ring, indirect_table, *table;
+    VRingDesc desc;
+    bool indirect = false;
+
+    if (vq->batch) {
+        /* Only look at the avail idx again when the known heads are used */
+        if (vq->last_avail_idx == vq->batch_avail_idx) {
+            vq->batch_avail_idx += virtqueue_num_heads(vq, vq->last_avail_idx);
+            if (vq->last_avail_idx == vq->batch_avail_idx) {
+                return 0;
+            }
+        }
+        table = &vq->desc_table;
+    } else {
+        if (!virtqueue_num_heads(vq, vq->last_avail_idx))
+            return 0;
+        vring_desc_table_init(&ring, vq->vring.desc, vq->vring.num);
+        table = &ring;
+    }
 
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
@@ -451,50 +538,60 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+    if (vq->batch) {
+        vq->batch_popped++;
+    } else if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-            error_report("Invalid size for indirect buffer table");
-            exit(1);
-        }
-
+    vring_desc_read(table, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        indirect = true;
+        max = vring_desc_indirect(&indirect_table, &desc);
+        table = &indirect_table;
         i = 0;
+        vring_desc_read(table, i, &desc);
     }
 
     /* Collect all the descriptors */
-    do {
+    for (;;) {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i == max) {
+            break;
+        }
+        vring_desc_read(table, i, &desc);
+    }
+
+    if (indirect) {
+        vring_desc_table_unmap(&indirect_table);
+    }
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -508,6 +605,53 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     return elem->in_num + elem->out_num;
 }
 
+void virtqueue_batch_begin(VirtQueue *vq)
+{
+    assert(!vq->batch);
+
+    vq->batch = true;
+    vq->batch_avail_idx = vq->last_avail_idx;
+    vq->batch_popped = 0;
+    vq->batch_used = 0;
+    vq->batch_notify = false;
+
+    vring_desc_table_init(&vq->desc_table, vq->vring.desc, vq->vring.num);
+    if (vq->vring.desc) {
+        vring_desc_table_map(&vq->desc_table);
+    }
+}
+
+bool virtqueue_batch_end(VirtQueue *vq)
+{
+    assert(vq->batch);
+
+    vring_desc_table_unmap(&vq->desc_table);
+    vq->batch = false;
+
+    trace_virtqueue_batch_end(vq, vq->batch_popped, vq->batch_used);
+
+    if (!virtio_queue_ready(vq)) {
+        return false;
+    }
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+        /*
+         * The guest may have added a buffer after the avail idx was read
+         * above but checked the old avail event, and not kicked.  Publish
+         * the event before looking at the avail idx again below.
+         */
+        smp_mb();
+    }
+    if (vq->batch_used) {
+        virtqueue_flush(vq, vq->batch_used);
+    }
+    if (vq->batch_notify) {
+        virtio_notify(vq->vdev, vq);
+    }
+
+    return vring_avail_idx(vq) != vq->last_avail_idx;
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -806,6 +950,12 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    if (vq->batch) {
+        /* The used ring is only published by virtqueue_batch_end() */
+        vq->batch_notify = true;
+        return;
+    }
+
     if (!vring_notify(vdev, vq)) {
         return;
     }
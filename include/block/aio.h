@@ -18,6 +18,7 @@
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
+#include "qemu/rfifolock.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -45,6 +46,9 @@ typedef void IOHandler(void *opaque);
 typedef struct AioContext {
     GSource source;
 
+    /* Protects all fields from multi-threaded access */
+    RFifoLock lock;
+
     /* The list of registered AIO handlers */
     QLIST_HEAD(, AioHandler) aio_handlers;
 
@@ -72,11 +76,30 @@ typedef struct AioContext {
 
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
+
+    /* Busy polling before a blocking aio_poll() sleeps, see
+     * aio_context_set_poll_params().  poll_ns adapts between 0 and
+     * poll_max_ns to how long the waits turn out to be.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+
+    /* Waits that polling avoided, and polls that ran out of time */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
+
+    /* Nanoseconds that blocking aio_poll() calls spent asleep */
+    uint64_t idle_ns;
 } AioContext;
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushEventNotifierHandler)(EventNotifier *e);
 
+/* Checks for events without blocking and handles them.  Returns true if
+ * there were any.
+ */
+typedef bool (AioPollEventNotifierHandler)(EventNotifier *e);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -102,6 +125,38 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: The AioContext to operate on.
+ * @max_ns: Longest time to busy poll for in nanoseconds, 0 to disable.
+ *
+ * Let blocking aio_poll() calls spin on the poll handlers of the context,
+ * see aio_set_event_notifier_poll(), for a while before they go to sleep.
+ * This saves the wakeup latency when events arrive quickly.  How long
+ * to poll for adapts to the time the waits take, up to @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns);
+
+/**
+ * aio_context_acquire:
+ * @ctx: The AioContext to operate on.
+ *
+ * The AioContext and everything attached to it, for example the block
+ * devices it runs, may only be used by the thread that holds its lock.
+ * A thread that runs an event loop for the context typically holds the
+ * lock while it calls aio_poll(); other threads wake it up with
+ * aio_notify() when they wait for the lock.  The lock is recursive.
+ */
+void aio_context_acquire(AioContext *ctx);
+
+/**
+ * aio_context_release:
+ * @ctx: The AioContext to operate on.
+ *
+ * Release the AioContext after aio_context_acquire().
+ */
+void aio_context_release(AioContext *ctx);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
@@ -228,6 +283,16 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifierHandler *io_read,
                             AioFlushEventNotifierHandler *io_flush);
 
+/* Add a poll handler to an event notifier registered with
+ * aio_set_event_notifier().  If the AioContext busy polls, it calls @io_poll
+ * in a loop while the notifier is busy according to its io_flush callback;
+ * @io_poll should check for events where they can be seen without a system
+ * call, e.g. in a ring in shared memory.  Pass NULL to remove it.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -242,6 +307,8 @@ bool qemu_aio_wait(void);
 void qemu_aio_set_event_notifier(EventNotifier *notifier,
                                  EventNotifierHandler *io_read,
                                  AioFlushEventNotifierHandler *io_flush);
+void qemu_aio_set_event_notifier_poll(EventNotifier *notifier,
+                                      AioPollEventNotifierHandler *io_poll);
 
 #ifdef CONFIG_POSIX
 void qemu_aio_set_fd_handler(int fd,
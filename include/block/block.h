@@ -28,6 +28,14 @@ typedef struct BlockFragInfo {
 } BlockFragInfo;
 
 /* Callbacks for block device models */
+typedef enum {
+    BDRV_REQ_COPY_ON_READ = 0x1,
+    BDRV_REQ_ZERO_WRITE   = 0x2,
+    /* The driver may discard the area instead of writing zeroes as long as
+     * it reads back as zeroes afterwards */
+    BDRV_REQ_MAY_UNMAP    = 0x4,
+} BdrvRequestFlags;
+
 typedef struct BlockDevOps {
     /*
      * Runs when virtual media changed (monitor commands eject, change)
@@ -158,7 +166,7 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors);
 int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
-               int nb_sectors);
+               int nb_sectors, BdrvRequestFlags flags);
 int bdrv_writev(BlockDriverState *bs, int64_t sector_num, QEMUIOVector *qiov);
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count);
@@ -180,13 +188,34 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
  * because it may allocate memory for the entire region.
  */
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
-    int nb_sectors);
+    int nb_sectors, BdrvRequestFlags flags);
 int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, int *pnum);
 int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
                                             BlockDriverState *base,
                                             int64_t sector_num,
                                             int nb_sectors, int *pnum);
+
+/*
+ * Block status flags.  BDRV_BLOCK_DATA means that the sectors contain data
+ * that must be read, BDRV_BLOCK_ZERO that they read as zeroes, and
+ * BDRV_BLOCK_ALLOCATED that they are not taken from the backing file.  If
+ * BDRV_BLOCK_OFFSET_VALID is set, the sectors are stored unchanged in
+ * bs->file at the offset given by BDRV_BLOCK_OFFSET_MASK.
+ */
+#define BDRV_BLOCK_DATA         0x01
+#define BDRV_BLOCK_ZERO         0x02
+#define BDRV_BLOCK_OFFSET_VALID 0x04
+#define BDRV_BLOCK_ALLOCATED    0x10
+#define BDRV_BLOCK_OFFSET_MASK  BDRV_SECTOR_MASK
+
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum);
+int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *top,
+                                                    BlockDriverState *base,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -254,6 +283,37 @@ typedef struct BlockRequest {
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
 
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
+/**
+ * bdrv_get_aio_context:
+ *
+ * Returns: the currently bound #AioContext
+ */
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_set_aio_context:
+ *
+ * Changes the #AioContext used for fd handlers, timers, and BHs by this
+ * BlockDriverState and all its children.  The requests of the device are
+ * then submitted and completed in the thread that runs @new_context.
+ *
+ * This function must be called from the main loop thread with the old
+ * #AioContext acquired.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
+/**
+ * bdrv_can_set_aio_context:
+ *
+ * Returns: true if the drivers of this BlockDriverState and all its children
+ * support moving to another #AioContext with bdrv_set_aio_context(), that is
+ * none of them keeps fd handlers, timers or BHs in the main loop
+ */
+bool bdrv_can_set_aio_context(BlockDriverState *bs);
+
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
 BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
@@ -281,6 +341,10 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
                       int *pnum);
 int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
                             int64_t sector_num, int nb_sectors, int *pnum);
+int64_t bdrv_get_block_status_above(BlockDriverState *top,
+                                    BlockDriverState *base,
+                                    int64_t sector_num, int nb_sectors,
+                                    int *pnum);
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
                        BlockdevOnError on_write_error);
@@ -311,6 +375,9 @@ const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t sector_num, int nb_sectors,
@@ -359,15 +426,6 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs);
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
 
-#ifdef CONFIG_LINUX_AIO
-int raw_get_aio_fd(BlockDriverState *bs);
-#else
-static inline int raw_get_aio_fd(BlockDriverState *bs)
-{
-    return -ENOTSUP;
-}
-#endif
-
 enum BlockAcctType {
     BDRV_ACCT_READ,
     BDRV_ACCT_WRITE,
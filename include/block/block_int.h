@@ -38,6 +38,7 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTENDED_L2      16
 
 #define BLOCK_IO_LIMIT_READ     0
 #define BLOCK_IO_LIMIT_WRITE    1
@@ -57,6 +58,7 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTENDED_L2       "extended_l2"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 
 typedef struct BdrvTrackedRequest {
@@ -128,14 +130,21 @@ struct BlockDriver {
      * Efficiently zero a region of the disk image.  Typically an image format
      * would use a compact metadata representation to implement this.  This
      * function pointer may be NULL and .bdrv_co_writev() will be called
-     * instead.
+     * instead.  With BDRV_REQ_MAY_UNMAP in flags, the space used by the
+     * region may be freed.
      */
     int coroutine_fn (*bdrv_co_write_zeroes)(BlockDriverState *bs,
-        int64_t sector_num, int nb_sectors);
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
+    /*
+     * Returns BDRV_BLOCK_* flags; drivers that implement this don't need
+     * bdrv_co_is_allocated.
+     */
+    int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
 
     /*
      * Invalidate any cached meta-data.
@@ -161,6 +170,12 @@ struct BlockDriver {
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Like bdrv_write_compressed, but may be called from several coroutines
+     * at the same time, so that compression can run in parallel.
+     */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -172,6 +187,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    void (*bdrv_get_metadata_cache_stats)(const BlockDriverState *bs,
+                                          BlockMetadataCacheStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -218,6 +235,30 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Hold back the submission of new requests until unplugged, so that
+     * they can be submitted as a batch.  Drivers without these callbacks
+     * pass the calls to bs->file.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
+    /*
+     * Move the fd handlers and bottom halves of the driver away from the
+     * current AioContext and to @new_context, see bdrv_set_aio_context().
+     * Children are moved by the generic code.  Drivers without state of
+     * their own in the AioContext need neither.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
+    /*
+     * Set by drivers whose fd handlers, timers or bottom halves stay in the
+     * main loop, for which bdrv_can_set_aio_context() fails.
+     */
+    bool bdrv_needs_main_loop;
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -263,6 +304,9 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
+    /* number of in-flight flush and discard requests, which aren't tracked */
+    unsigned int in_flight;
+
     /* the time for latest disk I/O */
     int64_t slice_start;
     int64_t slice_end;
@@ -271,12 +315,23 @@ struct BlockDriverState {
     CoQueue      throttled_reqs;
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
+    /* The timer is in the main loop.  When the requests run in another
+     * AioContext, they arm it and are woken up through these.
+     */
+    int64_t      block_timer_deadline;
+    QEMUBH       *block_timer_arm_bh;
+    QEMUBH       *block_timer_wake_bh;
 
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    uint64_t nr_detected_zero_ops;
+    uint64_t nr_detected_zero_bytes;
+
+    /* turn writes of zeroes into write zeroes requests (-drive detect-zeroes) */
+    BlockdevDetectZeroesOptions detect_zeroes;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -303,6 +358,9 @@ struct BlockDriverState {
     BlockJob *job;
 
     QDict *options;
+
+    /* event loop that submits and completes the requests */
+    AioContext *aio_context;
 };
 
 int get_tmp_filename(char *filename, int size);
@@ -319,13 +377,6 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
-/**
- * bdrv_get_aio_context:
- *
- * Returns: the currently bound #AioContext
- */
-AioContext *bdrv_get_aio_context(BlockDriverState *bs);
-
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -586,6 +586,41 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+/**
+ * memory_region_test_and_clear_dirty_bitmap: Collect and clear the dirty
+ *                                            pages of a range.
+ *
+ * Like memory_region_test_and_clear_dirty(), but for every page of the
+ * range at once: pages that are dirty for @client are set in @dest and
+ * become clean.  The dirty state is processed a word at a time.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @dest: bitmap with one bit per target page, indexed by ram_addr_t.
+ *
+ * Returns the number of bits that were newly set in @dest.  Disjoint
+ * ranges may be collected from several threads at the same time.
+ */
+uint64_t memory_region_test_and_clear_dirty_bitmap(MemoryRegion *mr,
+                                                   hwaddr addr, hwaddr size,
+                                                   unsigned client,
+                                                   unsigned long *dest);
+
+/**
+ * memory_region_set_dirty_lebitmap: Mark the pages set in a bitmap as dirty
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of bit 0.
+ * @bitmap: one bit per target page, as an array of little endian longs
+ *          (the layout of the KVM dirty log).
+ * @pages: number of pages covered by @bitmap.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      unsigned long *bitmap, hwaddr pages);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -51,6 +51,7 @@ struct SCSIRequest {
     SCSICommand       cmd;
     BlockDriverAIOCB  *aiocb;
     QEMUSGList        *sg;
+    QEMUIOVector      *iov;         /* host memory, used when sg is NULL */
     bool              dma_started;
     uint8_t sense[SCSI_SENSE_BUF_SIZE];
     uint32_t sense_len;
@@ -135,6 +136,10 @@ struct SCSIBusInfo {
     void (*hot_unplug)(SCSIBus *bus, SCSIDevice *dev);
     void (*change)(SCSIBus *bus, SCSIDevice *dev, SCSISense sense);
     QEMUSGList *(*get_sg_list)(SCSIRequest *req);
+    /* Like get_sg_list, but for HBAs that already have the buffer in host
+     * memory.  The vector covers exactly cmd.xfer bytes.
+     */
+    QEMUIOVector *(*get_iov)(SCSIRequest *req);
 
     void (*save_request)(QEMUFile *f, SCSIRequest *req);
     void *(*load_request)(QEMUFile *f, SCSIRequest *req);
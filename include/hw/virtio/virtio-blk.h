@@ -110,6 +110,8 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t poll_max_ns;
+    char *iothread;
 };
 
 struct VirtIOBlockDataPlane;
@@ -124,7 +126,7 @@ typedef struct VirtIOBlock {
     VirtIOBlkConf blk;
     unsigned short sector_mask;
     VMChangeStateEntry *change;
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#ifdef CONFIG_VIRTIO_DATA_PLANE
     Notifier migration_state_notifier;
     struct VirtIOBlockDataPlane *dataplane;
 #endif
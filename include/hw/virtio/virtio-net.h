@@ -70,6 +70,8 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t data_plane;
+    char *iothread;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -154,6 +156,8 @@ typedef struct VirtIONetQueue {
     struct VirtIONet *n;
 } VirtIONetQueue;
 
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
 typedef struct VirtIONet {
     VirtIODevice parent_obj;
     uint8_t mac[ETH_ALEN];
@@ -193,6 +197,10 @@ typedef struct VirtIONet {
     char *netclient_name;
     char *netclient_type;
     uint64_t curr_guest_offloads;
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    VirtIONetDataPlane *dataplane;
+    Notifier migration_state_notifier;
+#endif
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -274,4 +282,19 @@ void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+/* hw/net/virtio-net-dataplane.c */
+bool virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+bool virtio_net_data_plane_start(VirtIONetDataPlane *s, int queues);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+void virtio_net_data_plane_reset(VirtIONetDataPlane *s);
+int virtio_net_data_plane_get_queues(VirtIONetDataPlane *s);
+void virtio_net_data_plane_guest_notifier_mask(VirtIONetDataPlane *s,
+                                               int idx, bool mask);
+bool virtio_net_data_plane_guest_notifier_pending(VirtIONetDataPlane *s,
+                                                  int idx);
+#endif
+
 #endif
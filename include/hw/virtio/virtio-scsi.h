@@ -153,6 +153,8 @@ struct VirtIOSCSIConf {
     uint32_t cmd_per_lun;
     char *vhostfd;
     char *wwpn;
+    uint32_t data_plane;
+    char *iothread;
 };
 
 typedef struct VirtIOSCSICommon {
@@ -166,14 +168,44 @@ typedef struct VirtIOSCSICommon {
     VirtQueue **cmd_vqs;
 } VirtIOSCSICommon;
 
+typedef struct VirtIOSCSIDataPlane VirtIOSCSIDataPlane;
+typedef struct VirtIOSCSIVring VirtIOSCSIVring;
+
 typedef struct {
     VirtIOSCSICommon parent_obj;
 
     SCSIBus bus;
     int resetting;
     bool events_dropped;
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+    VirtIOSCSIDataPlane *dataplane;
+    Notifier migration_state_notifier;
+#endif
 } VirtIOSCSI;
 
+typedef struct VirtIOSCSIReq {
+    VirtIOSCSI *dev;
+    VirtQueue *vq;
+    VirtIOSCSIVring *vring;         /* set if the dataplane popped it */
+    VirtQueueElement elem;
+    QEMUSGList qsgl;
+    QEMUIOVector qiov;              /* data buffers, only used with vring */
+    SCSIRequest *sreq;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdReq      *cmd;
+        VirtIOSCSICtrlTMFReq  *tmf;
+        VirtIOSCSICtrlANReq   *an;
+    } req;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdResp     *cmd;
+        VirtIOSCSICtrlTMFResp *tmf;
+        VirtIOSCSICtrlANResp  *an;
+        VirtIOSCSIEvent       *event;
+    } resp;
+} VirtIOSCSIReq;
+
 #define DEFINE_VIRTIO_SCSI_PROPERTIES(_state, _conf_field)                     \
     DEFINE_PROP_UINT32("num_queues", _state, _conf_field.num_queues, 1),       \
     DEFINE_PROP_UINT32("max_sectors", _state, _conf_field.max_sectors, 0xFFFF),\
@@ -189,4 +221,20 @@ typedef struct {
 int virtio_scsi_common_init(VirtIOSCSICommon *vs);
 int virtio_scsi_common_exit(VirtIOSCSICommon *vs);
 
+#ifdef CONFIG_VIRTIO_DATA_PLANE
+void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
+void virtio_scsi_io_plug(VirtIOSCSI *s, bool plug);
+
+/* hw/scsi/virtio-scsi-dataplane.c */
+bool virtio_scsi_data_plane_create(VirtIOSCSI *vs,
+                                   VirtIOSCSIDataPlane **dataplane);
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s);
+bool virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_reset(VirtIOSCSIDataPlane *s);
+AioContext *virtio_scsi_data_plane_get_aio_context(VirtIOSCSIDataPlane *s);
+void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req, unsigned int len);
+#endif
+
 #endif /* _QEMU_VIRTIO_SCSI_H */
@@ -170,6 +170,20 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+
+/* Pop a run of elements at a lower cost per element.  Between the two calls
+ * the descriptor table stays mapped, the avail idx is only read again when
+ * the heads that were seen are used up, and virtqueue_push() and
+ * virtio_notify() on @vq only take effect in virtqueue_batch_end(), which
+ * publishes the used elements all at once.  Do not call virtqueue_fill()
+ * and virtqueue_flush() on @vq in between.
+ *
+ * virtqueue_batch_end() returns true if elements are available that were not
+ * popped.  The guest need not have kicked for them, so unless the caller
+ * stopped early on purpose it must run another batch.
+ */
+void virtqueue_batch_begin(VirtQueue *vq);
+bool virtqueue_batch_end(VirtQueue *vq);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
@@ -30,6 +30,15 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Most connections a migration can be spread over (channels=N in the URI) */
+#define MIGRATION_CHANNELS_MAX 16
+/* First word on each extra connection, followed by its be32 index */
+#define MIGRATION_CHANNEL_MAGIC 0x514d4348
+/* How long the destination waits for the extra connections */
+#define MIGRATION_CHANNELS_TIMEOUT_MS 30000
+
+typedef int MigrationConnectFunc(const char *dest, Error **errp);
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -49,11 +58,41 @@ struct MigrationState
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t setup_time;
+
+    /* Post-copy return path: page requests from the destination */
+    QEMUFile *rp_file;
+    QemuThread rp_thread;
+    bool rp_done;
+    int rp_status;
+
+    /* Multi-channel migration: channel_files[0] is unused, that's file */
+    int nr_channels;
+    QEMUFile *channel_files[MIGRATION_CHANNELS_MAX];
+    MigrationConnectFunc *channel_connect;
+    char *channel_dest;
+
+    /* file: migration: RAM goes to ram_fd at ram_base + its ram_addr_t */
+    int ram_fd;
+    int64_t ram_base;
+    int ram_file_threads;
+};
+
+/* Messages sent by the destination on the return path during post-copy */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,
+    MIG_RP_MSG_SHUT,      /* be32 status, no more messages follow */
+    MIG_RP_MSG_REQ_PAGES, /* idstr, be64 offset, be32 length */
 };
 
 void process_incoming_migration(QEMUFile *f);
 
+void migration_incoming_set_listen_fd(int fd);
+void migration_incoming_stop_listening(void);
+void migration_incoming_add_channel(QEMUFile *f);
+int migration_incoming_wait_channels(int count);
+
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
@@ -78,6 +117,14 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *uri, int threads,
+                                   Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
+int file_migration_sync(MigrationState *s);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -88,11 +135,17 @@ void migrate_fd_connect(MigrationState *s);
 
 int migrate_fd_close(MigrationState *s);
 
+void migrate_set_channel_connect(MigrationState *s,
+                                 MigrationConnectFunc *connect,
+                                 const char *dest);
+
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
+bool migration_is_active(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 uint64_t ram_bytes_remaining(void);
@@ -113,9 +166,30 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_cache_evictions(void);
+double xbzrle_mig_cache_hit_rate(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_busy(void);
+double compress_mig_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
+uint64_t ram_dirty_sync_count(void);
+uint64_t ram_dirty_sync_time(void);
+int ram_throttle_percentage(void);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start,
+                         ram_addr_t len);
+int ram_postcopy_send_pages(QEMUFile *f);
+void ram_postcopy_send_end(void);
+int ram_postcopy_incoming_load(QEMUFile *f);
+void ram_channels_incoming_start(QEMUFile **files, int count);
+void ram_channels_incoming_join(void);
+void ram_file_incoming_start(int fd, int threads, bool lazy);
+void ram_file_incoming_close(void);
+void ram_file_prefetch_stop(void);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -135,15 +209,35 @@ bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
 
+int64_t migration_predict_rounds(uint64_t dirty_rate, uint64_t bandwidth,
+                                 uint64_t remaining, uint64_t ram_size,
+                                 int64_t max_downtime, int64_t *downtime);
+int migration_throttle_percentage(uint64_t dirty_rate, uint64_t bandwidth,
+                                  int cur_pct);
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* Portable encoder; xbzrle_encode_buffer() picks the best one for the host */
+int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+bool migrate_use_compression(void);
+bool migrate_use_zero_copy_send(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+void migrate_decompress_threads_join(void);
+
+bool migrate_postcopy_ram(void);
+int migrate_postcopy_rounds(void);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags);
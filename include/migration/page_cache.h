@@ -37,14 +37,15 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached, and marks it as
+ * recently used if it is
  *
  * Returns %true if page is cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -58,13 +59,16 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page's set is full the least recently used page is evicted.
+ *
+ * Returns %true if another page was evicted
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
  * @pdata: pointer to the page
  */
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
+bool cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
 
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
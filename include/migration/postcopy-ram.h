@@ -0,0 +1,39 @@
+/*
+ * Post-copy live migration of RAM
+ *
+ * The destination starts running the guest before all of RAM has been
+ * transferred; pages that have not arrived yet are trapped with
+ * userfaultfd and requested from the source over the return path.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/qemu-file.h"
+
+/* Return true if the host has everything needed to receive post-copy RAM */
+bool postcopy_ram_supported_by_host(void);
+
+/* Drop the destination's copy of a range so that the next access faults */
+int postcopy_ram_discard_range(void *host, size_t length);
+
+/*
+ * Start trapping accesses to missing pages and hand the rest of @f to a
+ * thread that receives the remaining RAM while the guest runs.
+ */
+int postcopy_ram_incoming_listen(QEMUFile *f);
+
+/* True while the post-copy listener thread owns the incoming stream */
+bool postcopy_ram_incoming_active(void);
+
+/* Fill a missing page and wake up anyone who faulted on it */
+int postcopy_place_page(void *host, void *from);
+int postcopy_place_zero_page(void *host);
+
+#endif
@@ -82,6 +82,17 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
                                size_t size,
                                int *bytes_sent);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
+
+/*
+ * Switch writes to zero-copy sends; returns a negative errno if the
+ * underlying file does not support them.
+ */
+typedef int (QEMUFileEnableZeroCopyFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -92,6 +103,8 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
+    QEMURetPathFunc *get_return_path;
+    QEMUFileEnableZeroCopyFunc *enable_zerocopy;
 } QEMUFileOps;
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
@@ -99,6 +112,9 @@ QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
+QEMUFile *qemu_bufopen(const char *mode, uint8_t *data, size_t size);
+const uint8_t *qemu_buf_get_data(QEMUFile *f, size_t *size);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
@@ -124,6 +140,8 @@ void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
 int qemu_get_byte(QEMUFile *f);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_credit_transfer(QEMUFile *f, size_t size);
+int qemu_file_enable_zerocopy(QEMUFile *f);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
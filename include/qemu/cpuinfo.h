@@ -0,0 +1,24 @@
+/*
+ * Host CPU feature detection
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_CPUINFO_H
+#define QEMU_CPUINFO_H
+
+/* Vector extensions that both the host CPU and the OS support */
+#define CPUINFO_AVX2            (1u << 0)
+#define CPUINFO_AVX512F         (1u << 1)
+
+/*
+ * Returns the CPUINFO_* flags of the host.  Safe to call from constructors,
+ * the probe runs on first use.
+ */
+unsigned int cpuinfo_get(void);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Event loop thread
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include "qom/object.h"
+#include "qemu/thread.h"
+#include "block/aio.h"
+
+#define TYPE_IOTHREAD "iothread"
+
+typedef struct {
+    Object parent_obj;
+
+    QemuThread thread;
+    QEMUBH *start_bh;               /* pending thread creation */
+    AioContext *ctx;
+    bool stopping;
+    int thread_id;
+    int64_t start_time;             /* get_clock() when the thread started */
+
+    QemuMutex init_done_lock;
+    QemuCond init_done_cond;        /* thread_id is valid */
+} IOThread;
+
+#define IOTHREAD(obj) \
+    OBJECT_CHECK(IOThread, obj, TYPE_IOTHREAD)
+
+/**
+ * iothread_find:
+ * @id: The id that the iothread was created with.
+ *
+ * Look up an iothread in /objects, returns NULL if there is none.
+ */
+IOThread *iothread_find(const char *id);
+
+/**
+ * iothread_get_id:
+ * @iothread: The iothread to operate on.
+ *
+ * Returns the id of an iothread in /objects, the caller frees it.
+ */
+char *iothread_get_id(IOThread *iothread);
+
+/**
+ * iothread_get_aio_context:
+ * @iothread: The iothread to operate on.
+ *
+ * Returns the AioContext that the thread runs.  Other threads must
+ * acquire it with aio_context_acquire() before they use it.
+ */
+AioContext *iothread_get_aio_context(IOThread *iothread);
+
+#endif /* IOTHREAD_H */
@@ -0,0 +1,235 @@
+/*
+ * Event loop thread
+ *
+ * An iothread runs an AioContext in a thread of its own.  Devices that are
+ * given the id of an iothread attach their virtqueues and disks to its
+ * AioContext, so several devices can share a thread and the threads can be
+ * pinned to host CPUs with the thread ids from query-iothreads.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+#include "qapi/visitor.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+#include "sysemu/iothread.h"
+
+#define IOTHREADS_PATH "/objects"
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_mutex_lock(&iothread->init_done_lock);
+    iothread->thread_id = qemu_get_thread_id();
+    qemu_cond_signal(&iothread->init_done_cond);
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    while (!iothread->stopping) {
+        aio_context_acquire(iothread->ctx);
+        aio_poll(iothread->ctx, true);
+        aio_context_release(iothread->ctx);
+    }
+    return NULL;
+}
+
+static void iothread_start(IOThread *iothread)
+{
+    if (!iothread->start_bh) {
+        return;
+    }
+    qemu_bh_delete(iothread->start_bh);
+    iothread->start_bh = NULL;
+
+    iothread->start_time = get_clock();
+    qemu_mutex_lock(&iothread->init_done_lock);
+    qemu_thread_create(&iothread->thread, iothread_run,
+                       iothread, QEMU_THREAD_JOINABLE);
+    while (iothread->thread_id == -1) {
+        qemu_cond_wait(&iothread->init_done_cond,
+                       &iothread->init_done_lock);
+    }
+    qemu_mutex_unlock(&iothread->init_done_lock);
+}
+
+/* -object is processed before -daemonize forks, so the thread is created by
+ * the main loop.  This also makes it inherit the cpusets of the main thread.
+ */
+static void iothread_start_bh(void *opaque)
+{
+    iothread_start(opaque);
+}
+
+static void iothread_notify(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+/* Keep aio_poll() blocking while there is no I/O, aio_notify() and the
+ * other threads that acquire the AioContext wake the thread up.
+ */
+static int iothread_notify_flush(EventNotifier *e)
+{
+    return true;
+}
+
+static void iothread_get_poll_max_ns(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t value = iothread->ctx->poll_max_ns;
+
+    visit_type_int(v, &value, name, errp);
+}
+
+static void iothread_set_poll_max_ns(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (value < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                  "a non-negative value");
+        return;
+    }
+
+    aio_context_acquire(iothread->ctx);
+    aio_context_set_poll_params(iothread->ctx, value);
+    aio_context_release(iothread->ctx);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->thread_id = -1;
+    qemu_mutex_init(&iothread->init_done_lock);
+    qemu_cond_init(&iothread->init_done_cond);
+
+    iothread->ctx = aio_context_new();
+    aio_set_event_notifier(iothread->ctx, &iothread->ctx->notifier,
+                           iothread_notify, iothread_notify_flush);
+
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_max_ns,
+                        iothread_set_poll_max_ns,
+                        NULL, NULL, NULL);
+
+    iothread->start_bh = qemu_bh_new(iothread_start_bh, iothread);
+    qemu_bh_schedule(iothread->start_bh);
+}
+
+static void iothread_instance_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->start_bh) {
+        qemu_bh_delete(iothread->start_bh);
+    } else {
+        iothread->stopping = true;
+        aio_notify(iothread->ctx);
+        qemu_thread_join(&iothread->thread);
+    }
+    qemu_cond_destroy(&iothread->init_done_cond);
+    qemu_mutex_destroy(&iothread->init_done_lock);
+    aio_context_unref(iothread->ctx);
+}
+
+static const TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
+    .instance_finalize = iothread_instance_finalize,
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+    Object *child;
+
+    child = object_resolve_path_component(container, id);
+    if (!child) {
+        return NULL;
+    }
+    return (IOThread *)object_dynamic_cast(child, TYPE_IOTHREAD);
+}
+
+char *iothread_get_id(IOThread *iothread)
+{
+    char *path = object_get_canonical_path(OBJECT(iothread));
+    char *id = g_strdup(strrchr(path, '/') + 1);
+
+    g_free(path);
+    return id;
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+static int query_one_iothread(Object *object, void *opaque)
+{
+    IOThreadInfoList ***prev = opaque;
+    IOThreadInfoList *elem;
+    IOThreadInfo *info;
+    IOThread *iothread;
+    int64_t wall_ns, idle_ns;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    /* The monitor only runs after -daemonize */
+    iothread_start(iothread);
+
+    wall_ns = get_clock() - iothread->start_time;
+    idle_ns = MIN(iothread->ctx->idle_ns, wall_ns);
+
+    info = g_new0(IOThreadInfo, 1);
+    info->id = iothread_get_id(iothread);
+    info->thread_id = iothread->thread_id;
+    info->busy_ns = wall_ns - idle_ns;
+    info->idle_ns = idle_ns;
+
+    elem = g_new0(IOThreadInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadInfoList *qmp_query_iothreads(Error **errp)
+{
+    IOThreadInfoList *head = NULL;
+    IOThreadInfoList **prev = &head;
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+
+    object_child_foreach(container, query_one_iothread, &prev);
+    return head;
+}
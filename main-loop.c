@@ -503,3 +503,9 @@ void qemu_aio_set_event_notifier(EventNotifier *notifier,
 {
     aio_set_event_notifier(qemu_aio_context, notifier, io_read, io_flush);
 }
+
+void qemu_aio_set_event_notifier_poll(EventNotifier *notifier,
+                                      AioPollEventNotifierHandler *io_poll)
+{
+    aio_set_event_notifier_poll(qemu_aio_context, notifier, io_poll);
+}
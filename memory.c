@@ -1201,6 +1201,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
 }
 
 
+uint64_t memory_region_test_and_clear_dirty_bitmap(MemoryRegion *mr,
+                                                   hwaddr addr, hwaddr size,
+                                                   unsigned client,
+                                                   unsigned long *dest)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_sync_dirty_bitmap(dest, mr->ram_addr + addr,
+                                                 size, 1 << client);
+}
+
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      unsigned long *bitmap, hwaddr pages)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr, pages);
+}
+
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
     AddressSpace *as;
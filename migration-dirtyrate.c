@@ -0,0 +1,251 @@
+/*
+ * Guest dirty page rate estimation and migration convergence prediction
+ *
+ * The dirty rate is estimated by checksumming a random sample of the pages
+ * of every RAM block twice, some time apart, and counting how many of them
+ * changed.  This needs neither dirty logging nor a migration in progress,
+ * so it can be run against production guests to decide whether and how
+ * they can be migrated.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qerror.h"
+#include "migration/migration.h"
+#include "exec/cpu-all.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+/* Pages sampled per GiB of guest RAM, and at least this many per block */
+#define DIRTYRATE_SAMPLE_PAGES_PER_GB   512
+#define DIRTYRATE_MIN_SAMPLE_PAGES      16
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    uint64_t length;
+    int nr_samples;
+    ram_addr_t *offsets;
+    uint32_t *crcs;
+    int64_t changed;
+} DirtyRateBlock;
+
+typedef struct DirtyRateState {
+    int status;
+    int64_t start_time;
+    int64_t calc_time;
+    int nr_blocks;
+    DirtyRateBlock *blocks;
+    QemuThread thread;
+    bool thread_created;
+} DirtyRateState;
+
+/*
+ * The measuring thread owns everything but @status until it sets it to
+ * DIRTY_RATE_STATUS_MEASURED; the monitor only looks at the rest after
+ * that and only starts a new measurement once the previous one is over.
+ */
+static DirtyRateState dirty_rate = {
+    .status = DIRTY_RATE_STATUS_UNSTARTED,
+};
+
+static uint32_t dirty_rate_page_crc(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32(0, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+static void dirty_rate_free_blocks(void)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        g_free(dirty_rate.blocks[i].offsets);
+        g_free(dirty_rate.blocks[i].crcs);
+    }
+    g_free(dirty_rate.blocks);
+    dirty_rate.blocks = NULL;
+    dirty_rate.nr_blocks = 0;
+}
+
+static void dirty_rate_sample(void)
+{
+    RAMBlock *block;
+    int i, n = 0;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    dirty_rate.blocks = g_new0(DirtyRateBlock, n);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        DirtyRateBlock *b = &dirty_rate.blocks[dirty_rate.nr_blocks++];
+        int64_t pages = block->length >> TARGET_PAGE_BITS;
+
+        pstrcpy(b->idstr, sizeof(b->idstr), block->idstr);
+        b->length = block->length;
+        b->nr_samples = (block->length * DIRTYRATE_SAMPLE_PAGES_PER_GB) >> 30;
+        b->nr_samples = MAX(b->nr_samples, DIRTYRATE_MIN_SAMPLE_PAGES);
+        b->nr_samples = MIN(b->nr_samples, pages);
+        b->offsets = g_new(ram_addr_t, b->nr_samples);
+        b->crcs = g_new(uint32_t, b->nr_samples);
+
+        for (i = 0; i < b->nr_samples; i++) {
+            b->offsets[i] = (ram_addr_t)g_random_int_range(0, pages)
+                            << TARGET_PAGE_BITS;
+            b->crcs[i] = dirty_rate_page_crc(block, b->offsets[i]);
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+}
+
+static void dirty_rate_compare(void)
+{
+    RAMBlock *block;
+    int i, j;
+
+    qemu_mutex_lock_ramlist();
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+
+        /* The block may have been unplugged or resized in the meantime */
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strcmp(block->idstr, b->idstr)) {
+                break;
+            }
+        }
+        if (!block || block->length != b->length) {
+            b->nr_samples = 0;
+            continue;
+        }
+
+        for (j = 0; j < b->nr_samples; j++) {
+            if (dirty_rate_page_crc(block, b->offsets[j]) != b->crcs[j]) {
+                b->changed++;
+            }
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    int64_t start = qemu_get_clock_ms(rt_clock);
+    int64_t elapsed;
+
+    dirty_rate_sample();
+    g_usleep(dirty_rate.calc_time * 1000 * 1000);
+    dirty_rate_compare();
+
+    /* Hashing the sample may have stretched the period a little */
+    elapsed = qemu_get_clock_ms(rt_clock) - start;
+    dirty_rate.calc_time = MAX(elapsed / 1000, dirty_rate.calc_time);
+
+    trace_dirty_rate_measured(dirty_rate.nr_blocks, elapsed);
+    atomic_mb_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURED);
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    if (atomic_mb_read(&dirty_rate.status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "a value between 1 and 60");
+        return;
+    }
+
+    /* The previous measurement is over, reap its thread */
+    if (dirty_rate.thread_created) {
+        qemu_thread_join(&dirty_rate.thread);
+        dirty_rate.thread_created = false;
+    }
+
+    dirty_rate_free_blocks();
+    dirty_rate.start_time = time(NULL);
+    dirty_rate.calc_time = calc_time;
+    atomic_mb_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&dirty_rate.thread, dirty_rate_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    dirty_rate.thread_created = true;
+}
+
+/*
+ * A sampled page counts once however often it was written, which is what
+ * matters for migration: each round sends a dirty page only once.
+ */
+static uint64_t dirty_rate_of_block(DirtyRateBlock *b)
+{
+    if (!b->nr_samples) {
+        return 0;
+    }
+    return b->length * b->changed / b->nr_samples / dirty_rate.calc_time;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    RAMBlockDirtyRateList *head = NULL, **tail = &head;
+    MigrationState *s = migrate_get_current();
+    uint64_t total = 0, ram_size = 0, bandwidth;
+    int i;
+
+    info->status = atomic_mb_read(&dirty_rate.status);
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+        RAMBlockDirtyRateList *entry = g_malloc0(sizeof(*entry));
+        uint64_t rate = dirty_rate_of_block(b);
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->size = b->length;
+        entry->value->sample_pages = b->nr_samples;
+        entry->value->dirty_rate = rate >> 20;
+        *tail = entry;
+        tail = &entry->next;
+
+        total += rate;
+        ram_size += b->length;
+    }
+
+    info->has_start_time = true;
+    info->start_time = dirty_rate.start_time;
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate.calc_time;
+    info->has_dirty_rate = true;
+    info->dirty_rate = total >> 20;
+    info->has_blocks = true;
+    info->blocks = head;
+
+    if (migration_is_active(s) && s->mbps > 0) {
+        bandwidth = s->mbps * 1000 * 1000 / 8;
+    } else {
+        bandwidth = s->bandwidth_limit;
+    }
+    info->has_rounds_to_converge = true;
+    info->rounds_to_converge =
+        migration_predict_rounds(total, bandwidth, ram_size, ram_size,
+                                 migrate_max_downtime() / 1000000,
+                                 &info->expected_downtime);
+    info->has_expected_downtime = info->expected_downtime >= 0;
+
+    return info;
+}
@@ -0,0 +1,204 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * The file starts with a small header, followed by a region where every
+ * RAM page has a fixed, page-aligned place (see ram_file_save_setup() in
+ * arch_init.c), followed by the usual migration stream with everything
+ * but the RAM pages.  RAM is written and read back by several threads,
+ * with O_DIRECT when possible, so saving and restoring a guest go about
+ * as fast as the disk does.  With lazy=on the destination maps RAM from
+ * the file instead and resumes the guest before reading any of it.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "qemu/main-loop.h"
+#include "exec/cpu-all.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#define MIGRATION_FILE_MAGIC    0x514d4652
+#define MIGRATION_FILE_VERSION  1
+/* the RAM region and the stream start on such a boundary */
+#define MIGRATION_FILE_ALIGN    (1 << 20)
+/* writer or reader threads when the URI does not say */
+#define MIGRATION_FILE_THREADS  4
+
+typedef struct MigrationFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ram_base;
+    uint64_t stream_offset;
+} QEMU_PACKED MigrationFileHeader;
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    MigrationFileHeader hdr;
+    int64_t stream_offset;
+    int fd, ram_fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return;
+    }
+    /* a second file description, so that O_DIRECT stays off the stream */
+    ram_fd = qemu_open(path, O_WRONLY);
+    if (ram_fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        close(fd);
+        return;
+    }
+
+    stream_offset = ROUND_UP(MIGRATION_FILE_ALIGN + last_ram_offset(),
+                             MIGRATION_FILE_ALIGN);
+    stl_be_p(&hdr.magic, MIGRATION_FILE_MAGIC);
+    stl_be_p(&hdr.version, MIGRATION_FILE_VERSION);
+    stq_be_p(&hdr.ram_base, MIGRATION_FILE_ALIGN);
+    stq_be_p(&hdr.stream_offset, stream_offset);
+
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        lseek(fd, stream_offset, SEEK_SET) != stream_offset) {
+        error_setg_errno(errp, errno, "failed to write %s", path);
+        close(ram_fd);
+        close(fd);
+        return;
+    }
+    DPRINTF("RAM at %d, stream at %" PRId64 "\n",
+            MIGRATION_FILE_ALIGN, stream_offset);
+
+    s->ram_fd = ram_fd;
+    s->ram_base = MIGRATION_FILE_ALIGN;
+    s->ram_file_threads = s->nr_channels > 1 ? s->nr_channels :
+                                               MIGRATION_FILE_THREADS;
+    /* the channels are threads writing to the file, not connections */
+    s->nr_channels = 1;
+    s->file = qemu_fdopen(fd, "wb");
+
+    migrate_fd_connect(s);
+}
+
+/*
+ * Nothing else checks that the file made it to the disk, and the source
+ * is usually gone by the time anybody reads it, so do not report the
+ * migration as completed before it has.  The RAM writers have already
+ * been joined by ram_save_complete().
+ */
+int file_migration_sync(MigrationState *s)
+{
+    int ret;
+
+    qemu_fflush(s->file);
+    ret = qemu_file_get_error(s->file);
+    if (ret < 0) {
+        return ret;
+    }
+    if (qemu_fdatasync(s->ram_fd) < 0 ||
+        qemu_fdatasync(qemu_get_fd(s->file)) < 0) {
+        ret = -errno;
+        fprintf(stderr, "migration: failed to sync the migration file: %s\n",
+                strerror(errno));
+        return ret;
+    }
+    return 0;
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+static void file_open_incoming(const char *path, int threads, bool lazy,
+                               Error **errp)
+{
+    MigrationFileHeader hdr;
+    int64_t stream_offset;
+    int fd, ram_fd;
+    QEMUFile *f;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        ldl_be_p(&hdr.magic) != MIGRATION_FILE_MAGIC) {
+        error_setg(errp, "%s is not a migration file", path);
+        close(fd);
+        return;
+    }
+    if (ldl_be_p(&hdr.version) != MIGRATION_FILE_VERSION) {
+        error_setg(errp, "unsupported migration file version %d",
+                   ldl_be_p(&hdr.version));
+        close(fd);
+        return;
+    }
+
+    /* the stream says where each RAM block is, the base is informative */
+    stream_offset = ldq_be_p(&hdr.stream_offset);
+    if (lseek(fd, stream_offset, SEEK_SET) != stream_offset) {
+        error_setg_errno(errp, errno, "failed to seek in %s", path);
+        close(fd);
+        return;
+    }
+
+    ram_fd = qemu_open(path, O_RDONLY);
+    if (ram_fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        close(fd);
+        return;
+    }
+    ram_file_incoming_start(ram_fd, threads > 1 ? threads :
+                                                  MIGRATION_FILE_THREADS,
+                            lazy);
+
+    f = qemu_fdopen(fd, "rb");
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+}
+
+/*
+ * The URI is the path, optionally followed by comma-separated options.
+ * Only trailing elements that are options are taken as such, so a path
+ * may contain commas as long as what follows the last one is no option.
+ */
+void file_start_incoming_migration(const char *uri, int threads,
+                                   Error **errp)
+{
+    char *path = g_strdup(uri);
+    int lazy = -1;
+    char *opt;
+
+    /* walking backwards, the first lazy= seen is the one that counts */
+    while ((opt = strrchr(path, ',')) != NULL) {
+        if (strcmp(opt, ",lazy=on") && strcmp(opt, ",lazy=off")) {
+            break;
+        }
+        if (lazy < 0) {
+            lazy = !strcmp(opt, ",lazy=on");
+        }
+        *opt = 0;
+    }
+    file_open_incoming(path, threads, lazy > 0, errp);
+    g_free(path);
+}
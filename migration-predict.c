@@ -0,0 +1,90 @@
+/*
+ * Migration convergence prediction and auto-converge throttling
+ *
+ * These are pure functions of the measured dirty rate and bandwidth, kept
+ * apart from the target-specific sampling code so that they can be unit
+ * tested.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+
+/* Past this many rounds a migration is as good as not converging */
+#define PREDICT_MAX_ROUNDS              1000
+
+/*
+ * Auto-converge aims at a dirty rate of at most half the bandwidth, so
+ * that every round takes at most half as long as the one before.
+ */
+#define THROTTLE_TARGET_RATIO           0.5
+#define THROTTLE_MAX_PCT                95
+
+/*
+ * Pre-copy sends @remaining bytes in the first round; every later round
+ * sends what the guest dirtied during the previous one, so with a dirty
+ * rate of @dirty_rate and a bandwidth of @bandwidth (both in bytes per
+ * second) each round is @dirty_rate / @bandwidth times as long as the one
+ * before, until no more than @ram_size is dirty.  Migration completes once
+ * what is left can be sent within @max_downtime milliseconds.
+ *
+ * Returns the number of rounds before that happens and stores the
+ * expected downtime in milliseconds in @downtime.  If the rounds do not
+ * get shorter, returns -1 and stores the downtime that stopping after the
+ * next round would cause.
+ */
+int64_t migration_predict_rounds(uint64_t dirty_rate, uint64_t bandwidth,
+                                 uint64_t remaining, uint64_t ram_size,
+                                 int64_t max_downtime, int64_t *downtime)
+{
+    double left = remaining;
+    int64_t rounds = 0;
+
+    if (!bandwidth) {
+        *downtime = -1;
+        return -1;
+    }
+
+    while (left * 1000 / bandwidth > max_downtime) {
+        double next = MIN(left * dirty_rate / bandwidth, (double)ram_size);
+
+        if (next >= left || rounds == PREDICT_MAX_ROUNDS) {
+            *downtime = next * 1000 / bandwidth;
+            return -1;
+        }
+        left = next;
+        rounds++;
+    }
+
+    *downtime = left * 1000 / bandwidth;
+    return rounds;
+}
+
+/*
+ * The share of vCPU time to take away from the guest so that its dirty
+ * rate drops to THROTTLE_TARGET_RATIO of the bandwidth.  @dirty_rate was
+ * measured while @cur_pct percent of the time was already taken away, and
+ * is assumed to scale with the time the guest actually runs.
+ */
+int migration_throttle_percentage(uint64_t dirty_rate, uint64_t bandwidth,
+                                  int cur_pct)
+{
+    double unthrottled, pct;
+
+    if (!dirty_rate) {
+        return 0;
+    }
+    if (!bandwidth) {
+        return cur_pct;
+    }
+
+    unthrottled = (double)dirty_rate * 100 / (100 - cur_pct);
+    pct = 100 * (1 - THROTTLE_TARGET_RATIO * bandwidth / unthrottled);
+
+    return MIN(MAX(pct, 0), THROTTLE_MAX_PCT);
+}
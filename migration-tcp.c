@@ -46,6 +46,7 @@ static void tcp_wait_for_connect(int fd, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    migrate_set_channel_connect(s, inet_connect, host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -60,8 +61,6 @@ static void tcp_accept_incoming_migration(void *opaque)
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
@@ -73,14 +72,16 @@ static void tcp_accept_incoming_migration(void *opaque)
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
+        closesocket(c);
         goto out;
     }
 
-    process_incoming_migration(f);
+    /* keeps listening until the source has made its connections */
+    migration_incoming_add_channel(f);
     return;
 
 out:
-    closesocket(c);
+    migration_incoming_stop_listening();
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -94,4 +95,5 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp)
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
+    migration_incoming_set_listen_fd(s);
 }
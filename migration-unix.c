@@ -46,6 +46,7 @@ static void unix_wait_for_connect(int fd, void *opaque)
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp)
 {
+    migrate_set_channel_connect(s, unix_connect, path);
     unix_nonblocking_connect(path, unix_wait_for_connect, s, errp);
 }
 
@@ -60,8 +61,6 @@ static void unix_accept_incoming_migration(void *opaque)
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && errno == EINTR);
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
 
     DPRINTF("accepted migration\n");
 
@@ -73,14 +72,16 @@ static void unix_accept_incoming_migration(void *opaque)
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
+        close(c);
         goto out;
     }
 
-    process_incoming_migration(f);
+    /* keeps listening until the source has made its connections */
+    migration_incoming_add_channel(f);
     return;
 
 out:
-    close(c);
+    migration_incoming_stop_listening();
 }
 
 void unix_start_incoming_migration(const char *path, Error **errp)
@@ -94,4 +95,5 @@ void unix_start_incoming_migration(const char *path, Error **errp)
 
     qemu_set_fd_handler2(s, NULL, unix_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
+    migration_incoming_set_listen_fd(s);
 }
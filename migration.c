@@ -21,6 +21,7 @@
 #include "block/block.h"
 #include "qemu/sockets.h"
 #include "migration/block.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -42,6 +43,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -54,6 +56,17 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression thread count */
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+/* Default decompression thread count, usually decompression is at
+ * least 4 times as fast as compression.*/
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+/*0: means nocompress, 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+/* Dirty bitmap syncs before a migration that does not converge switches
+ * to post-copy */
+#define DEFAULT_MIGRATE_X_POSTCOPY_ROUNDS 5
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -68,14 +81,91 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .ram_fd = -1,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS] =
+                DEFAULT_MIGRATE_X_POSTCOPY_ROUNDS,
     };
 
     return &current_migration;
 }
 
-void qemu_start_incoming_migration(const char *uri, Error **errp)
+/*
+ * Take the channels=N option out of the comma-separated options of a
+ * migration URI; *base gets the URI with the remaining options, in order,
+ * for the transport to parse.
+ *
+ * Returns: the number of connections to use, -1 on error
+ */
+static int migrate_parse_channels(const char *uri, char **base, Error **errp)
+{
+    char **opts = g_strsplit(uri, ",", 0);
+    GString *rest = g_string_new(opts[0]);
+    long channels = 1;
+    int i;
+
+    *base = NULL;
+    for (i = 1; opts[0] && opts[i]; i++) {
+        const char *val;
+        char *end;
+
+        if (!strstart(opts[i], "channels=", &val)) {
+            g_string_append_c(rest, ',');
+            g_string_append(rest, opts[i]);
+            continue;
+        }
+        channels = strtol(val, &end, 10);
+        if (!*val || *end || channels < 1 ||
+            channels > MIGRATION_CHANNELS_MAX) {
+            error_setg(errp, "channels must be between 1 and %d",
+                       MIGRATION_CHANNELS_MAX);
+            goto fail;
+        }
+    }
+    if (channels > 1 && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL) && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "only tcp:, unix: and file: migration can use "
+                   "channels");
+        goto fail;
+    }
+
+    g_strfreev(opts);
+    *base = g_string_free(rest, false);
+    return channels;
+
+fail:
+    g_strfreev(opts);
+    g_string_free(rest, true);
+    return -1;
+}
+
+/* channels=N on the destination is the most connections it accepts; the
+ * source says on the main stream how many it really uses.
+ */
+static int incoming_nr_channels;
+static int incoming_nr_expected;
+static int incoming_nr_accepted;
+static QEMUFile *incoming_channels[MIGRATION_CHANNELS_MAX];
+static int incoming_listen_fd = -1;
+static Coroutine *incoming_channels_co;
+static QEMUTimer *incoming_channels_timer;
+
+void qemu_start_incoming_migration(const char *base_uri, Error **errp)
 {
     const char *p;
+    char *uri;
+
+    incoming_nr_channels = migrate_parse_channels(base_uri, &uri, errp);
+    if (incoming_nr_channels < 0) {
+        return;
+    }
+    incoming_nr_expected = 0;
+    incoming_nr_accepted = 0;
 
     if (strstart(uri, "tcp:", &p))
         tcp_start_incoming_migration(p, errp);
@@ -90,10 +180,107 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, incoming_nr_channels, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
+    g_free(uri);
+}
+
+/*
+ * The tcp: and unix: transports register their listening socket here, so
+ * that it can be closed once the source has made all its connections.
+ */
+void migration_incoming_set_listen_fd(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+void migration_incoming_stop_listening(void)
+{
+    if (incoming_listen_fd < 0) {
+        return;
+    }
+    qemu_set_fd_handler2(incoming_listen_fd, NULL, NULL, NULL, NULL);
+    closesocket(incoming_listen_fd);
+    incoming_listen_fd = -1;
+}
+
+/*
+ * The tcp: and unix: transports hand every connection they accept to this
+ * function.  The main one comes first and starts the migration, the extra
+ * channels follow in order.
+ */
+void migration_incoming_add_channel(QEMUFile *f)
+{
+    if (incoming_nr_accepted == incoming_nr_channels ||
+        (incoming_nr_expected &&
+         incoming_nr_accepted == incoming_nr_expected)) {
+        fprintf(stderr, "unexpected migration connection, closing it\n");
+        qemu_fclose(f);
+        return;
+    }
+
+    incoming_channels[incoming_nr_accepted++] = f;
+    if (incoming_nr_accepted == 1) {
+        if (incoming_nr_channels == 1) {
+            migration_incoming_stop_listening();
+        }
+        process_incoming_migration(f);
+    } else if (incoming_channels_co &&
+               incoming_nr_accepted == incoming_nr_expected) {
+        qemu_coroutine_enter(incoming_channels_co, NULL);
+    }
+}
+
+static void migration_incoming_channels_timeout(void *opaque)
+{
+    if (incoming_channels_co) {
+        qemu_coroutine_enter(incoming_channels_co, NULL);
+    }
+}
+
+/*
+ * Called from ram_load() when the source announces that it spreads RAM
+ * over @count connections.  Waits for the extra ones and starts loading
+ * from them.
+ *
+ * Returns: 0 on success, -EINVAL if the destination does not accept that
+ *          many connections, -ETIMEDOUT if they do not arrive in time
+ */
+int migration_incoming_wait_channels(int count)
+{
+    if (count < 2 || count > incoming_nr_channels) {
+        fprintf(stderr, "source uses %d migration channels, the destination "
+                "accepts at most %d\n", count, MAX(incoming_nr_channels, 1));
+        return -EINVAL;
+    }
+    incoming_nr_expected = count;
+
+    if (incoming_nr_accepted < count) {
+        incoming_channels_co = qemu_coroutine_self();
+        incoming_channels_timer =
+            qemu_new_timer_ms(rt_clock, migration_incoming_channels_timeout,
+                              NULL);
+        qemu_mod_timer(incoming_channels_timer, qemu_get_clock_ms(rt_clock) +
+                       MIGRATION_CHANNELS_TIMEOUT_MS);
+        qemu_coroutine_yield();
+        qemu_del_timer(incoming_channels_timer);
+        qemu_free_timer(incoming_channels_timer);
+        incoming_channels_timer = NULL;
+        incoming_channels_co = NULL;
+    }
+    migration_incoming_stop_listening();
+
+    if (incoming_nr_accepted < count) {
+        fprintf(stderr, "timed out waiting for migration channels, %d of %d "
+                "connected\n", incoming_nr_accepted, count);
+        return -ETIMEDOUT;
+    }
+    ram_channels_incoming_start(incoming_channels + 1, count - 1);
+    return 0;
 }
 
 static void process_incoming_migration_co(void *opaque)
@@ -102,8 +289,16 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    /* In post-copy the listener thread keeps reading the rest of RAM */
+    if (!postcopy_ram_incoming_active()) {
+        qemu_fclose(f);
+    }
+    migrate_decompress_threads_join();
+    migration_incoming_stop_listening();
+    ram_channels_incoming_join();
+    ram_file_incoming_close();
     if (ret < 0) {
+        ram_file_prefetch_stop();
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
     }
@@ -166,6 +361,23 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->x_postcopy_rounds =
+            s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS];
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -176,6 +388,21 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
+        info->xbzrle_cache->evictions = xbzrle_mig_pages_cache_evictions();
+    }
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->busy = compress_mig_busy();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_rate();
     }
 }
 
@@ -194,8 +421,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_total_time = false;
         break;
     case MIG_STATE_ACTIVE:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->state == MIG_STATE_ACTIVE ?
+                                "active" : "postcopy-active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -215,6 +444,27 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
+        info->ram->has_dirty_sync_count = true;
+        info->ram->dirty_sync_count = ram_dirty_sync_count();
+        info->ram->has_dirty_sync_time = true;
+        info->ram->dirty_sync_time = ram_dirty_sync_time();
+
+        if (s->state == MIG_STATE_ACTIVE && s->mbps > 0) {
+            int64_t downtime;
+
+            info->has_rounds_to_converge = true;
+            info->rounds_to_converge =
+                migration_predict_rounds(s->dirty_bytes_rate,
+                                         s->mbps * 1000 * 1000 / 8,
+                                         ram_bytes_remaining(),
+                                         ram_bytes_total(),
+                                         migrate_max_downtime() / 1000000,
+                                         &downtime);
+        }
+        if (ram_throttle_percentage()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = ram_throttle_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -225,9 +475,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -248,6 +500,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
+        info->ram->has_dirty_sync_count = true;
+        info->ram->dirty_sync_count = ram_dirty_sync_count();
+        info->ram->has_dirty_sync_time = true;
+        info->ram->dirty_sync_time = ram_dirty_sync_time();
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -268,7 +524,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -278,8 +535,134 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_x_postcopy_rounds,
+                                int64_t x_postcopy_rounds, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+            (compress_threads < 1 || compress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+            (decompress_threads < 1 || decompress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_postcopy_rounds &&
+            (x_postcopy_rounds < 1 || x_postcopy_rounds > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "x_postcopy_rounds",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                                                    decompress_threads;
+    }
+    if (has_x_postcopy_rounds) {
+        s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS] =
+                                                    x_postcopy_rounds;
+    }
+}
+
 /* shared migration helpers */
 
+static void migrate_close_channels(MigrationState *s)
+{
+    int i;
+
+    for (i = 1; i < MIGRATION_CHANNELS_MAX; i++) {
+        if (s->channel_files[i]) {
+            qemu_fclose(s->channel_files[i]);
+            s->channel_files[i] = NULL;
+        }
+    }
+    s->nr_channels = 0;
+}
+
+/*
+ * Open the extra connections of a multi-channel migration.  They are made
+ * one after the other once the main one is up, which is the order the
+ * destination accepts them in.  This runs in the migration thread, the
+ * connects block.
+ */
+static int migrate_connect_channels(MigrationState *s)
+{
+    Error *local_err = NULL;
+    int i, fd;
+
+    for (i = 1; i < s->nr_channels; i++) {
+        if (s->state != MIG_STATE_SETUP) {
+            /* cancelled meanwhile */
+            break;
+        }
+        fd = s->channel_connect(s->channel_dest, &local_err);
+        if (fd < 0) {
+            fprintf(stderr, "migration: could not open channel %d: %s\n", i,
+                    error_get_pretty(local_err));
+            error_free(local_err);
+            break;
+        }
+        s->channel_files[i] = qemu_fopen_socket(fd, "wb");
+        qemu_put_be32(s->channel_files[i], MIGRATION_CHANNEL_MAGIC);
+        qemu_put_be32(s->channel_files[i], i);
+    }
+    g_free(s->channel_dest);
+    s->channel_dest = NULL;
+
+    if (i < s->nr_channels) {
+        migrate_close_channels(s);
+        return -1;
+    }
+    return 0;
+}
+
+static void migrate_enable_zerocopy(MigrationState *s)
+{
+    int i, ret;
+
+    ret = qemu_file_enable_zerocopy(s->file);
+    for (i = 1; i < s->nr_channels; i++) {
+        int err = qemu_file_enable_zerocopy(s->channel_files[i]);
+
+        ret = ret ? ret : err;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "migration: zero-copy send not available (%s), "
+                "copying instead\n", strerror(-ret));
+    }
+}
+
+void migrate_set_channel_connect(MigrationState *s,
+                                 MigrationConnectFunc *connect,
+                                 const char *dest)
+{
+    s->channel_connect = connect;
+    g_free(s->channel_dest);
+    s->channel_dest = g_strdup(dest);
+}
+
 static void migrate_fd_cleanup(void *opaque)
 {
     MigrationState *s = opaque;
@@ -302,6 +685,11 @@ static void migrate_fd_cleanup(void *opaque)
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
     }
+    migrate_close_channels(s);
+    if (s->ram_fd >= 0) {
+        close(s->ram_fd);
+        s->ram_fd = -1;
+    }
 
     notifier_list_notify(&migration_state_notifiers, s);
 }
@@ -317,6 +705,12 @@ void migrate_fd_error(MigrationState *s)
 {
     DPRINTF("setting error state\n");
     assert(s->file == NULL);
+    g_free(s->channel_dest);
+    s->channel_dest = NULL;
+    if (s->ram_fd >= 0) {
+        close(s->ram_fd);
+        s->ram_fd = -1;
+    }
     s->state = MIG_STATE_ERROR;
     trace_migrate_set_state(MIG_STATE_ERROR);
     notifier_list_notify(&migration_state_notifiers, s);
@@ -355,23 +749,37 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
+bool migration_is_active(MigrationState *s)
+{
+    return s->state == MIG_STATE_ACTIVE;
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    memcpy(s->parameters, parameters, sizeof(parameters));
 
     s->bandwidth_limit = bandwidth_limit;
+    s->ram_fd = -1;
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
 
@@ -391,7 +799,7 @@ void migrate_del_blocker(Error *reason)
     migration_blockers = g_slist_remove(migration_blockers, reason);
 }
 
-void qmp_migrate(const char *uri, bool has_blk, bool blk,
+void qmp_migrate(const char *base_uri, bool has_blk, bool blk,
                  bool has_inc, bool inc, bool has_detach, bool detach,
                  Error **errp)
 {
@@ -399,11 +807,14 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     MigrationParams params;
     const char *p;
+    char *uri;
+    int channels;
 
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -417,7 +828,18 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    channels = migrate_parse_channels(base_uri, &uri, errp);
+    if (channels < 0) {
+        return;
+    }
+    if (channels > 1 && migrate_postcopy_ram()) {
+        error_setg(errp, "postcopy-ram cannot be used with several channels");
+        g_free(uri);
+        return;
+    }
+
     s = migrate_init(&params);
+    s->nr_channels = channels;
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -432,11 +854,15 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
+        g_free(uri);
         return;
     }
+    g_free(uri);
 
     if (local_err) {
         migrate_fd_error(s);
@@ -539,6 +965,187 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
+int migrate_postcopy_rounds(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS];
+}
+
+/* post-copy support */
+
+/*
+ * Reads the page requests the destination sends while it runs the guest
+ * and queues them for the migration thread.
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->rp_file;
+    char idstr[256];
+
+    while (!qemu_file_get_error(rp)) {
+        uint8_t type = qemu_get_byte(rp);
+        uint64_t start;
+        uint32_t len;
+        int idlen;
+
+        if (qemu_file_get_error(rp)) {
+            break;
+        }
+
+        switch (type) {
+        case MIG_RP_MSG_REQ_PAGES:
+            idlen = qemu_get_byte(rp);
+            qemu_get_buffer(rp, (uint8_t *)idstr, idlen);
+            idstr[idlen] = 0;
+            start = qemu_get_be64(rp);
+            len = qemu_get_be32(rp);
+            if (qemu_file_get_error(rp)) {
+                break;
+            }
+            DPRINTF("page request %s:%" PRIx64 " +%x\n", idstr, start, len);
+            if (ram_save_queue_pages(idstr, start, len) < 0) {
+                goto out;
+            }
+            break;
+        case MIG_RP_MSG_SHUT:
+            s->rp_status = qemu_get_be32(rp);
+            DPRINTF("return path shut, status %d\n", s->rp_status);
+            goto out;
+        default:
+            fprintf(stderr, "Invalid return path message type %d\n", type);
+            goto out;
+        }
+    }
+
+out:
+    atomic_mb_set(&s->rp_done, true);
+    return NULL;
+}
+
+/*
+ * Stop the guest and send the device state; from here on the destination
+ * runs the guest and the source can no longer resume it.
+ */
+static int postcopy_start(MigrationState *s, bool *old_vm_running)
+{
+    int ret;
+
+    DPRINTF("switching to post-copy\n");
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret >= 0) {
+        migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+        if (s->state != MIG_STATE_POSTCOPY_ACTIVE) {
+            ret = -ECANCELED;
+        }
+    }
+    if (ret >= 0) {
+        s->rp_status = -1;
+        qemu_thread_create(&s->rp_thread, source_return_path_thread, s,
+                           QEMU_THREAD_JOINABLE);
+        qemu_file_set_rate_limit(s->file, INT_MAX);
+        qemu_savevm_state_complete_postcopy(s->file);
+    }
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
+/* Send the pages left over after the switch until all of RAM is there */
+static void postcopy_send_pages(MigrationState *s)
+{
+    bool joined = false;
+
+    while (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        int ret;
+
+        if (qemu_file_get_error(s->file) || atomic_mb_read(&s->rp_done)) {
+            /* the destination went away before it had all of RAM */
+            migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_ERROR);
+            break;
+        }
+
+        ret = ram_postcopy_send_pages(s->file);
+        if (ret == 0 && !qemu_file_get_error(s->file)) {
+            /* wait for the destination to confirm it loaded everything */
+            qemu_thread_join(&s->rp_thread);
+            joined = true;
+            migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                              s->rp_status == 0 ? MIG_STATE_COMPLETED
+                                                : MIG_STATE_ERROR);
+        }
+    }
+
+    if (!joined) {
+#ifndef _WIN32
+        /* kick the return path thread out of its blocking read */
+        shutdown(qemu_get_fd(s->rp_file), SHUT_RDWR);
+#endif
+        qemu_thread_join(&s->rp_thread);
+    }
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -550,6 +1157,22 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool postcopy = false;
+
+    if (migrate_postcopy_ram()) {
+        s->rp_file = qemu_file_get_return_path(s->file);
+        if (!s->rp_file) {
+            fprintf(stderr, "Post-copy needs a migration transport "
+                    "with a return path\n");
+            migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ERROR);
+        }
+    }
+
+    if (migrate_connect_channels(s) < 0) {
+        migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ERROR);
+    } else if (migrate_use_zero_copy_send()) {
+        migrate_enable_zerocopy(s);
+    }
 
     DPRINTF("beginning savevm\n");
     qemu_savevm_state_begin(s->file, &s->params);
@@ -567,7 +1190,19 @@ static void *migration_thread(void *opaque)
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size &&
+                s->rp_file &&
+                ram_dirty_sync_count() >= migrate_postcopy_rounds()) {
+                start_time = qemu_get_clock_ms(rt_clock);
+                if (postcopy_start(s, &old_vm_running) < 0) {
+                    migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+                    break;
+                }
+                postcopy = true;
+                s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+                postcopy_send_pages(s);
+                break;
+            } else if (pending_size && pending_size >= max_size) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 int ret;
@@ -591,6 +1226,11 @@ static void *migration_thread(void *opaque)
                 }
 
                 if (!qemu_file_get_error(s->file)) {
+                    if (s->ram_fd >= 0 && file_migration_sync(s) < 0) {
+                        migrate_set_state(s, MIG_STATE_ACTIVE,
+                                          MIG_STATE_ERROR);
+                        break;
+                    }
                     migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_COMPLETED);
                     break;
                 }
@@ -631,13 +1271,22 @@ static void *migration_thread(void *opaque)
     }
 
     qemu_mutex_lock_iothread();
+    if (s->rp_file) {
+        qemu_fclose(s->rp_file);
+        s->rp_file = NULL;
+    }
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_get_clock_ms(rt_clock);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (postcopy) {
+            ram_postcopy_send_end();
+        } else {
+            s->downtime = end_time - start_time;
+        }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        /* Once post-copy started the destination owns the guest */
+        if (old_vm_running && !postcopy) {
             vm_start();
         }
     }
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is based on a hash of the page address, each hash value
+ * selects a small set of pages
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,6 +34,9 @@
     do { } while (0)
 #endif
 
+/* Number of pages that can share one hash slot */
+#define PAGE_CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -41,12 +45,19 @@ struct CacheItem {
     uint8_t *it_data;
 };
 
+/*
+ * The cache is set associative: an address hashes to a set of
+ * cache->ways items and may live in any of them.  When the set is full
+ * the least recently used item is replaced.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int ways;
+    int64_t num_sets;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,8 +82,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(PAGE_CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
@@ -101,66 +115,96 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the item to reuse for a new page: a free one, else the LRU one */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
+    return victim;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        return false;
+    }
+    it->it_age = ++cache->max_item_age;
+    return true;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+bool cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 {
-
-    CacheItem *it = NULL;
+    CacheItem *it;
+    bool evicted = false;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        evicted = it->it_data != NULL;
+    }
 
-    /* free old cached data if any */
-    g_free(it->it_data);
-
-    if (!it->it_data) {
+    /* reuse the old buffer if any */
+    if (it->it_data) {
+        memcpy(it->it_data, pdata, cache->page_size);
+    } else {
         cache->num_items++;
+        it->it_data = g_memdup(pdata, cache->page_size);
     }
 
-    it->it_data = g_memdup(pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
+
+    return evicted;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -192,10 +236,9 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            /* if the set is full, keep the MRU pages */
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
                 g_free(old_it->it_data);
             } else {
                 if (!new_it->it_data) {
@@ -213,6 +256,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->ways = new_cache->ways;
+    cache->num_sets = new_cache->num_sets;
 
     g_free(new_cache);
 
@@ -0,0 +1,419 @@
+/*
+ * Post-copy live migration of RAM
+ *
+ * After the switch to post-copy the destination runs the guest while the
+ * source keeps streaming the pages that were still dirty.  Every page the
+ * destination does not have yet is left unmapped and registered with
+ * userfaultfd; a fault on such a page is forwarded to the source as a
+ * page request and resolved atomically once the page arrives.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "exec/cpu-all.h"
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+
+#include <linux/userfaultfd.h>
+
+typedef struct PostcopyIncomingState {
+    int uffd;
+    /* written to by the listener to stop the fault thread */
+    int quit_fd[2];
+    bool active;
+    QEMUFile *from_src;
+    QEMUFile *to_src;
+    /* serialises messages on the return path */
+    QemuMutex rp_mutex;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+} PostcopyIncomingState;
+
+static PostcopyIncomingState incoming = {
+    .uffd = -1,
+    .quit_fd = { -1, -1 },
+};
+
+static int postcopy_open_uffd(void)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                          (__u64)1 << _UFFDIO_UNREGISTER;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd == -1) {
+        error_report("postcopy: userfaultfd not available: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy: UFFDIO_API failed: %s", strerror(errno));
+        close(ufd);
+        return -1;
+    }
+
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("postcopy: missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        close(ufd);
+        return -1;
+    }
+
+    return ufd;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    int ufd;
+
+    /* Faults are resolved one host page at a time */
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("postcopy: host page size %d differs from target "
+                     "page size %d", getpagesize(), TARGET_PAGE_SIZE);
+        return false;
+    }
+
+    ufd = postcopy_open_uffd();
+    if (ufd < 0) {
+        return false;
+    }
+    close(ufd);
+    return true;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    DPRINTF("discard %p +%zx\n", host, length);
+    if (qemu_madvise(host, length, QEMU_MADV_DONTNEED)) {
+        error_report("postcopy: discard of %p +%zx failed: %s",
+                     host, length, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_page(void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uint64_t)(uintptr_t)host;
+    copy_struct.src = (uint64_t)(uintptr_t)from;
+    copy_struct.len = TARGET_PAGE_SIZE;
+    copy_struct.mode = 0;
+
+    if (ioctl(incoming.uffd, UFFDIO_COPY, &copy_struct)) {
+        /* The page may be sent twice if it was requested and scanned */
+        if (errno == EEXIST) {
+            return 0;
+        }
+        error_report("postcopy: UFFDIO_COPY to %p failed: %s",
+                     host, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uint64_t)(uintptr_t)host;
+    zero_struct.range.len = TARGET_PAGE_SIZE;
+    zero_struct.mode = 0;
+
+    if (ioctl(incoming.uffd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        if (errno == EEXIST) {
+            return 0;
+        }
+        error_report("postcopy: UFFDIO_ZEROPAGE at %p failed: %s",
+                     host, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return incoming.active;
+}
+
+static RAMBlock *postcopy_find_block(uint64_t addr, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t host = (uintptr_t)block->host;
+
+        if (addr >= host && addr - host < block->length) {
+            *offset = (addr - host) & TARGET_PAGE_MASK;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void postcopy_request_page(PostcopyIncomingState *mis,
+                                  RAMBlock *block, ram_addr_t offset)
+{
+    size_t len = strlen(block->idstr);
+
+    DPRINTF("request %s:" RAM_ADDR_FMT "\n", block->idstr, offset);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_byte(mis->to_src, MIG_RP_MSG_REQ_PAGES);
+    qemu_put_byte(mis->to_src, len);
+    qemu_put_buffer(mis->to_src, (uint8_t *)block->idstr, len);
+    qemu_put_be64(mis->to_src, offset);
+    qemu_put_be32(mis->to_src, TARGET_PAGE_SIZE);
+    qemu_fflush(mis->to_src);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    PostcopyIncomingState *mis = opaque;
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+
+    pfd[0].fd = mis->uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = mis->quit_fd[0];
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        RAMBlock *block;
+        ram_addr_t offset;
+        ssize_t ret;
+
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("postcopy: fault thread poll failed: %s",
+                         strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(mis->uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("postcopy: failed to read fault: %s",
+                         ret < 0 ? strerror(errno) : "short read");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        block = postcopy_find_block(msg.arg.pagefault.address, &offset);
+        if (!block) {
+            error_report("postcopy: fault on unknown address %" PRIx64,
+                         (uint64_t)msg.arg.pagefault.address);
+            continue;
+        }
+        postcopy_request_page(mis, block, offset);
+    }
+
+    return NULL;
+}
+
+static void postcopy_ram_incoming_cleanup(PostcopyIncomingState *mis)
+{
+    RAMBlock *block;
+
+    if (mis->quit_fd[1] != -1) {
+        ssize_t ret;
+
+        do {
+            ret = write(mis->quit_fd[1], "", 1);
+        } while (ret == -1 && errno == EINTR);
+        qemu_thread_join(&mis->fault_thread);
+        close(mis->quit_fd[0]);
+        close(mis->quit_fd[1]);
+        mis->quit_fd[0] = mis->quit_fd[1] = -1;
+    }
+
+    /* Unregistering wakes up anything still waiting on a missing page */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_range range_struct;
+
+        range_struct.start = (uint64_t)(uintptr_t)block->host;
+        range_struct.len = block->length;
+        if (ioctl(mis->uffd, UFFDIO_UNREGISTER, &range_struct)) {
+            error_report("postcopy: UFFDIO_UNREGISTER of %s failed: %s",
+                         block->idstr, strerror(errno));
+        }
+    }
+    close(mis->uffd);
+    mis->uffd = -1;
+}
+
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    PostcopyIncomingState *mis = opaque;
+    int ret;
+
+    qemu_set_block(qemu_get_fd(mis->from_src));
+    ret = ram_postcopy_incoming_load(mis->from_src);
+    if (ret == 0) {
+        ret = qemu_file_get_error(mis->from_src);
+    }
+
+    postcopy_ram_incoming_cleanup(mis);
+
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_byte(mis->to_src, MIG_RP_MSG_SHUT);
+    qemu_put_be32(mis->to_src, ret < 0 ? -ret : 0);
+    qemu_fflush(mis->to_src);
+    qemu_mutex_unlock(&mis->rp_mutex);
+
+    qemu_fclose(mis->to_src);
+    qemu_fclose(mis->from_src);
+
+    /* The guest is already running here; there is nothing to fall back to */
+    if (ret < 0) {
+        error_report("postcopy: load of RAM failed: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    DPRINTF("incoming RAM complete\n");
+    mis->active = false;
+    return NULL;
+}
+
+int postcopy_ram_incoming_listen(QEMUFile *f)
+{
+    PostcopyIncomingState *mis = &incoming;
+    RAMBlock *block;
+
+    if (!postcopy_ram_supported_by_host()) {
+        return -ENOSYS;
+    }
+
+    mis->to_src = qemu_file_get_return_path(f);
+    if (!mis->to_src) {
+        error_report("postcopy: migration stream has no return path");
+        return -EINVAL;
+    }
+
+    mis->uffd = postcopy_open_uffd();
+    if (mis->uffd < 0) {
+        goto fail;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg_struct;
+
+        reg_struct.range.start = (uint64_t)(uintptr_t)block->host;
+        reg_struct.range.len = block->length;
+        reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+        if (ioctl(mis->uffd, UFFDIO_REGISTER, &reg_struct)) {
+            error_report("postcopy: UFFDIO_REGISTER of %s failed: %s",
+                         block->idstr, strerror(errno));
+            goto fail;
+        }
+        if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
+            error_report("postcopy: UFFDIO_COPY not supported for %s",
+                         block->idstr);
+            goto fail;
+        }
+    }
+
+    if (qemu_pipe(mis->quit_fd) < 0) {
+        error_report("postcopy: failed to create pipe: %s", strerror(errno));
+        mis->quit_fd[0] = mis->quit_fd[1] = -1;
+        goto fail;
+    }
+
+    qemu_mutex_init(&mis->rp_mutex);
+    mis->from_src = f;
+    mis->active = true;
+    qemu_thread_create(&mis->fault_thread, postcopy_ram_fault_thread, mis,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&mis->listen_thread, postcopy_ram_listen_thread, mis,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+
+fail:
+    if (mis->uffd >= 0) {
+        close(mis->uffd);
+        mis->uffd = -1;
+    }
+    qemu_fclose(mis->to_src);
+    mis->to_src = NULL;
+    return -EINVAL;
+}
+
+#else
+
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("postcopy: userfaultfd is not available on this host");
+    return false;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_incoming_listen(QEMUFile *f)
+{
+    error_report("postcopy: userfaultfd is not available on this host");
+    return -ENOSYS;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return false;
+}
+
+int postcopy_place_page(void *host, void *from)
+{
+    return -ENOSYS;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    return -ENOSYS;
+}
+
+#endif
@@ -102,6 +102,9 @@ static void help(void)
            "  '-q' use Quiet mode - do not print any output (except errors)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allow convert to write out of order; may improve performance,\n"
+           "       but the layout of the output image may differ between runs\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -738,22 +741,23 @@ static int img_commit(int argc, char **argv)
  */
 static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
 {
-    bool is_zero;
-    int i;
+    size_t len = (size_t)n * BDRV_SECTOR_SIZE;
+    size_t off;
 
     if (n <= 0) {
         *pnum = 0;
         return 0;
     }
-    is_zero = buffer_is_zero(buf, 512);
-    for(i = 1; i < n; i++) {
-        buf += 512;
-        if (is_zero != buffer_is_zero(buf, 512)) {
-            break;
-        }
+
+    off = buffer_find_nonzero_offset(buf, len);
+    if (off >= BDRV_SECTOR_SIZE) {
+        *pnum = off / BDRV_SECTOR_SIZE;
+        return 0;
     }
-    *pnum = i;
-    return !is_zero;
+
+    *pnum = buffer_find_zero_run(buf, len, BDRV_SECTOR_SIZE) /
+            BDRV_SECTOR_SIZE;
+    return 1;
 }
 
 /*
@@ -889,7 +893,8 @@ static int img_compare(int argc, char **argv)
     int64_t total_sectors1, total_sectors2;
     uint8_t *buf1 = NULL, *buf2 = NULL;
     int pnum1, pnum2;
-    int allocated1, allocated2;
+    int64_t status1, status2;
+    bool allocated1, allocated2, zero1, zero2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int64_t total_sectors;
@@ -978,65 +983,71 @@ static int img_compare(int argc, char **argv)
         if (nb_sectors <= 0) {
             break;
         }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
+        status1 = bdrv_get_block_status_above(bs1, NULL, sector_num,
+                                              nb_sectors, &pnum1);
+        if (status1 < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename1);
             goto out;
         }
+        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
 
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
+        status2 = bdrv_get_block_status_above(bs2, NULL, sector_num,
+                                              nb_sectors, &pnum2);
+        if (status2 < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename2);
             goto out;
         }
+        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
         nb_sectors = MIN(pnum1, pnum2);
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    ret = 1;
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    goto out;
-                }
+        if (strict && allocated1 != allocated2) {
+            ret = 1;
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n",
+                    sectors_to_bytes(sector_num));
+            goto out;
+        }
+
+        /* Sectors that are known to read as zeroes need not be read */
+        zero1 = (status1 & BDRV_BLOCK_ZERO) || !allocated1;
+        zero2 = (status2 & BDRV_BLOCK_ZERO) || !allocated2;
+
+        if (zero1 && zero2) {
+            /* nothing to compare */
+        } else if (!zero1 && !zero2) {
+            ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64 " of %s:"
+                             " %s", sectors_to_bytes(sector_num), filename1,
+                             strerror(-ret));
+                ret = 4;
+                goto out;
             }
-        } else {
-            if (strict) {
+            ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64
+                             " of %s: %s", sectors_to_bytes(sector_num),
+                             filename2, strerror(-ret));
+                ret = 4;
+                goto out;
+            }
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
                 ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
+                qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                        sectors_to_bytes(
+                            ret ? sector_num : sector_num + pnum));
                 goto out;
             }
-
-            if (allocated1) {
-                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
+        } else {
+            if (zero1) {
                 ret = check_empty_sectors(bs2, sector_num, nb_sectors,
                                           filename2, buf1, quiet);
+            } else {
+                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
+                                          filename1, buf1, quiet);
             }
             if (ret) {
                 if (ret < 0) {
@@ -1053,7 +1064,7 @@ static int img_compare(int argc, char **argv)
 
     if (total_sectors1 != total_sectors2) {
         BlockDriverState *bs_over;
-        int64_t total_sectors_over;
+        int64_t total_sectors_over, status;
         const char *filename_over;
 
         qprintf(quiet, "Warning: Image size mismatch!\n");
@@ -1072,9 +1083,9 @@ static int img_compare(int argc, char **argv)
             if (nb_sectors <= 0) {
                 break;
             }
-            ret = bdrv_is_allocated_above(bs_over, NULL, sector_num,
-                                          nb_sectors, &pnum);
-            if (ret < 0) {
+            status = bdrv_get_block_status_above(bs_over, NULL, sector_num,
+                                                 nb_sectors, &pnum);
+            if (status < 0) {
                 ret = 3;
                 error_report("Sector allocation test failed for %s",
                              filename_over);
@@ -1082,7 +1093,8 @@ static int img_compare(int argc, char **argv)
 
             }
             nb_sectors = pnum;
-            if (ret) {
+            if ((status & BDRV_BLOCK_ALLOCATED) &&
+                !(status & BDRV_BLOCK_ZERO)) {
                 ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
                                           filename_over, buf1, quiet);
                 if (ret) {
@@ -1114,25 +1126,370 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
+typedef enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+} ImgConvertBlockStatus;
+
+/*
+ * The conversion is done in chunks by several coroutines, so that reading a
+ * chunk overlaps with writing the ones before it.  Each chunk has the same
+ * block status throughout; chunks that must be read or written are at most
+ * buf_sectors long.  Chunks never span two source images, except with
+ * compression, where they are exactly one cluster of the output image.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    int min_sparse;
+    int buf_sectors;
+    /* start of the next chunk to be handed out */
+    int64_t sector_num;
+    /* with in-order writes, everything before this has been written */
+    int64_t wr_offs;
+    bool wr_in_order;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the length of the chunk starting at sector_num and stores in
+ * *status how it is to be converted, or -errno.  Chunks that need no I/O
+ * are not limited to buf_sectors, so that large holes are skipped at once.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num,
+                                                  ImgConvertBlockStatus *status)
+{
+    int64_t src_cur_offset, ret;
+    int src_cur, n, n1;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    n = MIN(s->total_sectors - sector_num, INT_MAX >> BDRV_SECTOR_BITS);
+    *status = BLK_DATA;
+
+    if (s->compressed) {
+        /* Only clusters that are entirely zero can be left out */
+        n = MIN(n, s->buf_sectors);
+        if (src_cur_offset + s->src_sectors[src_cur] - sector_num < n) {
+            return n;
+        }
+        ret = bdrv_co_get_block_status_above(s->src[src_cur], NULL,
+                                             sector_num - src_cur_offset,
+                                             n, &n1);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num - src_cur_offset,
+                         strerror(-ret));
+            return ret;
+        }
+        if ((ret & BDRV_BLOCK_ZERO) && n1 == n) {
+            *status = BLK_ZERO;
+        }
+        return n;
+    }
+
+    n = MIN(n, src_cur_offset + s->src_sectors[src_cur] - sector_num);
+
+    /* If the output image is being created as a copy on write image,
+       assume that sectors which are unallocated in the input image
+       are present in both the output's and input's base images (no
+       need to copy them), so only look at the top layer. */
+    if (s->target_has_backing) {
+        ret = bdrv_co_get_block_status(s->src[src_cur],
+                                       sector_num - src_cur_offset, n, &n1);
+    } else {
+        ret = bdrv_co_get_block_status_above(s->src[src_cur], NULL,
+                                             sector_num - src_cur_offset,
+                                             n, &n1);
+    }
+    if (ret < 0) {
+        error_report("error while reading block status of sector %" PRId64
+                     ": %s", sector_num - src_cur_offset, strerror(-ret));
+        return ret;
+    }
+    n = n1;
+
+    if (s->target_has_backing && s->has_zero_init &&
+        !(ret & BDRV_BLOCK_ALLOCATED)) {
+        *status = BLK_BACKING_FILE;
+    } else if (ret & BDRV_BLOCK_ZERO) {
+        *status = BLK_ZERO;
+    }
+
+    /* Zeroes only need to be written if the target doesn't read as zeroes */
+    if (*status == BLK_DATA ||
+        (*status == BLK_ZERO && (!s->has_zero_init || s->target_has_backing))) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    while (nb_sectors > 0) {
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                src_cur_offset + s->src_sectors[src_cur] - sector_num);
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         sector_num - src_cur_offset, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    if (status == BLK_BACKING_FILE) {
+        return 0;
+    }
+
+    if (s->compressed) {
+        if (status == BLK_ZERO ||
+            buffer_is_zero(buf, nb_sectors << BDRV_SECTOR_BITS)) {
+            return 0;
+        }
+        ret = bdrv_co_write_compressed(s->target, sector_num, buf,
+                                       nb_sectors);
+        if (ret < 0) {
+            error_report("error while compressing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            return ret;
+        }
+        return 0;
+    }
+
+    if (status == BLK_ZERO) {
+        if (s->has_zero_init && !s->target_has_backing) {
+            return 0;
+        }
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors, 0);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            return ret;
+        }
+        return 0;
+    }
+
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image. The block
+       status catches most of them without reading, but data
+       clusters may still contain zeroes. */
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n = nb_sectors;
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors << BDRV_SECTOR_BITS);
+
+    for (;;) {
+        int64_t sector_num;
+        ImgConvertBlockStatus status;
+        int n;
+
+        /* Finding out the next chunk may yield, but chunks must be handed
+         * out in order */
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        sector_num = s->sector_num;
+        n = convert_iteration_sectors(s, sector_num, &status);
+        if (n < 0) {
+            s->ret = n;
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that waits for this chunk to be done */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+
+        qemu_progress_print(100.0 * n / s->total_sectors, 100);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    qemu_co_mutex_init(&s->lock);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == -EINPROGRESS && s->compressed) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+
+    return s->ret == -EINPROGRESS ? 0 : s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t bs_len;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
     bool quiet = false;
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1140,7 +1497,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:W");
         if (c == -1) {
             break;
         }
@@ -1197,6 +1554,22 @@ static int img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1229,6 +1602,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -1239,8 +1613,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &bs_len);
+        bs_sectors[bs_i] = bs_len;
+        total_sectors += bs_len;
     }
 
     if (snapshot_name != NULL) {
@@ -1306,7 +1681,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -1358,10 +1733,19 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = (bool) out_baseimg,
+        .min_sparse         = min_sparse,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
+    };
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -1376,167 +1760,24 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
+        state.buf_sectors = cluster_sectors;
 
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
+        /* Only drivers with a coroutine implementation can compress several
+         * clusters at once */
+        if (!out_bs->drv->bdrv_co_write_compressed) {
+            state.wr_in_order = true;
         }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
+        state.has_zero_init = bdrv_has_zero_init(out_bs);
+    }
 
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
+    ret = convert_do_copy(&state);
 
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(bs_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
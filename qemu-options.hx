@@ -409,6 +409,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -446,6 +447,11 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
+@item detect-zeroes=@var{detect-zeroes}
+@var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
+conversion of plain zero writes by the OS to driver specific optimized
+zero write commands. You may even choose "unmap" if @var{discard} is set
+to "unmap" to allow a zero write to be converted to an UNMAP operation.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -2916,6 +2922,20 @@ STEXI
 @item -incoming @var{port}
 @findex -incoming
 Prepare for incoming migration, listen on @var{port}.
+
+For @code{tcp:} and @code{unix:}, a @code{,channels=@var{n}} suffix accepts up
+to @var{n} connections.  The source tells how many it uses in the migration
+stream; the migration fails if that is more than @var{n}, or if they do not
+all arrive within 30 seconds.
+
+@code{file:@var{path}} restores the state saved by
+@code{migrate file:@var{path}}, reading RAM back with several threads
+(@var{n} with @code{,channels=@var{n}}).
+With @code{file:@var{path},lazy=on} guest RAM is mapped from the file instead
+of read: the guest starts at once, pages are read when first touched and a
+background thread brings in the rest.  The file must then be left alone for as
+long as the guest runs.  Options can be combined in any order, as in
+@code{file:@var{path},channels=4,lazy=on}.
 ETEXI
 
 DEF("nodefaults", 0, QEMU_OPTION_nodefaults, \
@@ -3099,6 +3119,12 @@ Create an new object of type @var{typename} setting properties
 in the order they are specified.  Note that the 'id'
 property must be set.  These objects are placed in the
 '/objects' path.
+
+For example, @code{-object iothread,id=iothread0} creates an event loop
+thread that dataplane devices can share with
+@code{-device virtio-blk-pci,x-iothread=iothread0,...}.  Its
+@option{poll-max-ns} property enables busy polling like the
+@option{x-poll-max-ns} property of virtio-blk does.
 ETEXI
 
 DEF("msg", HAS_ARG, QEMU_OPTION_msg,
@@ -329,6 +329,60 @@ Example:
 -> { "execute": "device_del", "arguments": { "id": "net1" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "object-add",
+        .args_type  = "qom-type:s,id:s,props:q?",
+        .mhandler.cmd_new = qmp_object_add,
+    },
+
+SQMP
+object-add
+----------
+
+Create a QOM object, like -object does on the command line.  Only iothreads
+and backends (rng-random, rng-egd) can be created this way.
+
+Arguments:
+
+- "qom-type": the object's QOM type (json-string)
+- "id": the object's ID, it is placed in /objects (json-string)
+- "props": properties to set on the object (json-dict, optional)
+
+Example:
+
+-> { "execute": "object-add",
+     "arguments": { "qom-type": "iothread", "id": "iothread1",
+                    "props": { "poll-max-ns": 32768 } } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "object-del",
+        .args_type  = "id:s",
+        .mhandler.cmd_new = qmp_marshal_input_object_del,
+    },
+
+SQMP
+object-del
+----------
+
+Remove a QOM object that was created with -object or object-add.  As for
+object-add, it must be an iothread or a backend.  Objects that are still in
+use, such as an iothread that a device runs in, go away when their last user
+does.
+
+Arguments:
+
+- "id": the object's ID (json-string)
+
+Example:
+
+-> { "execute": "object-del", "arguments": { "id": "iothread1" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -632,6 +686,9 @@ Example:
 -> { "execute": "migrate", "arguments": { "uri": "tcp:0:4446" } }
 <- { "return": {} }
 
+-> { "execute": "migrate", "arguments": { "uri": "tcp:0:4446,channels=4" } }
+<- { "return": {} }
+
 Notes:
 
 (1) The 'query-migrate' command should be used to check migration's progress
@@ -639,6 +696,16 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) With ",channels=N" after a tcp: or unix: URI, RAM pages are sent over
+    N-1 extra connections, each served by its own thread, while the device
+    state stays on the main one.  The destination must accept at least N
+    connections with the same option in -incoming.  Post-copy cannot be
+    used together with it.
+(5) "file:PATH" writes the guest to a file that "-incoming file:PATH" can
+    restore from.  RAM pages have a fixed place in the file and are written
+    by several threads, with O_DIRECT when the file system allows it, so
+    the file does not grow with the number of rounds; ",channels=N" sets
+    the number of threads.  The migration speed limit still applies.
 
 EQMP
 
@@ -705,6 +772,76 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its RAM.  The result
+is read back with query-dirty-rate.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last dirty page rate measurement.
+
+returns a json-object with the following information:
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": host time in seconds at which the measurement started
+                (json-int, optional)
+- "calc-time": length of the measurement in seconds (json-int, optional)
+- "dirty-rate": estimated dirty rate in MB/s (json-int, optional)
+- "blocks": json-array of one json-object per RAM block (optional):
+         - "id": RAM block name (json-string)
+         - "size": RAM block size in bytes (json-int)
+         - "sample-pages": number of sampled pages (json-int)
+         - "dirty-rate": estimated dirty rate in MB/s (json-int)
+- "expected-downtime": downtime in milliseconds a migration would be
+                       expected to have (json-int, optional)
+- "rounds-to-converge": passes over RAM a migration would be expected to
+                        need, -1 if it would not converge (json-int, optional)
+
+The predictions use the bandwidth of the migration in progress if there is
+one, and the migration speed limit otherwise.
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "start-time": 1381824000,
+        "calc-time": 1,
+        "dirty-rate": 108,
+        "blocks": [ { "id": "pc.ram", "size": 4294967296,
+                      "sample-pages": 2048, "dirty-rate": 108 } ],
+        "expected-downtime": 276,
+        "rounds-to-converge": 7 } }
+
 EQMP
 
     {
@@ -1758,6 +1895,8 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "detect_zeroes": detect and optimize zero writes (json-string)
+             - Possible values: "off", "on", "unmap"
          - "image": the detail of the image, it is a json-object containing
             the following:
              - "filename": image file name (json-string)
@@ -1827,6 +1966,7 @@ Example:
                "iops":1000000,
                "iops_rd":0,
                "iops_wr":0,
+               "detect_zeroes":"on",
                "image":{
                   "filename":"disks/test.qcow2",
                   "format":"qcow2",
@@ -1907,6 +2047,18 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "wr_zero_detected_operations": write operations turned into write
+                                     zeroes by detect-zeroes (json-int)
+    - "wr_zero_detected_bytes": bytes in these operations (json-int)
+- "metadata-cache": A json-object with the statistics of the metadata caches
+                    of the image format, if it has any (json-object, optional):
+    - "l2-size": size of the L2 table cache in bytes (json-int)
+    - "l2-hits": L2 table lookups served from the cache (json-int)
+    - "l2-misses": L2 table lookups that loaded the table (json-int)
+    - "refcount-size": size of the refcount block cache in bytes (json-int)
+    - "refcount-hits": refcount block lookups served from the cache (json-int)
+    - "refcount-misses": refcount block lookups that loaded the block
+                         (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2037,6 +2189,49 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
+SQMP
+query-iothreads
+---------------
+
+Show the iothreads, for example to pin them to host CPUs with taskset.
+
+Return a json-array. Each iothread is represented by a json-object, which
+contains:
+
+- "id": the iothread's ID (json-string)
+- "thread-id": ID of the underlying host thread (json-int)
+- "busy-ns": nanoseconds the thread spent running since it started (json-int)
+- "idle-ns": nanoseconds the thread spent waiting for events since it
+             started (json-int)
+
+Example:
+
+-> { "execute": "query-iothreads" }
+<- {
+      "return":[
+         {
+            "id":"iothread0",
+            "thread-id":3134,
+            "busy-ns":1893712201,
+            "idle-ns":58220843970
+         },
+         {
+            "id":"iothread1",
+            "thread-id":3135,
+            "busy-ns":40718344,
+            "idle-ns":60073931214
+         }
+      ]
+   }
+
 EQMP
 
     {
@@ -2617,7 +2812,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -2626,6 +2822,12 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "rounds-to-converge": only present while migration is active
+                number of further bitmap rounds expected before the rest
+                fits in the maximum downtime, -1 if the rounds are not
+                getting shorter (json-int)
+- "cpu-throttle-percentage": only present while auto-converge is throttling
+                the guest, percentage of vCPU time taken away (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -2641,6 +2843,10 @@ The main json-object contains the following:
             pages. This is just normal pages times size of one page,
             but this way upper levels don't need to care about page
             size (json-int)
+         - "dirty-sync-count": number of dirty bitmap synchronizations
+            done so far (json-int, optional)
+         - "dirty-sync-time": duration of the last dirty bitmap
+            synchronization in microseconds (json-int, optional)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -2656,6 +2862,19 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-hit-rate": fraction of page cache lookups that hit
+           (json-number)
+         - "evictions": number of cached pages replaced by a more
+           recently used page
+- "compression": only present if compression is active.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages (json-int)
+         - "busy": number of times no free compression thread was
+           available (json-int)
+         - "compressed-size": number of bytes after compression (json-int)
+         - "compression-rate": ratio between the size of the original
+           pages and the compressed size (json-number)
 
 Examples:
 
@@ -2752,7 +2971,10 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":1122,
+            "cache-hit-rate":0.33,
+            "evictions":1020
          }
       }
    }
@@ -2812,6 +3034,69 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": set compression level during migration (json-int)
+- "compress-threads": set compression thread count for migration (json-int)
+- "decompress-threads": set decompression thread count for migration (json-int)
+- "x-postcopy-rounds": set dirty bitmap synchronizations before post-copy
+  starts (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-postcopy-rounds:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "x-postcopy-rounds" : bitmap synchronizations before post-copy
+           (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1,
+         "x-postcopy-rounds": 5
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -25,6 +25,8 @@
 #include "sysemu/blockdev.h"
 #include "qom/qom-qobject.h"
 #include "hw/boards.h"
+#include "sysemu/iothread.h"
+#include "sysemu/rng.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -239,6 +241,101 @@ out:
     return 0;
 }
 
+/*
+ * The types that object-add and object-del may create and delete.  Other
+ * types, devices in particular, are not meant to come and go under /objects.
+ */
+static const char *const object_hotplug_types[] = {
+    TYPE_IOTHREAD,
+    TYPE_RNG_BACKEND,
+    NULL
+};
+
+static bool object_class_is_hotpluggable(ObjectClass *klass)
+{
+    int i;
+
+    for (i = 0; object_hotplug_types[i]; i++) {
+        if (object_class_dynamic_cast(klass, object_hotplug_types[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int qmp_object_add(Monitor *mon, const QDict *qdict, QObject **ret)
+{
+    const char *type = qdict_get_str(qdict, "qom-type");
+    const char *id = qdict_get_str(qdict, "id");
+    QObject *po = qdict_get(qdict, "props");
+    Object *container = container_get(object_get_root(), "/objects");
+    Error *local_err = NULL;
+    ObjectClass *klass;
+    Object *obj = NULL;
+
+    klass = object_class_by_name(type);
+    if (!klass || object_class_is_abstract(klass) ||
+        !object_class_is_hotpluggable(klass)) {
+        error_set(&local_err, QERR_INVALID_PARAMETER_VALUE, "qom-type",
+                  "an iothread or backend type");
+        goto out;
+    }
+    if (object_resolve_path_component(container, id)) {
+        error_set(&local_err, QERR_DUPLICATE_ID, id, "object");
+        goto out;
+    }
+
+    obj = object_new(type);
+    if (po) {
+        QDict *props = qobject_to_qdict(po);
+        const QDictEntry *e;
+
+        if (!props) {
+            error_set(&local_err, QERR_INVALID_PARAMETER_TYPE, "props",
+                      "dict");
+            goto out;
+        }
+        for (e = qdict_first(props); e; e = qdict_next(props, e)) {
+            object_property_set_qobject(obj, qdict_entry_value(e),
+                                        qdict_entry_key(e), &local_err);
+            if (local_err) {
+                goto out;
+            }
+        }
+    }
+
+    object_property_add_child(container, id, obj, &local_err);
+
+out:
+    if (obj) {
+        object_unref(obj);
+    }
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        return -1;
+    }
+
+    return 0;
+}
+
+void qmp_object_del(const char *id, Error **errp)
+{
+    Object *container = container_get(object_get_root(), "/objects");
+    Object *obj;
+
+    obj = object_resolve_path_component(container, id);
+    if (!obj) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, id);
+        return;
+    }
+    if (!object_class_is_hotpluggable(object_get_class(obj))) {
+        error_setg(errp, "object '%s' cannot be deleted", id);
+        return;
+    }
+    object_unparent(obj);
+}
+
 int qmp_qom_get(Monitor *mon, const QDict *qdict, QObject **ret)
 {
     const char *path = qdict_get_str(qdict, "path");
@@ -32,6 +32,7 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
@@ -43,6 +44,15 @@
 #include "block/snapshot.h"
 #include "block/qapi.h"
 
+#ifdef __linux__
+#include <poll.h>
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define QEMU_FILE_ZEROCOPY
+#endif
+#endif
+
 #define SELF_ANNOUNCE_ROUNDS 5
 
 #ifndef ETH_P_RARP
@@ -143,12 +153,237 @@ typedef struct QEMUFileStdio
     QEMUFile *file;
 } QEMUFileStdio;
 
+typedef struct QEMUFileZeroCopy QEMUFileZeroCopy;
+
 typedef struct QEMUFileSocket
 {
     int fd;
     QEMUFile *file;
+    /* set once zero-copy sends are enabled */
+    QEMUFileZeroCopy *zc;
 } QEMUFileSocket;
 
+#ifdef QEMU_FILE_ZEROCOPY
+/*
+ * Zero-copy sends (MSG_ZEROCOPY): the kernel reads the data straight from
+ * our memory, possibly well after sendmsg() returned, and reports on the
+ * socket's error queue when it is done with it.
+ *
+ * Guest RAM queued with qemu_put_buffer_async() needs no tracking: a page
+ * that is written to before the kernel reads it is dirty again and will be
+ * sent once more.  The rest comes from QEMUFile's buffer, which is reused
+ * as soon as it has been flushed, so it is copied to a staging buffer that
+ * is only recycled once the send that used it has completed.
+ */
+#define ZEROCOPY_STAGING_BUFS 16
+
+struct QEMUFileZeroCopy {
+    uint8_t *staging;
+    /* last send that used each staging buffer */
+    uint32_t staging_id[ZEROCOPY_STAGING_BUFS];
+    bool staging_used[ZEROCOPY_STAGING_BUFS];
+    int next_staging;
+    /* id the kernel gives the next MSG_ZEROCOPY send */
+    uint32_t next_id;
+    /* every send below this id has completed; TCP completes in order */
+    uint32_t completed;
+    /* completions for which the kernel had to copy after all */
+    uint64_t copied;
+};
+
+static bool zerocopy_done(QEMUFileZeroCopy *zc, uint32_t id)
+{
+    return (int32_t)(id - zc->completed) < 0;
+}
+
+/*
+ * Collect completion notifications.  If there are none, wait up to
+ * @timeout ms (forever if negative) for one, or return at once if 0.
+ */
+static int zerocopy_reap(QEMUFileSocket *s, int timeout)
+{
+    QEMUFileZeroCopy *zc = s->zc;
+    bool reaped = false;
+
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cm;
+        struct pollfd pfd;
+        ssize_t ret;
+
+        /* the error queue is never waited on by recvmsg() */
+        ret = recvmsg(s->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -errno;
+            }
+            if (reaped || !timeout) {
+                return 0;
+            }
+            /* POLLERR is always reported */
+            pfd.fd = s->fd;
+            pfd.events = 0;
+            ret = poll(&pfd, 1, timeout);
+            if (ret < 0 && errno != EINTR) {
+                return -errno;
+            }
+            if (ret == 0) {
+                return -ETIMEDOUT;
+            }
+            continue;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (void *)CMSG_DATA(cm);
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+                continue;
+            }
+            /* [ee_info, ee_data] is the range of sends that completed */
+            zc->completed = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied++;
+            }
+            reaped = true;
+        }
+    }
+}
+
+static ssize_t zerocopy_writev_buffer(QEMUFileSocket *s, struct iovec *iov,
+                                      int iovcnt)
+{
+    QEMUFileZeroCopy *zc = s->zc;
+    QEMUFile *f = s->file;
+    int slot = zc->next_staging;
+    uint8_t *staging = zc->staging + slot * IO_BUF_SIZE;
+    unsigned int cnt = iovcnt;
+    size_t size = iov_size(iov, iovcnt);
+    size_t staged = 0;
+    ssize_t total = 0;
+    bool copy = false;
+    int i, ret;
+
+    /* a send that used the buffer is in flight, so a completion will come */
+    while (zc->staging_used[slot] &&
+           !zerocopy_done(zc, zc->staging_id[slot]) &&
+           zc->completed != zc->next_id) {
+        ret = zerocopy_reap(s, -1);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        uint8_t *base = iov[i].iov_base;
+
+        if (base >= f->buf && base < f->buf + IO_BUF_SIZE) {
+            memcpy(staging + staged, base, iov[i].iov_len);
+            iov[i].iov_base = staging + staged;
+            staged += iov[i].iov_len;
+        }
+    }
+    assert(staged <= IO_BUF_SIZE);
+
+    while (total < size) {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = cnt,
+        };
+        ssize_t len;
+
+        len = sendmsg(s->fd, &msg, copy ? 0 : MSG_ZEROCOPY);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && !copy) {
+                /* Too much memory pinned: wait for sends still in flight.
+                 * If there are none, no completion will ever come, as this
+                 * send alone is over the limit, so copy it instead.
+                 */
+                if (zc->completed == zc->next_id) {
+                    copy = true;
+                    continue;
+                }
+                ret = zerocopy_reap(s, -1);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+            return -errno;
+        }
+        if (!copy) {
+            zc->next_id++;
+        }
+        iov_discard_front(&iov, &cnt, len);
+        total += len;
+    }
+
+    if (staged) {
+        zc->staging_used[slot] = true;
+        zc->staging_id[slot] = zc->next_id - 1;
+        zc->next_staging = (slot + 1) % ZEROCOPY_STAGING_BUFS;
+    }
+
+    ret = zerocopy_reap(s, 0);
+    return ret < 0 ? ret : total;
+}
+
+static void zerocopy_fini(QEMUFileSocket *s)
+{
+    QEMUFileZeroCopy *zc = s->zc;
+
+    /* the staging buffers must not be freed under the kernel's feet */
+    while (zc->completed != zc->next_id) {
+        if (zerocopy_reap(s, 1000) < 0) {
+            break;
+        }
+    }
+    trace_qemu_file_zerocopy_fini(zc->next_id, zc->copied);
+    if (zc->completed == zc->next_id) {
+        g_free(zc->staging);
+    } else {
+        /* the kernel may still send from them, so leak them */
+        trace_qemu_file_zerocopy_leak(zc->next_id - zc->completed);
+    }
+    g_free(zc);
+    s->zc = NULL;
+}
+#endif
+
+static int socket_enable_zerocopy(void *opaque)
+{
+#ifdef QEMU_FILE_ZEROCOPY
+    QEMUFileSocket *s = opaque;
+    int one = 1;
+
+    if (s->zc) {
+        return 0;
+    }
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        return -errno;
+    }
+    s->zc = g_new0(QEMUFileZeroCopy, 1);
+    s->zc->staging = g_malloc(ZEROCOPY_STAGING_BUFS * IO_BUF_SIZE);
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                     int64_t pos)
 {
@@ -156,6 +391,12 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     ssize_t len;
     ssize_t size = iov_size(iov, iovcnt);
 
+#ifdef QEMU_FILE_ZEROCOPY
+    if (s->zc) {
+        return zerocopy_writev_buffer(s, iov, iovcnt);
+    }
+#endif
+
     len = iov_send(s->fd, iov, iovcnt, 0, size);
     if (len < size) {
         len = -socket_error();
@@ -196,11 +437,40 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+#ifdef QEMU_FILE_ZEROCOPY
+    if (s->zc) {
+        zerocopy_fini(s);
+    }
+#endif
     closesocket(s->fd);
     g_free(s);
     return 0;
 }
 
+/*
+ * Give a QEMUFile that reads what the other side of the socket writes to
+ * us, or writes to where we read from.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+#ifndef _WIN32
+    QEMUFileSocket *s = opaque;
+    int fd;
+
+    fd = dup(s->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (s->file->ops->get_buffer) {
+        return qemu_fopen_socket(fd, "wb");
+    }
+    return qemu_fopen_socket(fd, "rb");
+#else
+    return NULL;
+#endif
+}
+
 static int stdio_get_fd(void *opaque)
 {
     QEMUFileStdio *s = opaque;
@@ -338,6 +608,12 @@ static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     ssize_t size = iov_size(iov, iovcnt);
     ssize_t total = 0;
 
+#ifdef QEMU_FILE_ZEROCOPY
+    if (s->zc) {
+        return zerocopy_writev_buffer(s, iov, iovcnt);
+    }
+#endif
+
     assert(iovcnt > 0);
     offset = 0;
     while (size > 0) {
@@ -398,6 +674,12 @@ static int unix_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 static int unix_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+#ifdef QEMU_FILE_ZEROCOPY
+    if (s->zc) {
+        zerocopy_fini(s);
+    }
+#endif
     close(s->fd);
     g_free(s);
     return 0;
@@ -412,7 +694,8 @@ static const QEMUFileOps unix_read_ops = {
 static const QEMUFileOps unix_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = unix_writev_buffer,
-    .close =      unix_close
+    .close =      unix_close,
+    .enable_zerocopy = socket_enable_zerocopy
 };
 
 QEMUFile *qemu_fdopen(int fd, const char *mode)
@@ -438,15 +721,18 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 }
 
 static const QEMUFileOps socket_read_ops = {
-    .get_fd =     socket_get_fd,
-    .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .get_fd =          socket_get_fd,
+    .get_buffer =      socket_get_buffer,
+    .close =           socket_close,
+    .get_return_path = socket_get_return_path
 };
 
 static const QEMUFileOps socket_write_ops = {
-    .get_fd =     socket_get_fd,
-    .writev_buffer = socket_writev_buffer,
-    .close =      socket_close
+    .get_fd =          socket_get_fd,
+    .writev_buffer =   socket_writev_buffer,
+    .close =           socket_close,
+    .get_return_path = socket_get_return_path,
+    .enable_zerocopy = socket_enable_zerocopy
 };
 
 bool qemu_file_mode_is_not_valid(const char *mode)
@@ -555,6 +841,96 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/* In-memory QEMUFile, used to carry a chunk of migration stream inside
+ * another one.
+ */
+typedef struct QEMUFileBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
+    QEMUFile *file;
+} QEMUFileBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos + size > s->alloc) {
+        s->alloc = MAX(pos + size, s->alloc * 2);
+        s->data = g_realloc(s->data, s->alloc);
+    }
+    memcpy(s->data + pos, buf, size);
+    s->size = MAX(s->size, pos + size);
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buf_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    g_free(s->data);
+    g_free(s);
+    return 0;
+}
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+    .close =      buf_close
+};
+
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+    .close =      buf_close
+};
+
+/*
+ * For mode "r" the QEMUFile takes ownership of @data, which must have been
+ * allocated with g_malloc.  Mode "w" starts with an empty buffer.
+ */
+QEMUFile *qemu_bufopen(const char *mode, uint8_t *data, size_t size)
+{
+    QEMUFileBuffer *s;
+
+    if (mode == NULL || (mode[0] != 'r' && mode[0] != 'w') || mode[1] != 0) {
+        fprintf(stderr, "qemu_bufopen: Argument validity check failed\n");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileBuffer));
+    if (mode[0] == 'r') {
+        s->data = data;
+        s->size = s->alloc = size;
+        s->file = qemu_fopen_ops(s, &buf_read_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &buf_write_ops);
+    }
+    return s->file;
+}
+
+/* Contents of a buffer opened with qemu_bufopen("w"), valid until close */
+const uint8_t *qemu_buf_get_data(QEMUFile *f, size_t *size)
+{
+    QEMUFileBuffer *s = f->opaque;
+
+    assert(f->ops == &buf_write_ops);
+    qemu_fflush(f);
+    *size = s->size;
+    return s->data;
+}
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -708,11 +1084,50 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
 }
 
+/*
+ * Let the kernel read queued data in place instead of copying it.  Memory
+ * passed to qemu_put_buffer_async() must then stay unchanged until it has
+ * been sent, which may be after qemu_fflush() returns.
+ *
+ * Returns -ENOSYS or the error from the kernel when the file cannot do
+ * zero-copy sends; it keeps working as before in that case.
+ */
+int qemu_file_enable_zerocopy(QEMUFile *f)
+{
+    if (!f->ops->enable_zerocopy) {
+        return -ENOSYS;
+    }
+    qemu_fflush(f);
+    return f->ops->enable_zerocopy(f->opaque);
+}
+
+/*
+ * Account bytes that were sent on behalf of @f through another connection,
+ * so that they count against its rate limit too.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -1824,6 +2239,10 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
+
+/* Upper bound for the device state carried by QEMU_VM_POSTCOPY_PACKAGE */
+#define MAX_POSTCOPY_PACKAGE_SIZE    (256 << 20)
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1930,13 +2349,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1955,9 +2372,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
         trace_savevm_section_end(se->section_id);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1986,6 +2409,48 @@ void qemu_savevm_state_complete(QEMUFile *f)
     qemu_fflush(f);
 }
 
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+    qemu_savevm_state_complete_devices(f);
+}
+
+/*
+ * Like qemu_savevm_state_complete, but the device state is wrapped into
+ * a QEMU_VM_POSTCOPY_PACKAGE.  The destination reads the package in one
+ * go, which leaves the main stream free for the RAM pages that loading
+ * the devices (and running the guest) will fault in.
+ */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    QEMUFile *bf;
+    const uint8_t *data;
+    size_t len;
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+
+    bf = qemu_bufopen("w", NULL, 0);
+    qemu_savevm_state_complete_devices(bf);
+    data = qemu_buf_get_data(bf, &len);
+    if (len > MAX_POSTCOPY_PACKAGE_SIZE) {
+        qemu_file_set_error(f, -E2BIG);
+    } else {
+        qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+        qemu_put_be32(f, len);
+        qemu_put_buffer(f, data, len);
+    }
+    qemu_fclose(bf);
+    qemu_fflush(f);
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -2188,30 +2653,73 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers);
+
+static void loadvm_free_handlers(LoadStateEntry_Head *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+/*
+ * Read the device state package, hand the rest of the stream over to
+ * the post-copy listener and then load the devices from the package.
+ */
+static int loadvm_postcopy_package(QEMUFile *f)
+{
+    LoadStateEntry_Head loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    QEMUFile *bf;
+    uint8_t *data;
+    uint32_t len;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
+    len = qemu_get_be32(f);
+    if (len > MAX_POSTCOPY_PACKAGE_SIZE) {
+        fprintf(stderr, "Postcopy package too large: %u\n", len);
         return -EINVAL;
     }
+    data = g_malloc(len);
+    if (qemu_get_buffer(f, data, len) != len) {
+        g_free(data);
+        return qemu_file_get_error(f) ?: -EINVAL;
+    }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    ret = postcopy_ram_incoming_listen(f);
+    if (ret < 0) {
+        g_free(data);
+        return ret;
+    }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    bf = qemu_bufopen("r", data, len);
+    ret = qemu_loadvm_state_main(bf, &loadvm_handlers);
+    loadvm_free_handlers(&loadvm_handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(bf);
     }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+    qemu_fclose(bf);
+
+    return ret;
+}
+
+/*
+ * Returns: 0 on QEMU_VM_EOF
+ *          1 if the post-copy listener took over the rest of the stream
+ *          negative errno on failure
+ */
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -2234,16 +2742,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -2252,59 +2758,84 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            ret = loadvm_postcopy_package(f);
+            return ret < 0 ? ret : 1;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntry_Head loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    unsigned int v;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
     }
 
-    if (ret == 0) {
-        ret = qemu_file_get_error(f);
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
     }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
 
-    return ret;
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    loadvm_free_handlers(&loadvm_handlers);
+    if (ret < 0) {
+        return ret;
+    }
+
+    cpu_synchronize_all_post_init();
+
+    if (ret == 1) {
+        /* the rest of the stream now belongs to the post-copy listener */
+        return 0;
+    }
+    return qemu_file_get_error(f);
 }
 
 static BlockDriverState *find_vmstate_bs(void)
@@ -2539,6 +3070,7 @@ int load_vmstate(const char *name)
     ret = qemu_loadvm_state(f);
 
     qemu_fclose(f);
+    migrate_decompress_threads_join();
     if (ret < 0) {
         error_report("Error %d while loading VM state", ret);
         return ret;
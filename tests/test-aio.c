@@ -55,6 +55,7 @@ typedef struct {
     int n;
     int active;
     bool auto_set;
+    int polls;
 } EventNotifierTestData;
 
 static int event_active_cb(EventNotifier *e)
@@ -76,6 +77,19 @@ static void event_ready_cb(EventNotifier *e)
     }
 }
 
+static bool event_poll_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    /* the event shows up on the third look */
+    if (++data->polls < 3) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
 /* Tests using aio_*.  */
 
 static void test_notify(void)
@@ -291,6 +305,101 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb, event_active_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+
+    /* long enough that a broken poll loop gets noticed, not waited for */
+    aio_context_set_poll_params(ctx, 1000000000);
+    ctx->poll_ns = 1000000000;
+
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.polls, ==, 3);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, ==, 1000000000);
+
+    /* the handler is idle now, so it is not polled */
+    g_assert(!aio_poll(ctx, true));
+    g_assert_cmpint(data.polls, ==, 3);
+
+    aio_context_set_poll_params(ctx, 0);
+    aio_set_event_notifier(ctx, &data.e, NULL, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
+typedef struct {
+    QemuMutex start_lock;
+    bool thread_acquired;
+} AcquireTestData;
+
+static void *test_acquire_thread(void *opaque)
+{
+    AcquireTestData *data = opaque;
+
+    /* Wait for other thread to let us start */
+    qemu_mutex_lock(&data->start_lock);
+    qemu_mutex_unlock(&data->start_lock);
+
+    aio_context_acquire(ctx);
+    aio_context_release(ctx);
+
+    data->thread_acquired = true; /* success, we got here */
+
+    return NULL;
+}
+
+static int dummy_io_flush_true(EventNotifier *e)
+{
+    return true;
+}
+
+static void dummy_notifier_read(EventNotifier *unused)
+{
+    g_assert(false); /* should never be invoked */
+}
+
+static void test_acquire(void)
+{
+    QemuThread thread;
+    EventNotifier notifier;
+    AcquireTestData data;
+
+    while (aio_poll(ctx, false)) {
+        /* consume earlier aio_notify() calls */
+    }
+
+    /* Dummy event notifier ensures aio_poll() will block */
+    event_notifier_init(&notifier, false);
+    aio_set_event_notifier(ctx, &notifier, dummy_notifier_read,
+                           dummy_io_flush_true);
+
+    qemu_mutex_init(&data.start_lock);
+    qemu_mutex_lock(&data.start_lock);
+    data.thread_acquired = false;
+
+    qemu_thread_create(&thread, test_acquire_thread,
+                       &data, QEMU_THREAD_JOINABLE);
+
+    /* Block in aio_poll(), let other thread kick us and acquire context */
+    aio_context_acquire(ctx);
+    qemu_mutex_unlock(&data.start_lock); /* let the thread run */
+    g_assert(aio_poll(ctx, true));
+    aio_context_release(ctx);
+
+    qemu_thread_join(&thread);
+    aio_set_event_notifier(ctx, &notifier, NULL, NULL);
+    event_notifier_cleanup(&notifier);
+    qemu_mutex_destroy(&data.start_lock);
+
+    g_assert(data.thread_acquired);
+}
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -648,6 +757,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/acquire",                 test_acquire);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -0,0 +1,171 @@
+/*
+ * Test zero buffer detection
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE (64 * 1024)
+
+static uint8_t *alloc_zero_buf(size_t size)
+{
+    /* room to move the start of the buffer away from any alignment */
+    return qemu_memalign(4096, size + 4096);
+}
+
+static void test_all_zero(void)
+{
+    uint8_t *buf = alloc_zero_buf(BUF_SIZE);
+    size_t start, len;
+
+    memset(buf, 0, BUF_SIZE + 4096);
+    for (start = 0; start < 130; start++) {
+        for (len = 0; len < 1100; len += 7) {
+            g_assert_cmpint(buffer_find_nonzero_offset(buf + start, len), ==,
+                            len);
+            g_assert(buffer_is_zero(buf + start, len));
+        }
+        g_assert(buffer_is_zero(buf + start, BUF_SIZE));
+    }
+
+    qemu_vfree(buf);
+}
+
+static void test_nonzero_offset(void)
+{
+    uint8_t *buf = alloc_zero_buf(BUF_SIZE);
+    size_t start, pos, len = 2048;
+
+    memset(buf, 0, BUF_SIZE + 4096);
+
+    /* every unaligned start, every position of the non-zero byte */
+    for (start = 0; start < 70; start++) {
+        for (pos = 0; pos < len; pos++) {
+            buf[start + pos] = 0x80;
+            g_assert_cmpint(buffer_find_nonzero_offset(buf + start, len), ==,
+                            pos);
+            g_assert(!buffer_is_zero(buf + start, len));
+            /* bytes before the buffer must not be looked at */
+            g_assert(buffer_is_zero(buf + start, pos));
+            buf[start + pos] = 0;
+        }
+    }
+
+    /* large buffers take the unrolled vector path */
+    for (pos = 0; pos < BUF_SIZE; pos += 4093) {
+        buf[pos + 3] = 1;
+        g_assert_cmpint(buffer_find_nonzero_offset(buf + 3, BUF_SIZE), ==,
+                        pos);
+        buf[pos + 3] = 0;
+    }
+
+    qemu_vfree(buf);
+}
+
+static void test_zero_run(void)
+{
+    uint8_t *buf = alloc_zero_buf(BUF_SIZE);
+    size_t i;
+
+    memset(buf, 0x11, BUF_SIZE);
+
+    g_assert_cmpint(buffer_find_zero_run(buf, BUF_SIZE, 512), ==, BUF_SIZE);
+    g_assert_cmpint(buffer_find_zero_run(buf, 0, 512), ==, 0);
+
+    /* a zero area that covers only part of a block is not a run */
+    memset(buf + 1030, 0, 1000);
+    g_assert_cmpint(buffer_find_zero_run(buf, BUF_SIZE, 512), ==, BUF_SIZE);
+    memset(buf + 1000, 0, 1100);
+    g_assert_cmpint(buffer_find_zero_run(buf, BUF_SIZE, 512), ==, 1024);
+
+    /* the last block may be shorter */
+    memset(buf, 0x11, BUF_SIZE);
+    memset(buf + BUF_SIZE - 600, 0, 600);
+    g_assert_cmpint(buffer_find_zero_run(buf, BUF_SIZE - 50, 512), ==,
+                    BUF_SIZE - 512);
+    g_assert_cmpint(buffer_find_zero_run(buf, BUF_SIZE - 50, 4096), ==,
+                    BUF_SIZE - 50);
+
+    memset(buf, 0x11, BUF_SIZE);
+    for (i = 0; i < BUF_SIZE; i += 4096) {
+        memset(buf + i, 0, 4096);
+        g_assert_cmpint(buffer_find_zero_run(buf, BUF_SIZE, 4096), ==, i);
+        memset(buf + i, 0x11, 4096);
+    }
+
+    qemu_vfree(buf);
+}
+
+static void perf_buffer_is_zero(size_t size, size_t start)
+{
+    uint8_t *buf = alloc_zero_buf(size);
+    unsigned int i, max;
+    double duration;
+
+    memset(buf, 0, size + 4096);
+    max = (1024 * 1024 * 1024) / size * 4;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        g_assert(buffer_is_zero(buf + start, size));
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("buffer_is_zero, %zu bytes at offset %zu: %f GB/s\n",
+                   size, start, (double)size * max / duration / 1e9);
+    qemu_vfree(buf);
+}
+
+static void perf_page(void)
+{
+    perf_buffer_is_zero(4096, 0);
+    perf_buffer_is_zero(4096, 1);
+}
+
+static void perf_large(void)
+{
+    perf_buffer_is_zero(1024 * 1024, 0);
+    perf_buffer_is_zero(1024 * 1024, 17);
+}
+
+static void perf_zero_run(void)
+{
+    size_t size = 2 * 1024 * 1024;
+    uint8_t *buf = alloc_zero_buf(size);
+    unsigned int i, max = 1000;
+    double duration;
+
+    /* data everywhere but in the last sector, as in a full cluster */
+    memset(buf, 0x11, size);
+    memset(buf + size - 512, 0, 512);
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        g_assert_cmpint(buffer_find_zero_run(buf, size, 512), ==, size - 512);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("buffer_find_zero_run, %zu bytes in 512 byte blocks: "
+                   "%f GB/s\n", size, (double)size * max / duration / 1e9);
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/buffer-zero/all_zero", test_all_zero);
+    g_test_add_func("/buffer-zero/nonzero_offset", test_nonzero_offset);
+    g_test_add_func("/buffer-zero/zero_run", test_zero_run);
+    if (g_test_perf()) {
+        g_test_add_func("/buffer-zero/perf/page", perf_page);
+        g_test_add_func("/buffer-zero/perf/large", perf_large);
+        g_test_add_func("/buffer-zero/perf/zero_run", perf_zero_run);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,111 @@
+/*
+ * Migration convergence prediction unit tests
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/migration.h"
+
+#define MB (1000ULL * 1000)
+#define GB (1000 * MB)
+
+static void test_predict_no_bandwidth(void)
+{
+    int64_t downtime;
+
+    g_assert_cmpint(migration_predict_rounds(MB, 0, GB, GB, 300, &downtime),
+                    ==, -1);
+    g_assert_cmpint(downtime, ==, -1);
+}
+
+static void test_predict_fits_downtime(void)
+{
+    int64_t downtime;
+
+    /* 100 MB at 1 GB/s takes 100 ms, below the 300 ms limit */
+    g_assert_cmpint(migration_predict_rounds(0, GB, 100 * MB, GB, 300,
+                                             &downtime), ==, 0);
+    g_assert_cmpint(downtime, ==, 100);
+}
+
+static void test_predict_converges(void)
+{
+    int64_t downtime;
+
+    /*
+     * Dirtying at half the bandwidth halves every round:
+     * 10000, 5000, 2500, 1250, 625, 312.5, 156.25 ms.
+     */
+    g_assert_cmpint(migration_predict_rounds(50 * MB, 100 * MB, GB, 4 * GB,
+                                             300, &downtime), ==, 6);
+    g_assert_cmpint(downtime, ==, 156);
+}
+
+static void test_predict_diverges(void)
+{
+    int64_t downtime;
+
+    /* Dirtying faster than we send: the whole of RAM is left each round */
+    g_assert_cmpint(migration_predict_rounds(200 * MB, 100 * MB, GB, GB,
+                                             300, &downtime), ==, -1);
+    g_assert_cmpint(downtime, ==, 10000);
+
+    /* Dirtying exactly as fast as we send never gets any shorter either */
+    g_assert_cmpint(migration_predict_rounds(100 * MB, 100 * MB, GB, 4 * GB,
+                                             300, &downtime), ==, -1);
+    g_assert_cmpint(downtime, ==, 10000);
+}
+
+static void test_throttle_idle(void)
+{
+    g_assert_cmpint(migration_throttle_percentage(0, 100 * MB, 0), ==, 0);
+    g_assert_cmpint(migration_throttle_percentage(0, 100 * MB, 50), ==, 0);
+}
+
+static void test_throttle_no_bandwidth(void)
+{
+    g_assert_cmpint(migration_throttle_percentage(MB, 0, 20), ==, 20);
+}
+
+static void test_throttle_target(void)
+{
+    /* Already at half the bandwidth: nothing to do */
+    g_assert_cmpint(migration_throttle_percentage(50 * MB, 100 * MB, 0),
+                    ==, 0);
+    /* Dirtying at the bandwidth: run half the time */
+    g_assert_cmpint(migration_throttle_percentage(100 * MB, 100 * MB, 0),
+                    ==, 50);
+    /* Half the rate measured while throttled to 50% is the same guest */
+    g_assert_cmpint(migration_throttle_percentage(50 * MB, 100 * MB, 50),
+                    ==, 50);
+}
+
+static void test_throttle_cap(void)
+{
+    g_assert_cmpint(migration_throttle_percentage(10 * GB, 100 * MB, 0),
+                    ==, 95);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/migration/predict/no-bandwidth",
+                    test_predict_no_bandwidth);
+    g_test_add_func("/migration/predict/fits-downtime",
+                    test_predict_fits_downtime);
+    g_test_add_func("/migration/predict/converges", test_predict_converges);
+    g_test_add_func("/migration/predict/diverges", test_predict_diverges);
+    g_test_add_func("/migration/throttle/idle", test_throttle_idle);
+    g_test_add_func("/migration/throttle/no-bandwidth",
+                    test_throttle_no_bandwidth);
+    g_test_add_func("/migration/throttle/target", test_throttle_target);
+    g_test_add_func("/migration/throttle/cap", test_throttle_cap);
+
+    return g_test_run();
+}
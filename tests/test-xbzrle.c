@@ -19,6 +19,7 @@
 #include <assert.h>
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -179,6 +180,204 @@ static void test_encode_decode(void)
     }
 }
 
+#define CACHE_PAGE_SIZE 64
+
+static void test_cache_lru(void)
+{
+    /* 16 pages, so addresses a multiple of 4 pages apart share a set */
+    PageCache *cache = cache_init(16, CACHE_PAGE_SIZE);
+    uint8_t page[CACHE_PAGE_SIZE];
+    uint64_t stride = 4 * CACHE_PAGE_SIZE;
+    int i;
+
+    g_assert(cache);
+    for (i = 0; i < 4; i++) {
+        memset(page, i, sizeof(page));
+        g_assert(!cache_insert(cache, i * stride, page));
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * stride));
+        g_assert(get_cached_data(cache, i * stride)[0] == i);
+    }
+
+    /* touch page 0 again, which leaves page 1 as the LRU */
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(cache_insert(cache, 4 * stride, page));
+    g_assert(!cache_is_cached(cache, 1 * stride));
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(cache_is_cached(cache, 4 * stride));
+
+    /* other sets are untouched */
+    g_assert(!cache_is_cached(cache, CACHE_PAGE_SIZE));
+    g_assert(get_cached_data(cache, CACHE_PAGE_SIZE) == NULL);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_cache_resize(void)
+{
+    PageCache *cache = cache_init(16, CACHE_PAGE_SIZE);
+    uint8_t page[CACHE_PAGE_SIZE];
+    int i;
+
+    memset(page, 0, sizeof(page));
+    for (i = 0; i < 16; i++) {
+        cache_insert(cache, i * CACHE_PAGE_SIZE, page);
+    }
+    g_assert(cache_is_cached(cache, 3 * CACHE_PAGE_SIZE));
+
+    /* shrinking keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 5), ==, 4);
+    g_assert(cache_is_cached(cache, 3 * CACHE_PAGE_SIZE));
+    for (i = 13; i < 16; i++) {
+        g_assert(cache_is_cached(cache, i * CACHE_PAGE_SIZE));
+    }
+    g_assert(!cache_is_cached(cache, 0));
+
+    g_assert_cmpint(cache_resize(cache, 64), ==, 64);
+    g_assert(cache_is_cached(cache, 15 * CACHE_PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+/*
+ * Replay a dirty page trace where most writes hit a hot working set
+ * somewhat larger than a direct-mapped cache could hold without conflicts.
+ */
+static void perf_cache_hit_rate(void)
+{
+    const int cache_pages = 1024, hot_pages = 1024, total_pages = 65536;
+    PageCache *cache = cache_init(cache_pages, CACHE_PAGE_SIZE);
+    uint8_t page[CACHE_PAGE_SIZE];
+    uint64_t hits = 0, lookups = 0;
+    int i;
+
+    memset(page, 0, sizeof(page));
+    for (i = 0; i < 1000000; i++) {
+        uint64_t pfn;
+
+        if (g_test_rand_int_range(0, 10)) {
+            /* hot pages are scattered over guest RAM */
+            pfn = (g_test_rand_int_range(0, hot_pages) * 2654435761u) %
+                  total_pages;
+        } else {
+            pfn = g_test_rand_int_range(0, total_pages);
+        }
+
+        lookups++;
+        if (cache_is_cached(cache, pfn * CACHE_PAGE_SIZE)) {
+            hits++;
+        } else {
+            cache_insert(cache, pfn * CACHE_PAGE_SIZE, page);
+        }
+    }
+
+    g_test_message("cache hit rate: %0.2f%%\n", 100.0 * hits / lookups);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+/* Random pages with runs of changes of various lengths */
+static void xbzrle_make_pages(uint8_t *old_page, uint8_t *new_page,
+                              int max_run)
+{
+    int i, j, changes = g_test_rand_int_range(0, 200);
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_page[i] = g_test_rand_int();
+    }
+    memcpy(new_page, old_page, PAGE_SIZE);
+
+    for (i = 0; i < changes; i++) {
+        int start = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, max_run + 1);
+
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            new_page[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_scalar_equal(void)
+{
+    uint8_t *old_page = g_malloc(PAGE_SIZE);
+    uint8_t *new_page = g_malloc(PAGE_SIZE);
+    uint8_t *scalar = g_malloc(PAGE_SIZE);
+    uint8_t *best = g_malloc(PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        int dlen = i & 1 ? PAGE_SIZE : g_test_rand_int_range(0, PAGE_SIZE);
+        int rc1, rc2;
+
+        xbzrle_make_pages(old_page, new_page, i % 3 ? 8 : 300);
+        rc1 = xbzrle_encode_buffer_scalar(old_page, new_page, PAGE_SIZE,
+                                          scalar, dlen);
+        rc2 = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE, best, dlen);
+        g_assert_cmpint(rc1, ==, rc2);
+        if (rc1 > 0) {
+            g_assert(memcmp(scalar, best, rc1) == 0);
+            g_assert(xbzrle_decode_buffer(best, rc2, old_page,
+                                          PAGE_SIZE) == PAGE_SIZE);
+            g_assert(memcmp(old_page, new_page, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(scalar);
+    g_free(best);
+}
+
+static void perf_encode(int (*encode)(uint8_t *, uint8_t *, int,
+                                      uint8_t *, int),
+                        const char *name, int max_run)
+{
+    const int nr_pages = 256, iterations = 200;
+    uint8_t *old_pages = g_malloc(nr_pages * PAGE_SIZE);
+    uint8_t *new_pages = g_malloc(nr_pages * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double duration;
+    int i, j;
+
+    for (i = 0; i < nr_pages; i++) {
+        xbzrle_make_pages(old_pages + i * PAGE_SIZE,
+                          new_pages + i * PAGE_SIZE, max_run);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < nr_pages; j++) {
+            encode(old_pages + j * PAGE_SIZE, new_pages + j * PAGE_SIZE,
+                   PAGE_SIZE, compressed, PAGE_SIZE);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%s encoder, runs up to %d bytes: %f MB/s\n", name,
+                   max_run, (double)iterations * nr_pages * PAGE_SIZE /
+                   duration / (1024 * 1024));
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(compressed);
+}
+
+static void perf_encode_short_runs(void)
+{
+    perf_encode(xbzrle_encode_buffer_scalar, "scalar", 8);
+    perf_encode(xbzrle_encode_buffer, "best", 8);
+}
+
+static void perf_encode_long_runs(void)
+{
+    perf_encode(xbzrle_encode_buffer_scalar, "scalar", 300);
+    perf_encode(xbzrle_encode_buffer, "best", 300);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +390,14 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_scalar_equal", test_encode_scalar_equal);
+    g_test_add_func("/xbzrle/cache/lru", test_cache_lru);
+    g_test_add_func("/xbzrle/cache/resize", test_cache_resize);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/cache_hit_rate", perf_cache_hit_rate);
+        g_test_add_func("/xbzrle/perf/short_runs", perf_encode_short_runs);
+        g_test_add_func("/xbzrle/perf/long_runs", perf_encode_long_runs);
+    }
 
     return g_test_run();
 }
@@ -0,0 +1,233 @@
+/*
+ * virtio-net dataplane test cases
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
+
+#define VIRTIO_NET_PCI_DEV      4
+
+#define PCI_VENDOR_ID_REDHAT_QUMRANET   0x1af4
+#define PCI_DEVICE_ID_VIRTIO_NET        0x1000
+
+/* legacy virtio-pci registers, MSI-X is left disabled */
+enum {
+    reg_guest_features  = 0x04,
+    reg_queue_pfn       = 0x08,
+    reg_queue_num       = 0x0c,
+    reg_queue_sel       = 0x0e,
+    reg_queue_notify    = 0x10,
+    reg_status          = 0x12,
+};
+
+enum {
+    STATUS_ACK          = 0x1,
+    STATUS_DRIVER       = 0x2,
+    STATUS_DRIVER_OK    = 0x4,
+};
+
+#define TX_QUEUE        1
+#define VRING_ALIGN     4096
+#define VNET_HDR_LEN    10
+
+/* guest memory used by the test, below the default RAM size */
+#define VRING_ADDR      0x100000
+#define PACKET_ADDR     0x110000
+
+#define TIMEOUT_MS      5000
+
+static QPCIBus *pcibus;
+static QPCIDevice *dev;
+static uint16_t io_base;
+static int tap_sock[2];
+static uint16_t vring_num;
+static uint16_t avail_idx;
+
+static uint64_t vring_avail(void)
+{
+    return VRING_ADDR + 16 * vring_num;
+}
+
+static uint64_t vring_used(void)
+{
+    uint64_t addr = vring_avail() + 4 + 2 * vring_num + 2;
+
+    return (addr + VRING_ALIGN - 1) & ~(uint64_t)(VRING_ALIGN - 1);
+}
+
+static void virtio_net_test_start(void)
+{
+    char *cmdline;
+    uint16_t vendor_id, device_id;
+
+    /* A datagram socket stands in for the tap device: each writev() of a
+     * packet shows up as one datagram on the other end.
+     */
+    g_assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, tap_sock) == 0);
+
+    cmdline = g_strdup_printf("-netdev tap,id=hs0,fd=%d "
+                              "-device virtio-net-pci,netdev=hs0,"
+                              "x-data-plane=on,addr=%02x.0",
+                              tap_sock[1], VIRTIO_NET_PCI_DEV);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    close(tap_sock[1]);
+
+    pcibus = qpci_init_pc();
+    dev = qpci_device_find(pcibus, QPCI_DEVFN(VIRTIO_NET_PCI_DEV, 0));
+    g_assert(dev != NULL);
+
+    vendor_id = qpci_config_readw(dev, PCI_VENDOR_ID);
+    device_id = qpci_config_readw(dev, PCI_DEVICE_ID);
+    g_assert_cmphex(vendor_id, ==, PCI_VENDOR_ID_REDHAT_QUMRANET);
+    g_assert_cmphex(device_id, ==, PCI_DEVICE_ID_VIRTIO_NET);
+
+    io_base = (uint16_t)(uintptr_t) qpci_iomap(dev, 0);
+    qpci_device_enable(dev);
+}
+
+static void virtio_net_test_quit(void)
+{
+    g_free(dev);
+    qtest_end();
+    close(tap_sock[0]);
+}
+
+/* Set up the transmit queue and start the device without any features */
+static void virtio_net_driver_init(void)
+{
+    size_t size;
+    void *zero;
+
+    outb(io_base + reg_status, 0);
+    outb(io_base + reg_status, STATUS_ACK);
+    outb(io_base + reg_status, STATUS_ACK | STATUS_DRIVER);
+    outl(io_base + reg_guest_features, 0);
+
+    outw(io_base + reg_queue_sel, TX_QUEUE);
+    vring_num = inw(io_base + reg_queue_num);
+    g_assert_cmpint(vring_num, >, 0);
+
+    size = vring_used() + VRING_ALIGN - VRING_ADDR;
+    zero = g_malloc0(size);
+    memwrite(VRING_ADDR, zero, size);
+    g_free(zero);
+    avail_idx = 0;
+    outl(io_base + reg_queue_pfn, VRING_ADDR / VRING_ALIGN);
+
+    /* This starts the dataplane */
+    outb(io_base + reg_status,
+         STATUS_ACK | STATUS_DRIVER | STATUS_DRIVER_OK);
+}
+
+/* Queue one packet on the transmit queue and wait until it is used */
+static void send_packet(const char *payload)
+{
+    size_t len = strlen(payload);
+    uint64_t buf = PACKET_ADDR + (avail_idx % vring_num) * 0x800;
+    uint64_t desc = VRING_ADDR + 16 * (avail_idx % vring_num);
+    uint8_t hdr[VNET_HDR_LEN] = { 0 };
+    int i;
+
+    memwrite(buf, hdr, sizeof(hdr));
+    memwrite(buf + sizeof(hdr), payload, len);
+
+    writeq(desc, buf);
+    writel(desc + 8, sizeof(hdr) + len);
+    writew(desc + 12, 0);
+    writew(desc + 14, 0);
+
+    writew(vring_avail() + 4 + 2 * (avail_idx % vring_num),
+           avail_idx % vring_num);
+    avail_idx++;
+    writew(vring_avail() + 2, avail_idx);
+    outw(io_base + reg_queue_notify, TX_QUEUE);
+
+    for (i = 0; i < TIMEOUT_MS; i++) {
+        if (readw(vring_used() + 2) == avail_idx) {
+            return;
+        }
+        g_usleep(1000);
+    }
+    g_assert_not_reached();
+}
+
+/* Returns the length of the packet that reached the tap side, -1 if none */
+static ssize_t recv_packet(char *buf, size_t size, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = tap_sock[0], .events = POLLIN };
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+    return recv(tap_sock[0], buf, size, MSG_DONTWAIT);
+}
+
+static void assert_packet(const char *payload)
+{
+    char buf[64];
+    ssize_t len = recv_packet(buf, sizeof(buf), TIMEOUT_MS);
+
+    g_assert_cmpint(len, ==, strlen(payload));
+    g_assert(memcmp(buf, payload, len) == 0);
+}
+
+static void test_link_down(void)
+{
+    char buf[64];
+
+    virtio_net_test_start();
+    virtio_net_driver_init();
+
+    send_packet("link up");
+    assert_packet("link up");
+
+    /* Packets must not reach the tap fd while its link is down, so the
+     * running dataplane has to stop rather than keep calling writev().
+     */
+    qmp("{ 'execute': 'set_link',"
+        "  'arguments': { 'name': 'hs0', 'up': false } }");
+    send_packet("link down");
+    g_assert_cmpint(recv_packet(buf, sizeof(buf), 100), ==, -1);
+
+    qmp("{ 'execute': 'set_link',"
+        "  'arguments': { 'name': 'hs0', 'up': true } }");
+    send_packet("link up again");
+    assert_packet("link up again");
+
+    virtio_net_test_quit();
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    /* Check architecture */
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        g_test_message("Skipping test for non-x86\n");
+        return 0;
+    }
+
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio-net/dataplane/link_down", test_link_down);
+
+    return g_test_run();
+}
@@ -0,0 +1,238 @@
+/*
+ * Zero page and zero buffer detection
+ *
+ * The scan is done with the widest vector instructions that the host
+ * supports, chosen at startup: AVX-512 or AVX2 when the compiler can build
+ * them and the CPU and OS support them, otherwise SSE2, Altivec or plain
+ * longs as selected at compile time.  Buffers may have any alignment and
+ * length; the unaligned head and the tail are checked separately.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+
+#include "qemu/cpuinfo.h"
+
+/* vector definitions */
+#ifdef __ALTIVEC__
+#include <altivec.h>
+/* The altivec.h header says we're allowed to undef these for
+ * C++ compatibility.  Here we don't care about C++, but we
+ * undef them anyway to avoid namespace pollution.
+ */
+#undef vector
+#undef pixel
+#undef bool
+#define VECTYPE        __vector unsigned char
+#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
+/* altivec.h may redefine the bool macro as vector type.
+ * Reset it to POSIX semantics. */
+#define bool _Bool
+#elif defined __SSE2__
+#include <emmintrin.h>
+#define VECTYPE        __m128i
+#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
+#else
+#define VECTYPE        unsigned long
+#define ALL_EQ(v1, v2) ((v1) == (v2))
+#endif
+
+/* Vectors that are or'ed together before each test */
+#define BUFFER_ZERO_UNROLL 8
+
+typedef size_t BufferFindNonzeroFunc(const uint8_t *buf, size_t len);
+
+/*
+ * Byte and long based scan, used on its own for short buffers and by the
+ * vector versions for the unaligned head, the tail, and to find the exact
+ * byte in a block that is not zero.
+ */
+static size_t buffer_find_nonzero_scalar(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && ((uintptr_t)(buf + i) % sizeof(long))) {
+        if (buf[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    for (; i + 4 * sizeof(long) <= len; i += 4 * sizeof(long)) {
+        const long *p = (const long *)(buf + i);
+
+        if (p[0] | p[1] | p[2] | p[3]) {
+            break;
+        }
+    }
+
+    for (; i < len; i++) {
+        if (buf[i]) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+static size_t buffer_find_nonzero_vector(const uint8_t *buf, size_t len)
+{
+    const size_t step = BUFFER_ZERO_UNROLL * sizeof(VECTYPE);
+    const VECTYPE zero = (VECTYPE){0};
+    size_t i, head;
+
+    head = ROUND_UP((uintptr_t)buf, sizeof(VECTYPE)) - (uintptr_t)buf;
+    if (len < head + step) {
+        return buffer_find_nonzero_scalar(buf, len);
+    }
+
+    i = buffer_find_nonzero_scalar(buf, head);
+    if (i < head) {
+        return i;
+    }
+
+    for (; i + step <= len; i += step) {
+        const VECTYPE *p = (const VECTYPE *)(buf + i);
+        VECTYPE tmp0 = p[0] | p[1];
+        VECTYPE tmp1 = p[2] | p[3];
+        VECTYPE tmp2 = p[4] | p[5];
+        VECTYPE tmp3 = p[6] | p[7];
+        VECTYPE tmp01 = tmp0 | tmp1;
+        VECTYPE tmp23 = tmp2 | tmp3;
+        if (!ALL_EQ(tmp01 | tmp23, zero)) {
+            break;
+        }
+    }
+
+    return i + buffer_find_nonzero_scalar(buf + i, len - i);
+}
+
+static BufferFindNonzeroFunc *buffer_find_nonzero_func =
+    buffer_find_nonzero_vector;
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_avx2(const uint8_t *buf, size_t len)
+{
+    size_t i, head;
+
+    head = ROUND_UP((uintptr_t)buf, 32) - (uintptr_t)buf;
+    if (len < head + 4 * 32) {
+        return buffer_find_nonzero_scalar(buf, len);
+    }
+
+    i = buffer_find_nonzero_scalar(buf, head);
+    if (i < head) {
+        return i;
+    }
+
+    for (; i + 4 * 32 <= len; i += 4 * 32) {
+        const __m256i *p = (const __m256i *)(buf + i);
+        __m256i tmp = _mm256_or_si256(_mm256_or_si256(p[0], p[1]),
+                                      _mm256_or_si256(p[2], p[3]));
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i + buffer_find_nonzero_scalar(buf + i, len - i);
+}
+
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static size_t buffer_find_nonzero_avx512f(const uint8_t *buf, size_t len)
+{
+    size_t i, head;
+
+    head = ROUND_UP((uintptr_t)buf, 64) - (uintptr_t)buf;
+    if (len < head + 4 * 64) {
+        return buffer_find_nonzero_scalar(buf, len);
+    }
+
+    i = buffer_find_nonzero_scalar(buf, head);
+    if (i < head) {
+        return i;
+    }
+
+    for (; i + 4 * 64 <= len; i += 4 * 64) {
+        const __m512i *p = (const __m512i *)(buf + i);
+        __m512i tmp = _mm512_or_si512(_mm512_or_si512(p[0], p[1]),
+                                      _mm512_or_si512(p[2], p[3]));
+        if (_mm512_test_epi64_mask(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i + buffer_find_nonzero_scalar(buf + i, len - i);
+}
+
+#pragma GCC pop_options
+#endif
+
+static void __attribute__((constructor)) init_buffer_find_nonzero(void)
+{
+    unsigned int info = cpuinfo_get();
+
+    if (info & CPUINFO_AVX2) {
+        buffer_find_nonzero_func = buffer_find_nonzero_avx2;
+    }
+#ifdef CONFIG_AVX512F_OPT
+    if (info & CPUINFO_AVX512F) {
+        buffer_find_nonzero_func = buffer_find_nonzero_avx512f;
+    }
+#endif
+}
+#endif
+
+/*
+ * Returns the offset of the first non-zero byte in the buffer, or len if
+ * the buffer is all zero.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    return buffer_find_nonzero_func(buf, len);
+}
+
+/*
+ * Splits the buffer into blocks of run bytes (the last one may be shorter)
+ * and returns the offset of the first one that is all zero, or len if there
+ * is none.  Non-zero blocks usually are found to be so in their first few
+ * bytes, so this is not much slower than a single pass over the buffer.
+ */
+size_t buffer_find_zero_run(const void *buf, size_t len, size_t run)
+{
+    const uint8_t *p = buf;
+    size_t i, n;
+
+    assert(run > 0);
+
+    for (i = 0; i < len; i += n) {
+        n = MIN(run, len - i);
+        if (buffer_find_nonzero_func(p + i, n) == n) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_find_nonzero_func(buf, len) == len;
+}
@@ -0,0 +1,79 @@
+/*
+ * Host CPU feature detection
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/cpuinfo.h"
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+
+#ifndef bit_AVX
+#define bit_AVX (1 << 28)
+#endif
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+/* XCR0 bits for the SSE, AVX and AVX-512 register state */
+#define XCR0_YMM    0x06
+#define XCR0_ZMM    0xe0
+
+static unsigned int cpuinfo_probe(void)
+{
+    unsigned int a, b, c, d, info = 0;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if ((c & (bit_OSXSAVE | bit_AVX)) != (bit_OSXSAVE | bit_AVX)) {
+        return 0;
+    }
+
+    /* the OS must be saving the wide registers too */
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & XCR0_YMM) != XCR0_YMM) {
+        return 0;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    if (b & bit_AVX2) {
+        info |= CPUINFO_AVX2;
+    }
+    if ((b & bit_AVX512F) && (xcr0_lo & XCR0_ZMM) == XCR0_ZMM) {
+        info |= CPUINFO_AVX512F;
+    }
+    return info;
+}
+#else
+static unsigned int cpuinfo_probe(void)
+{
+    return 0;
+}
+#endif
+
+unsigned int cpuinfo_get(void)
+{
+    static int info = -1;
+
+    /* racing callers store the same value */
+    if (info < 0) {
+        info = cpuinfo_probe();
+    }
+    return info;
+}
@@ -380,6 +380,23 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
     return iov_memset(qiov->iov, qiov->niov, offset, fillc, bytes);
 }
 
+/*
+ * Checks if all elements of the vector are zero; stops at the first non-zero
+ * byte, so that checking a vector with data in it is cheap.
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (!buffer_is_zero(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
                          size_t bytes)
 {
@@ -12,6 +12,12 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/host-utils.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "qemu/cpuinfo.h"
 
 /*
   page = zrun nzrun
@@ -23,48 +29,101 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/* Returns the length of the run of equal bytes at the start of the buffers */
+typedef int XbzrleScanFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int len);
+
+static int xbzrle_zrun_len(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int len)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
+    int i = 0;
+    long res;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    /* not aligned to sizeof(long) */
+    res = len % sizeof(long);
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
 
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
+    /* word at a time for speed */
+    if (!res) {
+        while (i < len &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
+        /* go over the rest */
+        while (i < len && old_buf[i] == new_buf[i]) {
             i++;
-            res--;
         }
+    }
+
+    return i;
+}
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+/* Returns the length of the run of differing bytes */
+static int xbzrle_nzrun_len(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int len)
+{
+    int i = 0;
+    long res, xor;
+
+    /* not aligned to sizeof(long) */
+    res = len % sizeof(long);
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        long mask = (long)0x0101010101010101ULL;
+        while (i < len) {
+            xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
                 i += sizeof(long);
-                zrun_len += sizeof(long);
             }
+        }
+    }
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
+    return i;
+}
+
+/*
+ * The encoder proper; the vector versions only differ in how they find
+ * the end of each run, so the output is the same whichever is used.
+ */
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                XbzrleScanFunc *zrun_len,
+                                XbzrleScanFunc *nzrun_len)
+{
+    uint32_t zrun, nzrun;
+    int d = 0, i = 0;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
         }
 
+        zrun = zrun_len(old_buf + i, new_buf + i, slen - i);
+        i += zrun;
+
         /* buffer unchanged */
-        if (zrun_len == slen) {
+        if (zrun == slen) {
             return 0;
         }
 
@@ -73,56 +132,186 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return d;
         }
 
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
+        d += uleb128_encode_small(dst + d, zrun);
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
 
-        d += uleb128_encode_small(dst + d, nzrun_len);
+        nzrun = nzrun_len(old_buf + i, new_buf + i, slen - i);
+
+        d += uleb128_encode_small(dst + d, nzrun);
         /* overflow */
-        if (d + nzrun_len > dlen) {
+        if (d + nzrun > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
+        memcpy(dst + d, new_buf + i, nzrun);
+        d += nzrun;
+        i += nzrun;
     }
 
     return d;
 }
 
+int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_len, xbzrle_nzrun_len);
+}
+
+static int (*xbzrle_encode_func)(uint8_t *old_buf, uint8_t *new_buf,
+                                 int slen, uint8_t *dst, int dlen) =
+    xbzrle_encode_buffer_scalar;
+
+/*
+ * The vector scans compare a whole vector at a time and turn the result
+ * into a bit mask, so the end of a run is one count of trailing zeros away.
+ */
+#ifdef __SSE2__
+static inline int xbzrle_zrun_len_sse2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    while (i + 16 <= len) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t diff = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n)) ^ 0xffff;
+
+        if (diff) {
+            return i + ctz32(diff);
+        }
+        i += 16;
+    }
+
+    return i + xbzrle_zrun_len(old_buf + i, new_buf + i, len - i);
+}
+
+static inline int xbzrle_nzrun_len_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    while (i + 16 <= len) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t same = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (same) {
+            return i + ctz32(same);
+        }
+        i += 16;
+    }
+
+    return i + xbzrle_nzrun_len(old_buf + i, new_buf + i, len - i);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_len_sse2, xbzrle_nzrun_len_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline int xbzrle_zrun_len_avx2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    while (i + 32 <= len) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(
+                            _mm256_cmpeq_epi8(o, n));
+
+        if (diff) {
+            return i + ctz32(diff);
+        }
+        i += 32;
+    }
+
+    return i + xbzrle_zrun_len(old_buf + i, new_buf + i, len - i);
+}
+
+static inline int xbzrle_nzrun_len_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    while (i + 32 <= len) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (same) {
+            return i + ctz32(same);
+        }
+        i += 32;
+    }
+
+    return i + xbzrle_nzrun_len(old_buf + i, new_buf + i, len - i);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_len_avx2, xbzrle_nzrun_len_avx2);
+}
+
+#pragma GCC pop_options
+#endif
+
+static void __attribute__((constructor)) init_xbzrle_encoder(void)
+{
+#ifdef __SSE2__
+    xbzrle_encode_func = xbzrle_encode_buffer_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cpuinfo_get() & CPUINFO_AVX2) {
+        xbzrle_encode_func = xbzrle_encode_buffer_avx2;
+    }
+#endif
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_func(old_buf, new_buf, slen, dst, dlen);
+}
+
+/* Most nzruns are a few bytes long, too short to be worth a memcpy call */
+static inline void xbzrle_copy_run(uint8_t *dst, const uint8_t *src,
+                                   uint32_t count)
+{
+    if (count >= 8 && count <= 16) {
+        uint64_t head, tail;
+
+        /* two possibly overlapping words cover the whole run */
+        memcpy(&head, src, 8);
+        memcpy(&tail, src + count - 8, 8);
+        memcpy(dst, &head, 8);
+        memcpy(dst + count - 8, &tail, 8);
+    } else if (count >= 4 && count < 8) {
+        uint32_t head, tail;
+
+        memcpy(&head, src, 4);
+        memcpy(&tail, src + count - 4, 4);
+        memcpy(dst, &head, 4);
+        memcpy(dst + count - 4, &tail, 4);
+    } else {
+        memcpy(dst, src, count);
+    }
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -164,7 +353,7 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        memcpy(dst + d, src + i, count);
+        xbzrle_copy_run(dst + d, src + i, count);
         d += count;
         i += count;
     }